@@ -78,6 +78,24 @@ struct page *get_meta_page(struct f2fs_sb_info *sbi, pgoff_t index) {
 	return page;
 }
 
+/*
+ * Copy the current version of a NAT/SIT block into its other copy and
+ * return that page locked and dirty, ready to be updated by checkpoint.
+ */
+struct page *get_next_meta_page(struct f2fs_sb_info *sbi, pgoff_t src_off,
+								pgoff_t dst_off) {
+	struct page *src_page, *dst_page;
+
+	src_page = get_meta_page(sbi, src_off);
+	dst_page = grab_meta_page(sbi, dst_off);
+	f2fs_bug_on(sbi, PageDirty(src_page));
+
+	memcpy(page_address(dst_page), page_address(src_page), PAGE_CACHE_SIZE);
+	set_page_dirty(dst_page);
+	f2fs_put_page(src_page, 1);
+	return dst_page;
+}
+
 bool is_valid_blkaddr(struct f2fs_sb_info *sbi, block_t blkaddr, int type) {
 	switch (type) {
 		case META_NAT:
@@ -349,6 +367,7 @@ static void __add_ino_entry(struct f2fs_sb_info *sbi, nid_t ino, int type) {
 		im->ino_num++;
 #endif
 	}
+	e->epoch = READ_ONCE(sbi->cp_epoch);
 	spin_unlock(&im->ino_lock);
 	radix_tree_preload_end();
 }
@@ -418,6 +437,9 @@ void release_dirty_inode(struct f2fs_sb_info *sbi) {
 #endif
 				spin_lock(&im->ino_lock);
 				list_for_each_entry_safe(e, tmp, &im->ino_list, list) {
+					/* updated after the freeze, not covered by this CP */
+					if (sbi->cp_committing && e->epoch == sbi->cp_epoch)
+						continue;
 					list_del(&e->list);
 					radix_tree_delete(&im->ino_root, e->ino);
 					kmem_cache_free(ino_entry_slab, e);
@@ -887,20 +909,91 @@ void sync_dirty_dir_inodes(struct f2fs_sb_info *sbi) {
 	goto retry;
 }
 
+#ifdef FILE_CELL
+static void flush_cell_node_pages(struct work_struct *work) {
+	struct node_flush_work *nfw = container_of(work,
+											   struct node_flush_work, work);
+	struct writeback_control wbc = {
+			.sync_mode = WB_SYNC_ALL,
+			.nr_to_write = LONG_MAX,
+			.for_reclaim = 0,
+	};
+	struct blk_plug plug;
+
+	blk_start_plug(&plug);
+	sync_node_pages(nfw->sbi, 0, nfw->cell, &wbc);
+	blk_finish_plug(&plug);
+}
+
+int init_node_flush_works(struct f2fs_sb_info *sbi) {
+	struct max_info *max_i = sbi->max_info;
+	int i;
+
+	max_i->node_flush_works = kcalloc(sbi->node_count,
+									  sizeof(struct node_flush_work),
+									  GFP_KERNEL);
+	if (!max_i->node_flush_works)
+		return -ENOMEM;
+
+	/* unbound, so that the cells are spread over cpus of all NUMA nodes */
+	max_i->node_flush_wq = alloc_workqueue("max_node_flush-%s",
+										   WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+										   sbi->sb->s_id);
+	if (!max_i->node_flush_wq) {
+		kfree(max_i->node_flush_works);
+		max_i->node_flush_works = NULL;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < sbi->node_count; i++) {
+		INIT_WORK(&max_i->node_flush_works[i].work, flush_cell_node_pages);
+		max_i->node_flush_works[i].sbi = sbi;
+		max_i->node_flush_works[i].cell = i;
+	}
+	return 0;
+}
+
+void destroy_node_flush_works(struct f2fs_sb_info *sbi) {
+	struct max_info *max_i = sbi->max_info;
+
+	if (max_i->node_flush_wq)
+		destroy_workqueue(max_i->node_flush_wq);
+	kfree(max_i->node_flush_works);
+	max_i->node_flush_wq = NULL;
+	max_i->node_flush_works = NULL;
+}
+
+/*
+ * Write back the dirty node pages of every file cell in parallel and wait
+ * for all of them, so the time operations stay blocked is about that of
+ * the largest cell instead of the sum over all cells.
+ */
+static void sync_all_node_pages(struct f2fs_sb_info *sbi) {
+	struct max_info *max_i = sbi->max_info;
+	int i;
+
+	for (i = 0; i < sbi->node_count; i++) {
+		if (get_dirty_node_pages(sbi, i))
+			queue_work(max_i->node_flush_wq,
+					   &max_i->node_flush_works[i].work);
+	}
+	flush_workqueue(max_i->node_flush_wq);
+}
+#endif
+
 /*
  * Freeze all the FS-operations for checkpoint.
  */
 static int block_operations(struct f2fs_sb_info *sbi) {
+#ifndef FILE_CELL
 	struct writeback_control wbc = {
 			.sync_mode = WB_SYNC_ALL,
 			.nr_to_write = LONG_MAX,
 			.for_reclaim = 0,
 	};
+#endif
 	struct blk_plug plug;
 	int err = 0;
-#ifdef FILE_CELL
-	int i;
-#endif
 
 	blk_start_plug(&plug);
 	retry_flush_dents:
@@ -922,11 +1015,7 @@ static int block_operations(struct f2fs_sb_info *sbi) {
 	 */
 	retry_flush_nodes:
 #ifdef FILE_CELL
-	for (i = 0; i < sbi->node_count; i++) {
-		if (get_dirty_node_pages(sbi, i)) {
-			sync_node_pages(sbi, 0, i, &wbc);
-		}
-	}
+	sync_all_node_pages(sbi);
 	if (unlikely(f2fs_cp_error(sbi))) {
 		f2fs_unlock_all(sbi);
 		err = -EIO;
@@ -986,7 +1075,7 @@ static void wait_on_all_pages_writeback(struct f2fs_sb_info *sbi) {
 	finish_wait(&sbi->cp_wait, &wait);
 }
 
-static void do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
+static int do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
 	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_WARM_NODE);
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
@@ -1002,6 +1091,7 @@ static void do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	__u32 crc32 = 0;
 	int i;
 	int cp_payload_blks = __cp_payload(sbi);
+	struct blk_plug plug;
 #ifdef MLOG
 	int j;
 #endif
@@ -1010,12 +1100,16 @@ static void do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	 * metapages, so should be called prior to sync_meta_pages below.
 	 */
 	discard_next_dnode(sbi, NEXT_FREE_BLKADDR(sbi, curseg));
-	/* Flush all the NAT/SIT pages */
+	/* Flush all the NAT/SIT pages, as one plugged batch */
+	blk_start_plug(&plug);
 	while (get_pages(sbi, F2FS_DIRTY_META)) {
 		sync_meta_pages(sbi, META, LONG_MAX);
-		if (unlikely(f2fs_cp_error(sbi)))
-			return;
+		if (unlikely(f2fs_cp_error(sbi))) {
+			blk_finish_plug(&plug);
+			return -EIO;
+		}
 	}
+	blk_finish_plug(&plug);
 	next_free_nid(sbi, &last_nid);
 
 	/*
@@ -1024,7 +1118,9 @@ static void do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	 */
 	ckpt->elapsed_time = cpu_to_le64(get_mtime(sbi));
 	ckpt->valid_block_count = cpu_to_le64(valid_user_blocks(sbi));
-	ckpt->free_segment_count = cpu_to_le32(free_segments(sbi));
+	/* frozen prefree segments become free once this pack is committed */
+	ckpt->free_segment_count = cpu_to_le32(free_segments(sbi) +
+				(cpc->epoch ? DIRTY_I(sbi)->nr_frozen_prefree : 0));
 #ifdef MLOG
 	for (i = 0; i < NR_CURSEG_NODE_TYPE; i++) {
 		for (j = 0; j < sbi->nr_mlog; j++) {
@@ -1156,7 +1252,7 @@ static void do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	wait_on_all_pages_writeback(sbi);
 
 	if (unlikely(f2fs_cp_error(sbi)))
-		return;
+		return -EIO;
 
 #ifdef FILE_CELL
 	for (i = 0; i < sbi->node_count; i++)
@@ -1174,20 +1270,43 @@ static void do_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	sbi->last_valid_block_count = sbi->total_valid_block_count;
 	sbi->alloc_valid_block_count = 0;
 #endif
-	
+
+	return 0;
+}
+
+/*
+ * Write the CP pack staged by do_checkpoint() and finish the checkpoint.
+ * For an epoch checkpoint this runs after operations are unblocked, so
+ * only the pack itself is waited on; other in-flight writes belong to the
+ * next epoch.
+ */
+static void commit_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
+	block_t start_blk = __start_cp_addr(sbi);
+	block_t end_blk = start_blk +
+				le32_to_cpu(F2FS_CKPT(sbi)->cp_pack_total_block_count) - 1;
+
 	/* Here, we only have one bio having CP pack */
 	sync_meta_pages(sbi, META_FLUSH, LONG_MAX);
 
 	/* wait for previous submitted meta pages writeback */
-	wait_on_all_pages_writeback(sbi);
+	if (cpc->epoch)
+		filemap_fdatawait_range(META_MAPPING(sbi),
+								(loff_t) start_blk << PAGE_CACHE_SHIFT,
+								((loff_t) (end_blk + 1) << PAGE_CACHE_SHIFT) - 1);
+	else
+		wait_on_all_pages_writeback(sbi);
 
 	release_dirty_inode(sbi);
 
-	if (unlikely(f2fs_cp_error(sbi)))
+	if (unlikely(f2fs_cp_error(sbi))) {
+		if (cpc->epoch)
+			thaw_prefree_segments(sbi);
 		return;
+	}
 
 	clear_prefree_segments(sbi, cpc);
-	clear_sbi_flag(sbi, SBI_IS_DIRTY);
+	if (!cpc->epoch)
+		clear_sbi_flag(sbi, SBI_IS_DIRTY);
 }
 
 /*
@@ -1197,9 +1316,11 @@ void write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
 	unsigned long long ckpt_ver;
 	mutex_lock(&sbi->cp_mutex);
+	/* fstrim issues its discards after the commit, so it never overlaps */
+	cpc->epoch = test_opt(sbi, EPOCH_CP) && cpc->reason != CP_DISCARD;
 	if (!is_sbi_flag_set(sbi, SBI_IS_DIRTY) &&
 		(cpc->reason == CP_FASTBOOT || cpc->reason == CP_SYNC ||
-		 (cpc->reason == CP_DISCARD && !sbi->discard_blks)))
+		 (cpc->reason == CP_DISCARD && !discard_blocks(sbi))))
 		goto out;
 	if (unlikely(f2fs_cp_error(sbi)))
 		goto out;
@@ -1209,6 +1330,7 @@ void write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	if (block_operations(sbi)) // all dirty dir_inode and nodes in page cache are flushed
 		goto out;
 	trace_f2fs_write_checkpoint(sbi->sb, cpc->reason, "finish block_ops");
+	sbi->cp_epoch++;
 
 	// submit queued bio in sbi
 	f2fs_submit_merged_bio(sbi, DATA, WRITE);
@@ -1221,6 +1343,13 @@ void write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	 */
 	ckpt_ver = cur_cp_version(ckpt);
 	ckpt->checkpoint_ver = cpu_to_le64(++ckpt_ver);
+#ifdef MLOG
+	/* recovery merges the warm node chains of several logs by write order */
+	if (sbi->nr_mlog > 1)
+		set_ckpt_flags(ckpt, CP_NODE_SEQ_FLAG);
+	else
+		clear_ckpt_flags(ckpt, CP_NODE_SEQ_FLAG);
+#endif
 	/* write cached NAT/SIT entries to NAT/SIT area */
 #ifdef FILE_CELL
 	flush_nat_entries_per_core(sbi);
@@ -1228,9 +1357,30 @@ void write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	flush_nat_entries(sbi);
 #endif
 	flush_sit_entries(sbi, cpc);
-	/* unlock all the fs_lock[] in do_checkpoint() */
-	do_checkpoint(sbi, cpc);
-	unblock_operations(sbi);
+	if (do_checkpoint(sbi, cpc)) {
+		if (cpc->epoch)
+			thaw_prefree_segments(sbi);
+		unblock_operations(sbi);
+		goto out;
+	}
+#ifdef DIRTY_NODE_INDEX
+	/* node pages are all clean and written; restart exact fsync lists */
+	prune_dirty_node_index(sbi);
+#endif
+	if (cpc->epoch) {
+		/*
+		 * Everything up to the CP pack is on disk; let new operations
+		 * run in the next epoch while the pack is committed.
+		 */
+		clear_sbi_flag(sbi, SBI_IS_DIRTY);
+		WRITE_ONCE(sbi->cp_committing, true);
+		unblock_operations(sbi);
+		commit_checkpoint(sbi, cpc);
+		WRITE_ONCE(sbi->cp_committing, false);
+	} else {
+		commit_checkpoint(sbi, cpc);
+		unblock_operations(sbi);
+	}
 	stat_inc_cp_count(sbi->stat_info);
 
 	if (cpc->reason == CP_RECOVERY)
@@ -1241,6 +1391,18 @@ void write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	trace_f2fs_write_checkpoint(sbi->sb, cpc->reason, "finish checkpoint");
 }
 
+/*
+ * Node pages written while an epoch checkpoint is committed may rely on
+ * state of that checkpoint, e.g. a parent inode it just made checkpointed.
+ * fsync has to wait for the commit before reporting them as durable.
+ */
+void wait_on_checkpoint_commit(struct f2fs_sb_info *sbi) {
+	if (!READ_ONCE(sbi->cp_committing))
+		return;
+	mutex_lock(&sbi->cp_mutex);
+	mutex_unlock(&sbi->cp_mutex);
+}
+
 #ifdef FILE_CELL
 void init_ino_entry_info(struct f2fs_sb_info *sbi) {
 	int i, j;
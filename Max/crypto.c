@@ -36,6 +36,7 @@
 #include <linux/mempool.h>
 #include <linux/module.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
 #include <linux/random.h>
 #include <linux/scatterlist.h>
 #include <linux/spinlock_types.h>
@@ -49,19 +50,29 @@
 /* Encryption added and removed here! (L: */
 
 static unsigned int num_prealloc_crypto_pages = 32;
-static unsigned int num_prealloc_crypto_ctxs = 128;
+static unsigned int num_prealloc_crypto_ctxs = 16;
 
 module_param(num_prealloc_crypto_pages, uint, 0444);
 MODULE_PARM_DESC(num_prealloc_crypto_pages,
 		"Number of crypto pages to preallocate");
 module_param(num_prealloc_crypto_ctxs, uint, 0444);
 MODULE_PARM_DESC(num_prealloc_crypto_ctxs,
-		"Number of crypto contexts to preallocate");
+		"Number of crypto contexts to preallocate per online cpu");
 
 static mempool_t *f2fs_bounce_page_pool;
 
-static LIST_HEAD(f2fs_free_crypto_ctxs);
-static DEFINE_SPINLOCK(f2fs_crypto_ctx_lock);
+/*
+ * The preallocated contexts are spread over per-cpu free lists, and a
+ * context goes back to the list of the cpu releasing it. A cpu whose
+ * list ran dry takes one from another cpu before using the allocator,
+ * since contexts pile up on the cpus running the completions.
+ */
+struct f2fs_crypto_ctx_pool {
+	spinlock_t lock;
+	struct list_head free_ctxs;
+};
+
+static DEFINE_PER_CPU(struct f2fs_crypto_ctx_pool, f2fs_crypto_ctx_pools);
 
 static struct workqueue_struct *f2fs_read_workqueue;
 static DEFINE_MUTEX(crypto_init);
@@ -80,6 +91,7 @@ struct kmem_cache *f2fs_crypt_info_cachep;
  */
 void f2fs_release_crypto_ctx(struct f2fs_crypto_ctx *ctx)
 {
+	struct f2fs_crypto_ctx_pool *pool;
 	unsigned long flags;
 
 	if (ctx->flags & F2FS_WRITE_PATH_FL && ctx->w.bounce_page) {
@@ -90,12 +102,28 @@ void f2fs_release_crypto_ctx(struct f2fs_crypto_ctx *ctx)
 	if (ctx->flags & F2FS_CTX_REQUIRES_FREE_ENCRYPT_FL) {
 		kmem_cache_free(f2fs_crypto_ctx_cachep, ctx);
 	} else {
-		spin_lock_irqsave(&f2fs_crypto_ctx_lock, flags);
-		list_add(&ctx->free_list, &f2fs_free_crypto_ctxs);
-		spin_unlock_irqrestore(&f2fs_crypto_ctx_lock, flags);
+		pool = raw_cpu_ptr(&f2fs_crypto_ctx_pools);
+		spin_lock_irqsave(&pool->lock, flags);
+		list_add(&ctx->free_list, &pool->free_ctxs);
+		spin_unlock_irqrestore(&pool->lock, flags);
 	}
 }
 
+static struct f2fs_crypto_ctx *
+f2fs_pool_get_ctx(struct f2fs_crypto_ctx_pool *pool)
+{
+	struct f2fs_crypto_ctx *ctx;
+	unsigned long flags;
+
+	spin_lock_irqsave(&pool->lock, flags);
+	ctx = list_first_entry_or_null(&pool->free_ctxs,
+					struct f2fs_crypto_ctx, free_list);
+	if (ctx)
+		list_del(&ctx->free_list);
+	spin_unlock_irqrestore(&pool->lock, flags);
+	return ctx;
+}
+
 /**
  * f2fs_get_crypto_ctx() - Gets an encryption context
  * @inode:       The inode for which we are doing the crypto
@@ -108,28 +136,35 @@ void f2fs_release_crypto_ctx(struct f2fs_crypto_ctx *ctx)
 struct f2fs_crypto_ctx *f2fs_get_crypto_ctx(struct inode *inode)
 {
 	struct f2fs_crypto_ctx *ctx = NULL;
-	unsigned long flags;
+	struct f2fs_crypto_ctx_pool *pool;
 	struct f2fs_crypt_info *ci = F2FS_I(inode)->i_crypt_info;
+	int cpu;
 
 	if (ci == NULL)
 		return ERR_PTR(-ENOKEY);
 
 	/*
-	 * We first try getting the ctx from a free list because in
-	 * the common case the ctx will have an allocated and
+	 * We first try getting the ctx from the free list of this cpu
+	 * because in the common case the ctx will have an allocated and
 	 * initialized crypto tfm, so it's probably a worthwhile
-	 * optimization. For the bounce page, we first try getting it
-	 * from the kernel allocator because that's just about as fast
-	 * as getting it from a list and because a cache of free pages
+	 * optimization. An empty list falls back to the lists of other
+	 * cpus, and only then to the allocator. For the bounce page, we first
+	 * try getting it from the kernel allocator because that's just
+	 * about as fast as getting it from a list (mempool_alloc() tries
+	 * the per-cpu page lists first) and because a cache of free pages
 	 * should generally be a "last resort" option for a filesystem
 	 * to be able to do its job.
 	 */
-	spin_lock_irqsave(&f2fs_crypto_ctx_lock, flags);
-	ctx = list_first_entry_or_null(&f2fs_free_crypto_ctxs,
-					struct f2fs_crypto_ctx, free_list);
-	if (ctx)
-		list_del(&ctx->free_list);
-	spin_unlock_irqrestore(&f2fs_crypto_ctx_lock, flags);
+	pool = raw_cpu_ptr(&f2fs_crypto_ctx_pools);
+	ctx = f2fs_pool_get_ctx(pool);
+	if (!ctx) {
+		for_each_possible_cpu(cpu) {
+			ctx = f2fs_pool_get_ctx(
+				per_cpu_ptr(&f2fs_crypto_ctx_pools, cpu));
+			if (ctx)
+				break;
+		}
+	}
 	if (!ctx) {
 		ctx = kmem_cache_zalloc(f2fs_crypto_ctx_cachep, GFP_NOFS);
 		if (!ctx)
@@ -143,28 +178,15 @@ struct f2fs_crypto_ctx *f2fs_get_crypto_ctx(struct inode *inode)
 }
 
 /*
- * Call f2fs_decrypt on every single page, reusing the encryption
- * context.
+ * Decrypt all pages of a read bio, reusing the encryption context.
  */
 static void completion_pages(struct work_struct *work)
 {
 	struct f2fs_crypto_ctx *ctx =
 		container_of(work, struct f2fs_crypto_ctx, r.work);
 	struct bio *bio = ctx->r.bio;
-	struct bio_vec *bv;
-	int i;
 
-	bio_for_each_segment_all(bv, bio, i) {
-		struct page *page = bv->bv_page;
-		int ret = f2fs_decrypt(ctx, page);
-
-		if (ret) {
-			WARN_ON_ONCE(1);
-			SetPageError(page);
-		} else
-			SetPageUptodate(page);
-		unlock_page(page);
-	}
+	f2fs_decrypt_bio(bio);
 	f2fs_release_crypto_ctx(ctx);
 	bio_put(bio);
 }
@@ -178,11 +200,16 @@ void f2fs_end_io_crypto_work(struct f2fs_crypto_ctx *ctx, struct bio *bio)
 
 static void f2fs_crypto_destroy(void)
 {
+	struct f2fs_crypto_ctx_pool *pool;
 	struct f2fs_crypto_ctx *pos, *n;
+	int cpu;
 
-	list_for_each_entry_safe(pos, n, &f2fs_free_crypto_ctxs, free_list)
-		kmem_cache_free(f2fs_crypto_ctx_cachep, pos);
-	INIT_LIST_HEAD(&f2fs_free_crypto_ctxs);
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(&f2fs_crypto_ctx_pools, cpu);
+		list_for_each_entry_safe(pos, n, &pool->free_ctxs, free_list)
+			kmem_cache_free(f2fs_crypto_ctx_cachep, pos);
+		INIT_LIST_HEAD(&pool->free_ctxs);
+	}
 	if (f2fs_bounce_page_pool)
 		mempool_destroy(f2fs_bounce_page_pool);
 	f2fs_bounce_page_pool = NULL;
@@ -198,7 +225,7 @@ static void f2fs_crypto_destroy(void)
  */
 int f2fs_crypto_initialize(void)
 {
-	int i, res = -ENOMEM;
+	int i, nr, cpu = -1, res = -ENOMEM;
 
 	if (f2fs_bounce_page_pool)
 		return 0;
@@ -207,13 +234,19 @@ int f2fs_crypto_initialize(void)
 	if (f2fs_bounce_page_pool)
 		goto already_initialized;
 
-	for (i = 0; i < num_prealloc_crypto_ctxs; i++) {
+	/* nothing else uses the pools yet, so no locking */
+	nr = num_prealloc_crypto_ctxs * num_online_cpus();
+	for (i = 0; i < nr; i++) {
 		struct f2fs_crypto_ctx *ctx;
 
 		ctx = kmem_cache_zalloc(f2fs_crypto_ctx_cachep, GFP_KERNEL);
 		if (!ctx)
 			goto fail;
-		list_add(&ctx->free_list, &f2fs_free_crypto_ctxs);
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_online_mask);
+		list_add(&ctx->free_list,
+			 &per_cpu_ptr(&f2fs_crypto_ctx_pools, cpu)->free_ctxs);
 	}
 
 	/* must be allocated at the last step to avoid race condition above */
@@ -248,9 +281,21 @@ void f2fs_exit_crypto(void)
 
 int __init f2fs_init_crypto(void)
 {
-	int res = -ENOMEM;
+	struct f2fs_crypto_ctx_pool *pool;
+	int cpu, res = -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		pool = per_cpu_ptr(&f2fs_crypto_ctx_pools, cpu);
+		spin_lock_init(&pool->lock);
+		INIT_LIST_HEAD(&pool->free_ctxs);
+	}
 
-	f2fs_read_workqueue = alloc_workqueue("f2fs_crypto", WQ_HIGHPRI, 0);
+	/*
+	 * Read completions arrive on the cpus taking the device interrupts;
+	 * an unbound queue spreads their decryption over all cpus.
+	 */
+	f2fs_read_workqueue = alloc_workqueue("f2fs_crypto",
+					WQ_UNBOUND | WQ_HIGHPRI, 0);
 	if (!f2fs_read_workqueue)
 		goto fail;
 
@@ -471,6 +516,128 @@ int f2fs_decrypt_one(struct inode *inode, struct page *page)
 	return ret;
 }
 
+/* one request of a bio in flight, followed by the tfm request context */
+struct f2fs_bio_crypt_req {
+	struct f2fs_bio_crypt *bc;
+	u8 xts_tweak[F2FS_XTS_TWEAK_SIZE];
+	struct scatterlist sg;
+	int res;
+	struct ablkcipher_request req;
+};
+
+struct f2fs_bio_crypt {
+	atomic_t pending;
+	struct completion done;
+};
+
+static void f2fs_bio_crypt_req_done(struct f2fs_bio_crypt_req *breq, int res)
+{
+	breq->res = res;
+	if (atomic_dec_and_test(&breq->bc->pending))
+		complete(&breq->bc->done);
+}
+
+static void f2fs_bio_crypt_complete(struct crypto_async_request *req, int res)
+{
+	if (res == -EINPROGRESS)
+		return;
+	f2fs_bio_crypt_req_done(req->data, res);
+}
+
+/**
+ * f2fs_decrypt_bio() - Decrypts all pages of a read bio in-place
+ * @bio: The completed read bio. Its pages must be locked.
+ *
+ * Every page gets its own XTS tweak, so each is a separate request, but
+ * all of them are queued on the tfm before waiting once for the whole
+ * bio. Asynchronous and multi-buffer implementations then work on the
+ * pages in parallel instead of one page per round trip.
+ *
+ * Marks each page uptodate or in error, and unlocks it.
+ */
+void f2fs_decrypt_bio(struct bio *bio)
+{
+	struct f2fs_bio_crypt_req **breqs;
+	struct f2fs_bio_crypt bc;
+	struct crypto_ablkcipher *tfm;
+	struct bio_vec *bv;
+	unsigned int size;
+	int i;
+
+	breqs = kcalloc(bio->bi_vcnt, sizeof(*breqs), GFP_NOFS);
+	atomic_set(&bc.pending, 1);
+	init_completion(&bc.done);
+
+	bio_for_each_segment_all(bv, bio, i) {
+		struct page *page = bv->bv_page;
+		struct f2fs_bio_crypt_req *breq;
+		pgoff_t index = page->index;
+		int res;
+
+		/* without the array fall back to a page at a time */
+		if (!breqs) {
+			res = f2fs_decrypt_one(page->mapping->host, page);
+			goto page_done;
+		}
+
+		tfm = F2FS_I(page->mapping->host)->i_crypt_info->ci_ctfm;
+		size = sizeof(*breq) + crypto_ablkcipher_reqsize(tfm);
+		breq = kzalloc(size, GFP_NOFS);
+		if (!breq) {
+			res = -ENOMEM;
+			goto page_done;
+		}
+		breqs[i] = breq;
+		breq->bc = &bc;
+
+		memcpy(breq->xts_tweak, &index, sizeof(index));
+		sg_init_table(&breq->sg, 1);
+		sg_set_page(&breq->sg, page, PAGE_CACHE_SIZE, 0);
+		ablkcipher_request_set_tfm(&breq->req, tfm);
+		ablkcipher_request_set_callback(&breq->req,
+			CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+			f2fs_bio_crypt_complete, breq);
+		ablkcipher_request_set_crypt(&breq->req, &breq->sg, &breq->sg,
+					PAGE_CACHE_SIZE, breq->xts_tweak);
+
+		atomic_inc(&bc.pending);
+		res = crypto_ablkcipher_decrypt(&breq->req);
+		if (res != -EINPROGRESS && res != -EBUSY)
+			f2fs_bio_crypt_req_done(breq, res);
+		continue;
+page_done:
+		if (res) {
+			WARN_ON_ONCE(1);
+			SetPageError(page);
+		} else
+			SetPageUptodate(page);
+		unlock_page(page);
+	}
+
+	if (!atomic_dec_and_test(&bc.pending))
+		wait_for_completion(&bc.done);
+	if (!breqs)
+		return;
+
+	bio_for_each_segment_all(bv, bio, i) {
+		struct page *page = bv->bv_page;
+
+		if (!breqs[i])
+			continue;
+		if (breqs[i]->res) {
+			printk_ratelimited(KERN_ERR
+				"%s: crypto_ablkcipher_decrypt() returned %d\n",
+				__func__, breqs[i]->res);
+			WARN_ON_ONCE(1);
+			SetPageError(page);
+		} else
+			SetPageUptodate(page);
+		unlock_page(page);
+		kzfree(breqs[i]);
+	}
+	kfree(breqs);
+}
+
 bool f2fs_valid_contents_enc_mode(uint32_t mode)
 {
 	return (mode == F2FS_ENCRYPTION_MODE_AES_256_XTS);
@@ -120,6 +120,20 @@ void f2fs_submit_merged_bio(struct f2fs_sb_info *sbi,
 							enum page_type type, int rw) {
 	enum page_type btype = PAGE_TYPE_OF_BIO(type);
 	struct f2fs_bio_info *io;
+#ifdef MLOG
+	int i;
+
+	if (!is_read_io(rw) && btype != META) {
+		/* flush the pending bio of every log */
+		for (i = 0; i < NR_WRITE_IO(sbi, btype); i++) {
+			io = WRITE_IO(sbi, btype, i);
+			down_write(&io->io_rwsem);
+			__submit_merged_bio(io);
+			up_write(&io->io_rwsem);
+		}
+		return;
+	}
+#endif
 	io = is_read_io(rw) ? &sbi->read_io : &sbi->write_io[btype];
 
 	down_write(&io->io_rwsem);
@@ -136,6 +150,18 @@ void f2fs_submit_merged_bio(struct f2fs_sb_info *sbi,
 	up_write(&io->io_rwsem);
 }
 
+#ifdef MLOG
+/* flush the pending write bio of one log only */
+void f2fs_submit_merged_bio_mlog(struct f2fs_sb_info *sbi,
+								 enum page_type type, int mlog) {
+	struct f2fs_bio_info *io = WRITE_IO(sbi, PAGE_TYPE_OF_BIO(type), mlog);
+
+	down_write(&io->io_rwsem);
+	__submit_merged_bio(io);
+	up_write(&io->io_rwsem);
+}
+#endif
+
 /*
  * Fill the locked page with data located in the block address.
  * Return unlocked page.
@@ -166,7 +192,11 @@ void f2fs_submit_page_mbio(struct f2fs_io_info *fio) {
 	struct f2fs_bio_info *io;
 	bool is_read = is_read_io(fio->rw);
 	struct page *bio_page;
+#ifdef MLOG
+	io = is_read ? &sbi->read_io : WRITE_IO(sbi, btype, fio->mlog);
+#else
 	io = is_read ? &sbi->read_io : &sbi->write_io[btype];
+#endif
 
 	verify_block_addr(sbi, fio->blk_addr);
 
@@ -203,6 +233,78 @@ void f2fs_submit_page_mbio(struct f2fs_io_info *fio) {
 
 }
 
+#ifdef MLOG
+
+int init_mlog_write_io(struct f2fs_sb_info *sbi) {
+	struct f2fs_bio_info *array;
+	enum page_type btype;
+	int i;
+
+	for (btype = DATA; btype < META; btype++) {
+		array = kcalloc(sbi->nr_mlog, sizeof(*array), GFP_KERNEL);
+		if (!array) {
+			destroy_mlog_write_io(sbi);
+			return -ENOMEM;
+		}
+		for (i = 0; i < sbi->nr_mlog; i++) {
+			init_rwsem(&array[i].io_rwsem);
+			array[i].sbi = sbi;
+			array[i].bio = NULL;
+		}
+		sbi->mlog_write_io[btype] = array;
+	}
+
+	/*
+	 * One writeback context per log, so that a log is never fed by two
+	 * writers at once; cpus share the contexts round robin.
+	 */
+	sbi->nr_wb_ctxs = sbi->nr_mlog;
+	sbi->wb_ctxs = kcalloc(sbi->nr_wb_ctxs, sizeof(struct f2fs_wb_ctx),
+						   GFP_KERNEL);
+	if (!sbi->wb_ctxs) {
+		destroy_mlog_write_io(sbi);
+		return -ENOMEM;
+	}
+	for (i = 0; i < sbi->nr_wb_ctxs; i++) {
+		mutex_init(&sbi->wb_ctxs[i].lock);
+		sbi->wb_ctxs[i].mlog = i;
+	}
+	return 0;
+}
+
+void destroy_mlog_write_io(struct f2fs_sb_info *sbi) {
+	enum page_type btype;
+
+	for (btype = DATA; btype < META; btype++) {
+		kfree(sbi->mlog_write_io[btype]);
+		sbi->mlog_write_io[btype] = NULL;
+	}
+	kfree(sbi->wb_ctxs);
+	sbi->wb_ctxs = NULL;
+}
+
+#endif
+
+/* the block address changed, forget what the block-map cache holds for it */
+static void f2fs_drop_block_map_entry(struct dnode_of_data *dn) {
+	struct f2fs_inode_info *fi = F2FS_I(dn->inode);
+	struct block_map *bm;
+	pgoff_t index;
+
+	if (!READ_ONCE(fi->i_bmap))
+		return;
+
+	index = start_bidx_of_node(ofs_of_node(dn->node_page), fi) +
+			dn->ofs_in_node;
+	spin_lock(&fi->bmap_lock);
+	bm = fi->i_bmap;
+	if (bm && radix_tree_delete(&bm->root, index)) {
+		bm->nr_entries--;
+		atomic_dec(&F2FS_I_SB(dn->inode)->total_bmap_entries);
+	}
+	spin_unlock(&fi->bmap_lock);
+}
+
 /*
  * Lock ordering for the change of data block address:
  * ->data_page
@@ -223,6 +325,7 @@ void set_data_blkaddr(struct dnode_of_data *dn) {
 	addr_array = blkaddr_in_node(rn);
 	addr_array[ofs_in_node] = cpu_to_le32(dn->data_blkaddr);
 	set_page_dirty(node_page);
+	f2fs_drop_block_map_entry(dn);
 }
 
 int reserve_new_block(struct dnode_of_data *dn) {
@@ -362,9 +465,10 @@ static struct extent_node *__attach_extent_node(struct f2fs_sb_info *sbi,
 		return NULL;
 
 	en->ei = *ei;
+	en->referenced = false;
 	INIT_LIST_HEAD(&en->list);
 
-	rb_link_node(&en->rb_node, parent, p);
+	rb_link_node_rcu(&en->rb_node, parent, p);
 	rb_insert_color(&en->rb_node, &et->root);
 	et->count++;
 	atomic_inc(&sbi->total_ext_node);
@@ -381,18 +485,24 @@ static void __detach_extent_node(struct f2fs_sb_info *sbi,
 		et->cached_en = NULL;
 }
 
+static void __free_extent_tree_rcu(struct rcu_head *head) {
+	kmem_cache_free(extent_tree_slab,
+					container_of(head, struct extent_tree, rcu));
+}
+
 static struct extent_tree *__find_extent_tree(struct f2fs_sb_info *sbi,
 											  nid_t ino) {
+	int shard = EXT_SHARD(ino);
 	struct extent_tree *et;
 
-	down_read(&sbi->extent_tree_lock);
-	et = radix_tree_lookup(&sbi->extent_tree_root, ino);
+	down_read(&sbi->extent_tree_lock[shard]);
+	et = radix_tree_lookup(&sbi->extent_tree_root[shard], ino);
 	if (!et) {
-		up_read(&sbi->extent_tree_lock);
+		up_read(&sbi->extent_tree_lock[shard]);
 		return NULL;
 	}
 	atomic_inc(&et->refcount);
-	up_read(&sbi->extent_tree_lock);
+	up_read(&sbi->extent_tree_lock[shard]);
 
 	return et;
 }
@@ -401,23 +511,26 @@ static struct extent_tree *__grab_extent_tree(struct inode *inode) {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
 	struct extent_tree *et;
 	nid_t ino = inode->i_ino;
+	int shard = EXT_SHARD(ino);
 
-	down_write(&sbi->extent_tree_lock);
-	et = radix_tree_lookup(&sbi->extent_tree_root, ino);
+	down_write(&sbi->extent_tree_lock[shard]);
+	et = radix_tree_lookup(&sbi->extent_tree_root[shard], ino);
 	if (!et) {
 		et = f2fs_kmem_cache_alloc(extent_tree_slab, GFP_NOFS);
-		f2fs_radix_tree_insert(&sbi->extent_tree_root, ino, et);
 		memset(et, 0, sizeof(struct extent_tree));
 		et->ino = ino;
 		et->root = RB_ROOT;
 		et->cached_en = NULL;
 		rwlock_init(&et->lock);
+		seqcount_init(&et->seq);
 		atomic_set(&et->refcount, 0);
 		et->count = 0;
-		sbi->total_ext_tree++;
+		/* lockless lookups may see it as soon as it is inserted */
+		f2fs_radix_tree_insert(&sbi->extent_tree_root[shard], ino, et);
+		atomic_inc(&sbi->total_ext_tree);
 	}
 	atomic_inc(&et->refcount);
-	up_write(&sbi->extent_tree_lock);
+	up_write(&sbi->extent_tree_lock[shard]);
 
 	return et;
 }
@@ -450,6 +563,49 @@ static struct extent_node *__lookup_extent_tree(struct extent_tree *et,
 	return NULL;
 }
 
+/*
+ * Lockless version of __lookup_extent_tree for the read path. Extent nodes
+ * come from a SLAB_DESTROY_BY_RCU cache and every rb-tree update is done
+ * inside et->seq, so a walk that raced with a writer is simply retried.
+ * Caller should hold rcu_read_lock.
+ */
+static struct extent_node *__lookup_extent_tree_rcu(struct extent_tree *et,
+													unsigned int fofs, struct extent_info *ei) {
+	struct extent_node *en, *found;
+	struct rb_node *node;
+	unsigned int seq;
+
+	do {
+		found = NULL;
+		seq = read_seqcount_begin(&et->seq);
+
+		en = READ_ONCE(et->cached_en);
+		if (en && en->ei.fofs <= fofs && en->ei.fofs + en->ei.len > fofs) {
+			*ei = en->ei;
+			found = en;
+			continue;
+		}
+
+		node = READ_ONCE(et->root.rb_node);
+		while (node) {
+			en = rb_entry(node,
+						  struct extent_node, rb_node);
+
+			if (fofs < en->ei.fofs) {
+				node = READ_ONCE(node->rb_left);
+			} else if (fofs >= en->ei.fofs + en->ei.len) {
+				node = READ_ONCE(node->rb_right);
+			} else {
+				*ei = en->ei;
+				found = en;
+				break;
+			}
+		}
+	} while (read_seqcount_retry(&et->seq, seq));
+
+	return found;
+}
+
 static struct extent_node *__try_back_merge(struct f2fs_sb_info *sbi,
 											struct extent_tree *et, struct extent_node *en) {
 	struct extent_node *prev;
@@ -530,6 +686,7 @@ static struct extent_node *__insert_extent_tree(struct f2fs_sb_info *sbi,
 
 static unsigned int __free_extent_tree(struct f2fs_sb_info *sbi,
 									   struct extent_tree *et, bool free_all) {
+	int shard = EXT_SHARD(et->ino);
 	struct rb_node *node, *next;
 	struct extent_node *en;
 	unsigned int count = et->count;
@@ -541,10 +698,10 @@ static unsigned int __free_extent_tree(struct f2fs_sb_info *sbi,
 					  struct extent_node, rb_node);
 
 		if (free_all) {
-			spin_lock(&sbi->extent_lock);
+			spin_lock(&sbi->extent_lock[shard]);
 			if (!list_empty(&en->list))
 				list_del_init(&en->list);
-			spin_unlock(&sbi->extent_lock);
+			spin_unlock(&sbi->extent_lock[shard]);
 		}
 
 		if (free_all || list_empty(&en->list)) {
@@ -560,6 +717,7 @@ static unsigned int __free_extent_tree(struct f2fs_sb_info *sbi,
 static void f2fs_init_extent_tree(struct inode *inode,
 								  struct f2fs_extent *i_ext) {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	int shard = EXT_SHARD(inode->i_ino);
 	struct extent_tree *et;
 	struct extent_node *en;
 	struct extent_info ei;
@@ -576,53 +734,61 @@ static void f2fs_init_extent_tree(struct inode *inode,
 	set_extent_info(&ei, le32_to_cpu(i_ext->fofs),
 					le32_to_cpu(i_ext->blk), le32_to_cpu(i_ext->len));
 
+	write_seqcount_begin(&et->seq);
 	en = __insert_extent_tree(sbi, et, &ei, NULL);
-	if (en) {
+	if (en)
 		et->cached_en = en;
+	write_seqcount_end(&et->seq);
 
-		spin_lock(&sbi->extent_lock);
-		list_add_tail(&en->list, &sbi->extent_list);
-		spin_unlock(&sbi->extent_lock);
+	if (en) {
+		spin_lock(&sbi->extent_lock[shard]);
+		list_add_tail(&en->list, &sbi->extent_list[shard]);
+		spin_unlock(&sbi->extent_lock[shard]);
 	}
 	out:
 	write_unlock(&et->lock);
 	atomic_dec(&et->refcount);
 }
 
+/*
+ * Read path: no shard lock, no et->lock and no lru list lock is taken.
+ * A hit only marks the node referenced; the shrinker gives such nodes a
+ * second pass on the lru list instead of moving them on every lookup.
+ */
 static bool f2fs_lookup_extent_tree(struct inode *inode, pgoff_t pgofs,
 									struct extent_info *ei) {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	nid_t ino = inode->i_ino;
 	struct extent_tree *et;
-	struct extent_node *en;
+	struct extent_node *en = NULL;
 
 	trace_f2fs_lookup_extent_tree_start(inode, pgofs);
 
-	et = __find_extent_tree(sbi, inode->i_ino);
-	if (!et)
+	rcu_read_lock();
+	et = radix_tree_lookup(&sbi->extent_tree_root[EXT_SHARD(ino)], ino);
+	if (!et) {
+		rcu_read_unlock();
 		return false;
+	}
 
-	read_lock(&et->lock);
-	en = __lookup_extent_tree(et, pgofs);
+	en = __lookup_extent_tree_rcu(et, pgofs, ei);
 	if (en) {
-		*ei = en->ei;
-		spin_lock(&sbi->extent_lock);
-		if (!list_empty(&en->list))
-			list_move_tail(&en->list, &sbi->extent_list);
-		spin_unlock(&sbi->extent_lock);
+		if (!READ_ONCE(en->referenced))
+			WRITE_ONCE(en->referenced, true);
 		stat_inc_read_hit(sbi->sb);
 	}
 	stat_inc_total_hit(sbi->sb);
-	read_unlock(&et->lock);
+	rcu_read_unlock();
 
 	trace_f2fs_lookup_extent_tree_end(inode, pgofs, en);
 
-	atomic_dec(&et->refcount);
 	return en ? true : false;
 }
 
 static void f2fs_update_extent_tree(struct inode *inode, pgoff_t fofs,
 									block_t blkaddr) {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	int shard = EXT_SHARD(inode->i_ino);
 	struct extent_tree *et;
 	struct extent_node *en = NULL, *en1 = NULL, *en2 = NULL, *en3 = NULL;
 	struct extent_node *den = NULL;
@@ -634,6 +800,7 @@ static void f2fs_update_extent_tree(struct inode *inode, pgoff_t fofs,
 	et = __grab_extent_tree(inode);
 
 	write_lock(&et->lock);
+	write_seqcount_begin(&et->seq);
 
 	/* 1. lookup and remove existing extent info in cache */
 	en = __lookup_extent_tree(et, fofs);
@@ -667,9 +834,10 @@ static void f2fs_update_extent_tree(struct inode *inode, pgoff_t fofs,
 		set_extent_info(&ei, fofs, blkaddr, 1);
 		en3 = __insert_extent_tree(sbi, et, &ei, &den);
 	}
+	write_seqcount_end(&et->seq);
 
-	/* 4. update in global extent list */
-	spin_lock(&sbi->extent_lock);
+	/* 4. update in the shard extent list */
+	spin_lock(&sbi->extent_lock[shard]);
 	if (en && !list_empty(&en->list))
 		list_del(&en->list);
 	/*
@@ -678,18 +846,18 @@ static void f2fs_update_extent_tree(struct inode *inode, pgoff_t fofs,
 	 * than F2FS_MIN_EXTENT_LEN, we will not add them into extent tree.
 	 */
 	if (en1)
-		list_add_tail(&en1->list, &sbi->extent_list);
+		list_add_tail(&en1->list, &sbi->extent_list[shard]);
 	if (en2)
-		list_add_tail(&en2->list, &sbi->extent_list);
+		list_add_tail(&en2->list, &sbi->extent_list[shard]);
 	if (en3) {
 		if (list_empty(&en3->list))
-			list_add_tail(&en3->list, &sbi->extent_list);
+			list_add_tail(&en3->list, &sbi->extent_list[shard]);
 		else
-			list_move_tail(&en3->list, &sbi->extent_list);
+			list_move_tail(&en3->list, &sbi->extent_list[shard]);
 	}
 	if (den && !list_empty(&den->list))
 		list_del(&den->list);
-	spin_unlock(&sbi->extent_lock);
+	spin_unlock(&sbi->extent_lock[shard]);
 
 	/* 5. release extent node */
 	if (en)
@@ -750,31 +918,36 @@ void f2fs_preserve_extent_tree(struct inode *inode) {
 		update_inode_page(inode);
 }
 
-void f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink) {
+static unsigned int __shrink_extent_shard(struct f2fs_sb_info *sbi, int shard,
+										  int *nr_shrink, unsigned int *tree_cnt) {
 	struct extent_tree *treevec[EXT_TREE_VEC_SIZE];
 	struct extent_node *en, *tmp;
 	unsigned long ino = F2FS_ROOT_INO(sbi);
 	struct radix_tree_iter iter;
 	void **slot;
 	unsigned int found;
-	unsigned int node_cnt = 0, tree_cnt = 0;
-
-	if (!test_opt(sbi, EXTENT_CACHE))
-		return;
-
-	if (available_free_memory(sbi, EXTENT_CACHE))
-		return;
+	unsigned int node_cnt = 0;
+	int nr_scan = *nr_shrink * 2;
+	LIST_HEAD(referenced);
 
-	spin_lock(&sbi->extent_lock);
-	list_for_each_entry_safe(en, tmp, &sbi->extent_list, list) {
-		if (!nr_shrink--)
+	/* referenced nodes get a second chance at the lru tail */
+	spin_lock(&sbi->extent_lock[shard]);
+	list_for_each_entry_safe(en, tmp, &sbi->extent_list[shard], list) {
+		if (!*nr_shrink || !nr_scan--)
 			break;
+		if (en->referenced) {
+			en->referenced = false;
+			list_move_tail(&en->list, &referenced);
+			continue;
+		}
 		list_del_init(&en->list);
+		(*nr_shrink)--;
 	}
-	spin_unlock(&sbi->extent_lock);
+	list_splice_tail(&referenced, &sbi->extent_list[shard]);
+	spin_unlock(&sbi->extent_lock[shard]);
 
-	down_read(&sbi->extent_tree_lock);
-	while ((found = radix_tree_gang_lookup(&sbi->extent_tree_root,
+	down_read(&sbi->extent_tree_lock[shard]);
+	while ((found = radix_tree_gang_lookup(&sbi->extent_tree_root[shard],
 										   (void **) treevec, ino, EXT_TREE_VEC_SIZE))) {
 		unsigned i;
 
@@ -784,32 +957,55 @@ void f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink) {
 
 			atomic_inc(&et->refcount);
 			write_lock(&et->lock);
+			write_seqcount_begin(&et->seq);
 			node_cnt += __free_extent_tree(sbi, et, false);
+			write_seqcount_end(&et->seq);
 			write_unlock(&et->lock);
 			atomic_dec(&et->refcount);
 		}
 	}
-	up_read(&sbi->extent_tree_lock);
+	up_read(&sbi->extent_tree_lock[shard]);
 
-	down_write(&sbi->extent_tree_lock);
-	radix_tree_for_each_slot(slot, &sbi->extent_tree_root, &iter,
+	down_write(&sbi->extent_tree_lock[shard]);
+	radix_tree_for_each_slot(slot, &sbi->extent_tree_root[shard], &iter,
 							 F2FS_ROOT_INO(sbi)) {
 		struct extent_tree *et = (struct extent_tree *) *slot;
 
 		if (!atomic_read(&et->refcount) && !et->count) {
-			radix_tree_delete(&sbi->extent_tree_root, et->ino);
-			kmem_cache_free(extent_tree_slab, et);
-			sbi->total_ext_tree--;
-			tree_cnt++;
+			radix_tree_delete(&sbi->extent_tree_root[shard], et->ino);
+			call_rcu(&et->rcu, __free_extent_tree_rcu);
+			atomic_dec(&sbi->total_ext_tree);
+			(*tree_cnt)++;
 		}
 	}
-	up_write(&sbi->extent_tree_lock);
+	up_write(&sbi->extent_tree_lock[shard]);
+
+	return node_cnt;
+}
+
+void f2fs_shrink_extent_tree(struct f2fs_sb_info *sbi, int nr_shrink) {
+	unsigned int node_cnt = 0, tree_cnt = 0;
+	unsigned int start;
+	int i;
+
+	if (!test_opt(sbi, EXTENT_CACHE))
+		return;
+
+	if (available_free_memory(sbi, EXTENT_CACHE))
+		return;
+
+	/* spread the work over the shards, starting where we stopped last time */
+	start = sbi->ext_shrink_shard++;
+	for (i = 0; i < EXT_TREE_SHARDS && nr_shrink > 0; i++)
+		node_cnt += __shrink_extent_shard(sbi,
+							(start + i) % EXT_TREE_SHARDS, &nr_shrink, &tree_cnt);
 
 	trace_f2fs_shrink_extent_tree(sbi, node_cnt, tree_cnt);
 }
 
 void f2fs_destroy_extent_tree(struct inode *inode) {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	int shard = EXT_SHARD(inode->i_ino);
 	struct extent_tree *et;
 	unsigned int node_cnt = 0;
 
@@ -822,23 +1018,25 @@ void f2fs_destroy_extent_tree(struct inode *inode) {
 
 	/* free all extent info belong to this extent tree */
 	write_lock(&et->lock);
+	write_seqcount_begin(&et->seq);
 	node_cnt = __free_extent_tree(sbi, et, true);
+	write_seqcount_end(&et->seq);
 	write_unlock(&et->lock);
 
 	atomic_dec(&et->refcount);
 
 	/* try to find and delete extent tree entry in radix tree */
-	down_write(&sbi->extent_tree_lock);
-	et = radix_tree_lookup(&sbi->extent_tree_root, inode->i_ino);
+	down_write(&sbi->extent_tree_lock[shard]);
+	et = radix_tree_lookup(&sbi->extent_tree_root[shard], inode->i_ino);
 	if (!et) {
-		up_write(&sbi->extent_tree_lock);
+		up_write(&sbi->extent_tree_lock[shard]);
 		goto out;
 	}
 	f2fs_bug_on(sbi, atomic_read(&et->refcount) || et->count);
-	radix_tree_delete(&sbi->extent_tree_root, inode->i_ino);
-	kmem_cache_free(extent_tree_slab, et);
-	sbi->total_ext_tree--;
-	up_write(&sbi->extent_tree_lock);
+	radix_tree_delete(&sbi->extent_tree_root[shard], inode->i_ino);
+	call_rcu(&et->rcu, __free_extent_tree_rcu);
+	atomic_dec(&sbi->total_ext_tree);
+	up_write(&sbi->extent_tree_lock[shard]);
 	out:
 	trace_f2fs_destroy_extent_tree(inode, node_cnt);
 	return;
@@ -884,6 +1082,187 @@ void f2fs_update_extent_cache(struct dnode_of_data *dn) {
 		sync_inode_page(dn);
 }
 
+/*
+ * Block-map cache (bmap_cache mount option). Entries are block addresses
+ * stored as exceptional radix tree entries, so lookups run under RCU only.
+ * An entry is added and dropped with its dnode page locked, which orders
+ * it against any change of that block address in set_data_blkaddr().
+ */
+#define BMAP_ENTRY(blkaddr)	((void *)(((unsigned long)(blkaddr) << \
+				RADIX_TREE_EXCEPTIONAL_SHIFT) | RADIX_TREE_EXCEPTIONAL_ENTRY))
+#define BMAP_BLKADDR(entry)	((block_t)((unsigned long)(entry) >> \
+				RADIX_TREE_EXCEPTIONAL_SHIFT))
+
+/* small files have their whole map in the inode page already */
+static inline bool bmap_cache_wanted(struct inode *inode) {
+	return test_opt(F2FS_I_SB(inode), BMAP_CACHE) && S_ISREG(inode->i_mode) &&
+		   (i_size_read(inode) >> PAGE_CACHE_SHIFT) >
+		   ADDRS_PER_INODE(F2FS_I(inode));
+}
+
+static bool f2fs_lookup_block_map(struct inode *inode, pgoff_t index,
+								  block_t *blkaddr) {
+	struct block_map *bm;
+	void *entry = NULL;
+
+	rcu_read_lock();
+	bm = rcu_dereference(F2FS_I(inode)->i_bmap);
+	if (bm) {
+		entry = radix_tree_lookup(&bm->root, index);
+		if (entry && !READ_ONCE(bm->referenced))
+			WRITE_ONCE(bm->referenced, true);
+	}
+	rcu_read_unlock();
+
+	if (!entry)
+		return false;
+	*blkaddr = BMAP_BLKADDR(entry);
+	return true;
+}
+
+static struct block_map *grab_block_map(struct inode *inode) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	struct block_map *bm, *new;
+
+	bm = fi->i_bmap;
+	if (bm)
+		return bm;
+	spin_unlock(&fi->bmap_lock);
+	new = kzalloc(sizeof(struct block_map), GFP_NOFS);
+	spin_lock(&fi->bmap_lock);
+	if (!new || fi->i_bmap) {
+		kfree(new);
+		return fi->i_bmap;
+	}
+	INIT_LIST_HEAD(&new->list);
+	new->inode = inode;
+	INIT_RADIX_TREE(&new->root, GFP_ATOMIC | __GFP_NOWARN);
+	rcu_assign_pointer(fi->i_bmap, new);
+	spin_lock(&sbi->bmap_list_lock);
+	list_add_tail(&new->list, &sbi->bmap_list);
+	spin_unlock(&sbi->bmap_list_lock);
+	return new;
+}
+
+/* caller holds the dnode page mapping @index locked */
+static void f2fs_add_block_map(struct inode *inode, pgoff_t index,
+							   block_t blkaddr) {
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	struct block_map *bm;
+
+	if (blkaddr == NULL_ADDR || blkaddr == NEW_ADDR ||
+		!bmap_cache_wanted(inode))
+		return;
+
+	spin_lock(&fi->bmap_lock);
+	bm = grab_block_map(inode);
+	if (bm && !radix_tree_insert(&bm->root, index, BMAP_ENTRY(blkaddr))) {
+		bm->nr_entries++;
+		atomic_inc(&F2FS_I_SB(inode)->total_bmap_entries);
+	}
+	spin_unlock(&fi->bmap_lock);
+}
+
+static struct block_map *detach_block_map(struct f2fs_sb_info *sbi,
+										  struct f2fs_inode_info *fi) {
+	struct block_map *bm = fi->i_bmap;
+
+	if (!bm)
+		return NULL;
+	RCU_INIT_POINTER(fi->i_bmap, NULL);
+	spin_lock(&sbi->bmap_list_lock);
+	list_del(&bm->list);
+	spin_unlock(&sbi->bmap_list_lock);
+	return bm;
+}
+
+/* readers may still walk a detached map, so nodes and map go via RCU */
+static void free_block_map(struct f2fs_sb_info *sbi, struct block_map *bm) {
+	struct radix_tree_iter iter;
+	void **slot;
+
+	rcu_read_lock();
+	radix_tree_for_each_slot(slot, &bm->root, &iter, 0)
+		radix_tree_delete(&bm->root, iter.index);
+	rcu_read_unlock();
+	atomic_sub(bm->nr_entries, &sbi->total_bmap_entries);
+	kfree_rcu(bm, rcu);
+}
+
+void f2fs_drop_block_map(struct inode *inode) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	struct block_map *bm;
+
+	spin_lock(&fi->bmap_lock);
+	bm = detach_block_map(sbi, fi);
+	spin_unlock(&fi->bmap_lock);
+
+	if (bm)
+		free_block_map(sbi, bm);
+}
+
+/* CLOCK reclaim of whole maps, the same way as f2fs_shrink_dir_index() */
+void f2fs_shrink_block_map(struct f2fs_sb_info *sbi, int nr_shrink) {
+	struct f2fs_inode_info *fi;
+	struct block_map *bm;
+	LIST_HEAD(victims);
+	int scanned = 0;
+
+	if (available_free_memory(sbi, BMAP_CACHE))
+		return;
+
+	spin_lock(&sbi->bmap_list_lock);
+	while (nr_shrink > 0 && !list_empty(&sbi->bmap_list) &&
+		   scanned++ < BMAP_CACHE_SHRINK_NUMBER) {
+		bm = list_first_entry(&sbi->bmap_list, struct block_map, list);
+		fi = F2FS_I(bm->inode);
+		if (bm->referenced || !spin_trylock(&fi->bmap_lock)) {
+			bm->referenced = false;
+			list_move_tail(&bm->list, &sbi->bmap_list);
+			continue;
+		}
+		RCU_INIT_POINTER(fi->i_bmap, NULL);
+		list_move_tail(&bm->list, &victims);
+		spin_unlock(&fi->bmap_lock);
+		nr_shrink -= bm->nr_entries;
+	}
+	spin_unlock(&sbi->bmap_list_lock);
+
+	while (!list_empty(&victims)) {
+		bm = list_first_entry(&victims, struct block_map, list);
+		list_del(&bm->list);
+		free_block_map(sbi, bm);
+	}
+}
+
+/*
+ * Read the node blocks mapping a readahead batch whose offsets neither
+ * cache resolves, so their dnode paths are read a level at a time in
+ * parallel instead of one dependent read after another per page.
+ */
+static void f2fs_ra_block_map(struct inode *inode, struct list_head *pages) {
+	pgoff_t index[RA_DNODE_BATCH];
+	struct extent_info ei;
+	struct page *page;
+	block_t blkaddr;
+	int nr = 0;
+
+	list_for_each_entry_reverse(page, pages, lru) {
+		if (f2fs_lookup_extent_cache(inode, page->index, &ei) ||
+			f2fs_lookup_block_map(inode, page->index, &blkaddr))
+			continue;
+		index[nr++] = page->index;
+		if (nr == RA_DNODE_BATCH) {
+			ra_dnode_paths(inode, index, nr);
+			nr = 0;
+		}
+	}
+	if (nr)
+		ra_dnode_paths(inode, index, nr);
+}
+
 struct page *get_read_data_page(struct inode *inode, pgoff_t index, int rw) {
 	struct address_space *mapping = inode->i_mapping;
 	struct dnode_of_data dn;
@@ -1092,6 +1471,68 @@ static int __allocate_data_block(struct dnode_of_data *dn) {
 	return 0;
 }
 
+/*
+ * Allocate the run of unallocated slots starting at dn->ofs_in_node, at
+ * most max_blocks long and inside the dnode, through allocate_data_blocks
+ * so that the run gets consecutive addresses with one curseg_mutex hold
+ * per segment. Returns the # of slots covered or an error.
+ */
+static int __allocate_data_run(struct dnode_of_data *dn, u64 max_blocks) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(dn->inode);
+	struct f2fs_inode_info *fi = F2FS_I(dn->inode);
+	unsigned int end_offset = ADDRS_PER_PAGE(dn->node_page, fi);
+	unsigned int ofs = dn->ofs_in_node;
+	unsigned int nr = 0, nr_new = 0, done = 0, allocated, i;
+	struct f2fs_summary sum;
+	struct node_info ni;
+	int seg = CURSEG_WARM_DATA;
+	block_t blkaddr;
+	pgoff_t fofs;
+
+	if (unlikely(is_inode_flag_set(fi, FI_NO_ALLOC)))
+		return -EPERM;
+
+	while (ofs + nr < end_offset && nr < max_blocks) {
+		blkaddr = datablock_addr(dn->node_page, ofs + nr);
+		if (blkaddr == NEW_ADDR)
+			nr_new++;
+		else if (blkaddr != NULL_ADDR)
+			break;
+		nr++;
+	}
+
+	/* NEW_ADDR slots were already counted by reserve_new_block */
+	if (unlikely(!inc_valid_block_count(sbi, dn->inode, nr - nr_new)))
+		return -ENOSPC;
+
+	get_node_info(sbi, dn->nid, &ni);
+
+	if (ofs == 0 && dn->inode_page == dn->node_page)
+		seg = CURSEG_DIRECT_IO;
+
+	while (done < nr) {
+		set_summary(&sum, dn->nid, ofs + done, ni.version);
+		allocated = allocate_data_blocks(sbi, &sum, nr - done, &blkaddr, seg);
+
+		/* direct IO doesn't use extent cache to maximize the performance */
+		for (i = 0; i < allocated; i++) {
+			dn->ofs_in_node = ofs + done + i;
+			dn->data_blkaddr = blkaddr + i;
+			set_data_blkaddr(dn);
+		}
+		done += allocated;
+		seg = CURSEG_WARM_DATA;
+	}
+	dn->ofs_in_node = ofs;
+
+	/* update i_size */
+	fofs = start_bidx_of_node(ofs_of_node(dn->node_page), fi) + ofs + nr;
+	if (i_size_read(dn->inode) < (fofs << PAGE_CACHE_SHIFT))
+		i_size_write(dn->inode, (fofs << PAGE_CACHE_SHIFT));
+
+	return nr;
+}
+
 static void __allocate_data_blocks(struct inode *inode, loff_t offset,
 								   size_t count) {
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
@@ -1115,16 +1556,18 @@ static void __allocate_data_blocks(struct inode *inode, loff_t offset,
 
 		while (dn.ofs_in_node < end_offset && len) {
 			block_t blkaddr;
+			int nr = 1;
 
 			blkaddr = datablock_addr(dn.node_page, dn.ofs_in_node);
 			if (blkaddr == NULL_ADDR || blkaddr == NEW_ADDR) {
-				if (__allocate_data_block(&dn))
+				nr = __allocate_data_run(&dn, len);
+				if (nr < 0)
 					goto sync_out;
 				allocated = true;
 			}
-			len--;
-			start++;
-			dn.ofs_in_node++;
+			len -= nr;
+			start += nr;
+			dn.ofs_in_node += nr;
 		}
 
 		if (allocated)
@@ -1176,6 +1619,12 @@ static int f2fs_map_blocks(struct inode *inode, struct f2fs_map_blocks *map,
 		goto out;
 	}
 
+	if (!create && f2fs_lookup_block_map(inode, pgofs, &map->m_pblk)) {
+		map->m_len = 1;
+		map->m_flags = F2FS_MAP_MAPPED;
+		goto out;
+	}
+
 	if (create)
 		f2fs_lock_op(F2FS_I_SB(inode));
 
@@ -1195,6 +1644,8 @@ static int f2fs_map_blocks(struct inode *inode, struct f2fs_map_blocks *map,
 		map->m_pblk = dn.data_blkaddr;
 		if (dn.data_blkaddr == NEW_ADDR)
 			map->m_flags |= F2FS_MAP_UNWRITTEN;
+		else if (!create)
+			f2fs_add_block_map(inode, pgofs, dn.data_blkaddr);
 	} else if (create) {
 		err = __allocate_data_block(&dn);
 		if (err)
@@ -1428,6 +1879,9 @@ static int f2fs_mpage_readpages(struct address_space *mapping,
 	map.m_len = 0;
 	map.m_flags = 0;
 
+	if (pages && nr_pages > 1 && bmap_cache_wanted(inode))
+		f2fs_ra_block_map(inode, pages);
+
 	for (page_idx = 0; nr_pages; page_idx++, nr_pages--) {
 
 		prefetchw(&page->flags);
@@ -1633,8 +2087,13 @@ int do_write_data_page(struct f2fs_io_info *fio) {
 	return err;
 }
 
+#ifdef MLOG
+static int __write_data_page(struct page *page, struct writeback_control *wbc,
+							 struct f2fs_wb_ctx *ctx) {
+#else
 static int f2fs_write_data_page(struct page *page,
 								struct writeback_control *wbc) {
+#endif
 	struct inode *inode = page->mapping->host;
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
 	loff_t i_size = i_size_read(inode);
@@ -1649,6 +2108,10 @@ static int f2fs_write_data_page(struct page *page,
 			.rw = (wbc->sync_mode == WB_SYNC_ALL) ? WRITE_SYNC : WRITE,
 			.page = page,
 			.encrypted_page = NULL,
+#ifdef MLOG
+			.mlog = ctx ? ctx->mlog : 0,
+			.wb_ctx = ctx,
+#endif
 	};
 
 	trace_f2fs_writepage(page, DATA);
@@ -1722,6 +2185,29 @@ static int f2fs_write_data_page(struct page *page,
 	return AOP_WRITEPAGE_ACTIVATE;
 }
 
+#ifdef MLOG
+static int f2fs_write_data_page(struct page *page,
+								struct writeback_control *wbc) {
+	return __write_data_page(page, wbc, NULL);
+}
+
+static int __f2fs_writepage(struct page *page, struct writeback_control *wbc,
+							void *data) {
+	struct address_space *mapping = page->mapping;
+	int ret = __write_data_page(page, wbc, data);
+	mapping_set_error(mapping, ret);
+	return ret;
+}
+
+/*
+ * Regular files are written back under the context of the current cpu.
+ * Under the default per_cpu policy the context allocates all their pages
+ * from its own log; writers using other contexts proceed in parallel.
+ */
+static struct f2fs_wb_ctx *writeback_ctx(struct f2fs_sb_info *sbi) {
+	return &sbi->wb_ctxs[raw_smp_processor_id() % sbi->nr_wb_ctxs];
+}
+#else
 static int __f2fs_writepage(struct page *page, struct writeback_control *wbc,
 							void *data) {
 	struct address_space *mapping = data;
@@ -1729,12 +2215,18 @@ static int __f2fs_writepage(struct page *page, struct writeback_control *wbc,
 	mapping_set_error(mapping, ret);
 	return ret;
 }
+#endif
 
 static int f2fs_write_data_pages(struct address_space *mapping,
 								 struct writeback_control *wbc) {
 	struct inode *inode = mapping->host;
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+#ifdef MLOG
+	struct f2fs_wb_ctx *ctx = NULL;
+	bool bound = false;
+#else
 	bool locked = false;
+#endif
 	int ret;
 	long diff;
 	trace_f2fs_writepages(mapping->host, wbc, DATA);
@@ -1753,6 +2245,24 @@ static int f2fs_write_data_pages(struct address_space *mapping,
 		goto skip_write;
 
 	diff = nr_pages_to_write(sbi, DATA, wbc); // SYNC_ALL:0;SYNC_NONE:DATA4096
+#ifdef MLOG
+	if (!S_ISDIR(inode->i_mode)) {
+		ctx = writeback_ctx(sbi);
+		mutex_lock(&ctx->lock);
+		/* other policies place every page themselves */
+		bound = READ_ONCE(sbi->mlog_policy) == MLOG_PER_CPU;
+	}
+	ret = write_cache_pages(mapping, wbc, __f2fs_writepage,
+							bound ? ctx : NULL);
+
+	/* the pages of a bound context all went to its log */
+	if (bound)
+		f2fs_submit_merged_bio_mlog(sbi, DATA, ctx->mlog);
+	else
+		f2fs_submit_merged_bio(sbi, DATA, WRITE);
+	if (ctx)
+		mutex_unlock(&ctx->lock);
+#else
 	if (!S_ISDIR(inode->i_mode)) {
 		mutex_lock(&sbi->writepages);
 		locked = true;
@@ -1763,6 +2273,7 @@ static int f2fs_write_data_pages(struct address_space *mapping,
 		mutex_unlock(&sbi->writepages);
 	}
 	f2fs_submit_merged_bio(sbi, DATA, WRITE);
+#endif
 
 	remove_dirty_dir_inode(inode);
 	wbc->nr_to_write = max((long) 0, wbc->nr_to_write - diff);
@@ -2048,11 +2559,16 @@ static sector_t f2fs_bmap(struct address_space *mapping, sector_t block) {
 }
 
 void init_extent_cache_info(struct f2fs_sb_info *sbi) {
-	INIT_RADIX_TREE(&sbi->extent_tree_root, GFP_NOIO);
-	init_rwsem(&sbi->extent_tree_lock);
-	INIT_LIST_HEAD(&sbi->extent_list);
-	spin_lock_init(&sbi->extent_lock);
-	sbi->total_ext_tree = 0;
+	int i;
+
+	for (i = 0; i < EXT_TREE_SHARDS; i++) {
+		INIT_RADIX_TREE(&sbi->extent_tree_root[i], GFP_NOIO);
+		init_rwsem(&sbi->extent_tree_lock[i]);
+		INIT_LIST_HEAD(&sbi->extent_list[i]);
+		spin_lock_init(&sbi->extent_lock[i]);
+	}
+	sbi->ext_shrink_shard = 0;
+	atomic_set(&sbi->total_ext_tree, 0);
 	atomic_set(&sbi->total_ext_node, 0);
 }
 
@@ -2063,8 +2579,10 @@ create_extent_cache(void) {
 											  sizeof(struct extent_tree));
 	if (!extent_tree_slab)
 		return -ENOMEM;
-	extent_node_slab = f2fs_kmem_cache_create("f2fs_extent_node",
-											  sizeof(struct extent_node));
+	/* nodes stay type-stable for lockless lookups, see __lookup_extent_tree_rcu */
+	extent_node_slab = kmem_cache_create("f2fs_extent_node",
+										 sizeof(struct extent_node), 0,
+										 SLAB_RECLAIM_ACCOUNT | SLAB_DESTROY_BY_RCU, NULL);
 	if (!extent_node_slab) {
 		kmem_cache_destroy(extent_tree_slab);
 		return -ENOMEM;
@@ -2073,6 +2591,8 @@ create_extent_cache(void) {
 }
 
 void destroy_extent_cache(void) {
+	/* wait for extent trees freed by call_rcu */
+	rcu_barrier();
 	kmem_cache_destroy(extent_node_slab);
 	kmem_cache_destroy(extent_tree_slab);
 }
@@ -27,6 +27,41 @@ static LIST_HEAD(f2fs_stat_list);
 static struct dentry *f2fs_debugfs_root;
 static DEFINE_MUTEX(f2fs_stat_mutex);
 
+static const char *gc_decision_name[] = {
+		[GC_DECIDE_NONE] = "none",
+		[GC_DECIDE_RUN] = "run",
+		[GC_DECIDE_BUSY] = "busy",
+		[GC_DECIDE_NO_VICTIM] = "no victim",
+		[GC_DECIDE_FROZEN] = "frozen",
+};
+
+static void show_gc_sched(struct seq_file *s, struct f2fs_sb_info *sbi) {
+	struct f2fs_gc_kthread *gc_th = sbi->gc_thread;
+
+	if (!gc_th)
+		return;
+
+	spin_lock(&gc_th->sched_lock);
+	seq_printf(s, "BG GC scheduler: %s\n",
+			   gc_th->gc_sched == GC_SCHED_ADAPTIVE ? "adaptive" : "legacy");
+	seq_printf(s, "  - alloc rate: %u secs/1000s, ", gc_th->alloc_rate);
+	if (gc_th->runway == GC_RUNWAY_INFINITE)
+		seq_puts(s, "runway: inf\n");
+	else
+		seq_printf(s, "runway: %us\n", gc_th->runway);
+	seq_printf(s, "  - urgency: %u/%u, wb: %u (busy > %u)\n",
+			   gc_th->urgency, GC_URGENCY_SCALE, gc_th->wb_pages,
+			   gc_th->busy_wb_pages);
+	seq_printf(s, "  - last: %s, run: %llu, busy: %llu, "
+			   "no victim: %llu, frozen: %llu\n",
+			   gc_decision_name[gc_th->decision],
+			   gc_th->nr_decisions[GC_DECIDE_RUN],
+			   gc_th->nr_decisions[GC_DECIDE_BUSY],
+			   gc_th->nr_decisions[GC_DECIDE_NO_VICTIM],
+			   gc_th->nr_decisions[GC_DECIDE_FROZEN]);
+	spin_unlock(&gc_th->sched_lock);
+}
+
 static void update_general_status(struct f2fs_sb_info *sbi) {
 	struct f2fs_stat_info *si = F2FS_STAT(sbi);
 	int i;
@@ -34,7 +69,7 @@ static void update_general_status(struct f2fs_sb_info *sbi) {
 	/* validation check of the segment numbers */
 	si->hit_ext = sbi->read_hit_ext;
 	si->total_ext = sbi->total_hit_ext;
-	si->ext_tree = sbi->total_ext_tree;
+	si->ext_tree = atomic_read(&sbi->total_ext_tree);
 	si->ext_node = atomic_read(&sbi->total_ext_node);
 #ifdef FILE_CELL
 	for (i = 0; i < sbi->node_count; ++i) {
@@ -174,6 +209,8 @@ static void update_mem_info(struct f2fs_sb_info *sbi) {
 	si->base_mem += sizeof(struct dirty_seglist_info);
 	si->base_mem += NR_DIRTY_TYPE * f2fs_bitmap_size(MAIN_SEGS(sbi));
 	si->base_mem += f2fs_bitmap_size(MAIN_SECS(sbi));
+	si->base_mem += NR_GC_BUCKETS * f2fs_bitmap_size(MAIN_SECS(sbi));
+	si->base_mem += MAIN_SECS(sbi);
 
 	/* build nm */
 	si->base_mem += sizeof(struct f2fs_nm_info);
@@ -195,7 +232,9 @@ static void update_mem_info(struct f2fs_sb_info *sbi) {
 
 	/* build merge flush thread */
 	if (SM_I(sbi)->cmd_control_info)
-		si->cache_mem += sizeof(struct flush_cmd_control);
+		si->cache_mem += sizeof(struct flush_cmd_control) +
+				SM_I(sbi)->cmd_control_info->nr_queues *
+				sizeof(struct flush_cmd_queue);
 
 	/* free nids */
 	si->cache_mem += NM_I(sbi)->fcnt * sizeof(struct free_nid);
@@ -212,7 +251,7 @@ static void update_mem_info(struct f2fs_sb_info *sbi) {
 	for (i = 0; i <= UPDATE_INO; i++)
 		si->cache_mem += sbi->im[i].ino_num * sizeof(struct ino_entry);
 #endif
-	si->cache_mem += sbi->total_ext_tree * sizeof(struct extent_tree);
+	si->cache_mem += atomic_read(&sbi->total_ext_tree) * sizeof(struct extent_tree);
 	si->cache_mem += atomic_read(&sbi->total_ext_node) *
 					 sizeof(struct extent_node);
 
@@ -305,6 +344,7 @@ static int stat_show(struct seq_file *s, void *v) {
 				   si->bg_data_blks);
 		seq_printf(s, "  - node blocks : %d (%d)\n", si->node_blks,
 				   si->bg_node_blks);
+		show_gc_sched(s, si->sbi);
 		seq_printf(s, "\nExtent Hit Ratio: %d / %d\n",
 				   si->hit_ext, si->total_ext);
 		seq_printf(s, "\nExtent Tree Count: %d\n", si->ext_tree);
@@ -9,6 +9,8 @@
  * published by the Free Software Foundation.
  */
 #include <linux/fs.h>
+#include <linux/hash.h>
+#include <linux/vmalloc.h>
 #include "max_fs.h"
 #include "f2fs.h"
 #include "node.h"
@@ -34,6 +36,30 @@ static unsigned int bucket_blocks(unsigned int level) {
 		return 4;
 }
 
+/*
+ * Issue the reads of every block in a hash bucket before scanning it, so
+ * the i_mutex holder waits for one round trip instead of one per block.
+ */
+static void ra_dentry_bucket(struct inode *dir, unsigned long bidx,
+							 unsigned int nblock) {
+	struct page *page;
+	unsigned long end = bidx + nblock;
+
+	for (; bidx < end && bidx < dir_blocks(dir); bidx++) {
+		page = find_get_page(dir->i_mapping, bidx);
+		if (page && PageUptodate(page)) {
+			f2fs_put_page(page, 0);
+			continue;
+		}
+		f2fs_put_page(page, 0);
+
+		/* holes are left for the caller */
+		page = get_read_data_page(dir, bidx, READA);
+		if (!IS_ERR(page))
+			f2fs_put_page(page, 0);
+	}
+}
+
 unsigned char f2fs_filetype_table[F2FS_FT_MAX] = {
 		[F2FS_FT_UNKNOWN]    = DT_UNKNOWN,
 		[F2FS_FT_REG_FILE]    = DT_REG,
@@ -173,6 +199,8 @@ static struct f2fs_dir_entry *find_in_level(struct inode *dir,
 						   le32_to_cpu(namehash) % nbucket);
 	end_block = bidx + nblock;
 
+	ra_dentry_bucket(dir, bidx, nblock);
+
 	for (; bidx < end_block; bidx++) {
 		/* no need to allocate new dentry pages to all the indices */
 		dentry_page = find_data_page(dir, bidx);
@@ -199,6 +227,394 @@ static struct f2fs_dir_entry *find_in_level(struct inode *dir,
 	return de;
 }
 
+static struct kmem_cache *dindex_entry_slab;
+
+static void *dindex_zalloc(size_t size) {
+	void *p = kzalloc(size, GFP_NOFS | __GFP_NOWARN);
+
+	return p ? p : vzalloc(size);
+}
+
+static void dindex_free(void *p) {
+	if (is_vmalloc_addr(p))
+		vfree(p);
+	else
+		kfree(p);
+}
+
+static inline unsigned int dindex_bloom_bit(struct dir_index *di,
+											f2fs_hash_t hash, int k) {
+	return hash_32(le32_to_cpu(hash) + k * GOLDEN_RATIO_PRIME_32,
+				   di->bloom_bits);
+}
+
+static inline struct hlist_head *dindex_bucket(struct dir_index *di,
+											   f2fs_hash_t hash) {
+	return &di->table[hash_32(le32_to_cpu(hash), di->hash_bits)];
+}
+
+static int dindex_insert(struct f2fs_sb_info *sbi, struct dir_index *di,
+						 f2fs_hash_t hash, pgoff_t bidx, unsigned int slot,
+						 gfp_t gfp) {
+	struct hlist_head *head = dindex_bucket(di, hash);
+	struct dindex_entry *ie;
+
+	/* a racing build may already have picked this dentry up */
+	hlist_for_each_entry(ie, head, hnode) {
+		if (ie->bidx == bidx && ie->slot == slot) {
+			ie->hash = hash;
+			return 0;
+		}
+	}
+
+	ie = kmem_cache_alloc(dindex_entry_slab, gfp);
+	if (!ie)
+		return -ENOMEM;
+	ie->hash = hash;
+	ie->bidx = bidx;
+	ie->slot = slot;
+	hlist_add_head(&ie->hnode, head);
+	__set_bit(dindex_bloom_bit(di, hash, 0), di->bloom);
+	__set_bit(dindex_bloom_bit(di, hash, 1), di->bloom);
+	di->nr_entries++;
+	atomic_inc(&sbi->total_dindex_entries);
+	return 0;
+}
+
+static void dindex_remove(struct f2fs_sb_info *sbi, struct dir_index *di,
+						  f2fs_hash_t hash, pgoff_t bidx, unsigned int slot) {
+	struct dindex_entry *ie;
+
+	/* bloom bits stay set, a stale bit only costs a table probe */
+	hlist_for_each_entry(ie, dindex_bucket(di, hash), hnode) {
+		if (ie->bidx != bidx || ie->slot != slot)
+			continue;
+		hlist_del(&ie->hnode);
+		kmem_cache_free(dindex_entry_slab, ie);
+		di->nr_entries--;
+		atomic_dec(&sbi->total_dindex_entries);
+		return;
+	}
+}
+
+static void free_dir_index(struct f2fs_sb_info *sbi, struct dir_index *di) {
+	struct dindex_entry *ie;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	for (i = 0; di->table && i < (1U << di->hash_bits); i++) {
+		hlist_for_each_entry_safe(ie, tmp, &di->table[i], hnode)
+			kmem_cache_free(dindex_entry_slab, ie);
+	}
+	atomic_sub(di->nr_entries, &sbi->total_dindex_entries);
+	atomic_long_sub(di->mem_size, &sbi->total_dindex_mem);
+	dindex_free(di->table);
+	dindex_free(di->bloom);
+	kfree(di);
+}
+
+/* caller holds fi->dindex_lock */
+static struct dir_index *detach_dir_index(struct f2fs_sb_info *sbi,
+										  struct f2fs_inode_info *fi) {
+	struct dir_index *di = fi->i_dindex;
+
+	if (!di)
+		return NULL;
+	fi->i_dindex = NULL;
+	spin_lock(&sbi->dindex_list_lock);
+	list_del(&di->list);
+	spin_unlock(&sbi->dindex_list_lock);
+	return di;
+}
+
+static struct dir_index *build_dir_index(struct inode *dir,
+										 unsigned long nblock) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(dir);
+	struct f2fs_dentry_block *dentry_blk;
+	struct f2fs_dir_entry *de;
+	struct dir_index *di;
+	struct page *page;
+	unsigned long bidx;
+	unsigned int bit_pos;
+
+	di = kzalloc(sizeof(struct dir_index), GFP_NOFS);
+	if (!di)
+		return NULL;
+	INIT_LIST_HEAD(&di->list);
+	di->hash_bits = clamp_t(unsigned int,
+							order_base_2(nblock * NR_DENTRY_IN_BLOCK / 4),
+							DIR_INDEX_MIN_BITS, DIR_INDEX_MAX_BITS);
+	di->bloom_bits = di->hash_bits + DIR_INDEX_BLOOM_SHIFT;
+	di->table = dindex_zalloc(sizeof(struct hlist_head) << di->hash_bits);
+	di->bloom = dindex_zalloc(BITS_TO_LONGS(1UL << di->bloom_bits) *
+							  sizeof(unsigned long));
+	if (!di->table || !di->bloom)
+		goto fail;
+	di->mem_size = sizeof(struct dir_index) +
+				   (sizeof(struct hlist_head) << di->hash_bits) +
+				   BITS_TO_LONGS(1UL << di->bloom_bits) * sizeof(unsigned long);
+	atomic_long_add(di->mem_size, &sbi->total_dindex_mem);
+
+	for (bidx = 0; bidx < nblock; bidx++) {
+		page = find_data_page(dir, bidx);
+		if (IS_ERR(page)) {
+			if (PTR_ERR(page) == -ENOENT)
+				continue;
+			goto fail;
+		}
+
+		dentry_blk = kmap(page);
+		bit_pos = find_next_bit_le(&dentry_blk->dentry_bitmap,
+								   NR_DENTRY_IN_BLOCK, 0);
+		while (bit_pos < NR_DENTRY_IN_BLOCK) {
+			de = &dentry_blk->dentry[bit_pos];
+			if (unlikely(!de->name_len) ||
+				dindex_insert(sbi, di, de->hash_code, bidx, bit_pos,
+							  GFP_NOFS)) {
+				kunmap(page);
+				f2fs_put_page(page, 0);
+				goto fail;
+			}
+			bit_pos = find_next_bit_le(&dentry_blk->dentry_bitmap,
+									   NR_DENTRY_IN_BLOCK,
+									   bit_pos + GET_DENTRY_SLOTS(le16_to_cpu(de->name_len)));
+		}
+		kunmap(page);
+		f2fs_put_page(page, 0);
+	}
+	return di;
+	fail:
+	free_dir_index(sbi, di);
+	return NULL;
+}
+
+/*
+ * Build the index outside any lock and publish it only if no dentry was
+ * added or deleted meanwhile. A build lost to such a race is retried a
+ * second later rather than on every lookup.
+ */
+static void install_dir_index(struct inode *dir, unsigned long nblock) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(dir);
+	struct f2fs_inode_info *fi = F2FS_I(dir);
+	struct dir_index *di;
+	unsigned int seq;
+
+	if (time_before(jiffies, fi->dindex_next_build) ||
+		test_and_set_bit(FI_DINDEX_BUILD, &fi->flags))
+		return;
+
+	spin_lock(&fi->dindex_lock);
+	seq = fi->dindex_seq;
+	spin_unlock(&fi->dindex_lock);
+
+	di = build_dir_index(dir, nblock);
+	if (!di)
+		goto out;
+	di->inode = dir;
+
+	spin_lock(&fi->dindex_lock);
+	if (!fi->i_dindex && fi->dindex_seq == seq) {
+		fi->i_dindex = di;
+		spin_lock(&sbi->dindex_list_lock);
+		list_add_tail(&di->list, &sbi->dindex_list);
+		spin_unlock(&sbi->dindex_list_lock);
+		di = NULL;
+	}
+	spin_unlock(&fi->dindex_lock);
+	if (di)
+		free_dir_index(sbi, di);
+	out:
+	if (di || !fi->i_dindex)
+		fi->dindex_next_build = jiffies + HZ;
+	clear_bit(FI_DINDEX_BUILD, &fi->flags);
+}
+
+static struct f2fs_dir_entry *find_in_index_slot(struct inode *dir,
+												 struct f2fs_filename *fname,
+												 f2fs_hash_t namehash,
+												 pgoff_t bidx, unsigned int slot,
+												 struct page **res_page) {
+	struct f2fs_str *name = &fname->disk_name;
+	struct f2fs_dentry_block *dentry_blk;
+	struct f2fs_dir_entry *de;
+	struct page *page;
+
+	page = find_data_page(dir, bidx);
+	if (IS_ERR(page))
+		return NULL;
+
+	dentry_blk = kmap(page);
+	if (slot < NR_DENTRY_IN_BLOCK &&
+		test_bit_le(slot, &dentry_blk->dentry_bitmap)) {
+		de = &dentry_blk->dentry[slot];
+		if (de->hash_code == namehash &&
+			le16_to_cpu(de->name_len) == name->len &&
+			!memcmp(dentry_blk->filename[slot], name->name, name->len)) {
+			*res_page = page;
+			return de;
+		}
+	}
+	kunmap(page);
+	f2fs_put_page(page, 0);
+	return NULL;
+}
+
+/*
+ * Look the name up in the directory's in-memory index, building it on
+ * first use. *indexed tells the caller whether the answer is final; if
+ * not, it falls back to scanning the hash levels.
+ */
+static struct f2fs_dir_entry *find_in_dir_index(struct inode *dir,
+												struct f2fs_filename *fname,
+												unsigned long npages,
+												struct page **res_page,
+												bool *indexed) {
+	struct f2fs_inode_info *fi = F2FS_I(dir);
+	struct qstr name = FSTR_TO_QSTR(&fname->disk_name);
+	struct f2fs_dir_entry *de;
+	struct dir_index *di;
+	struct dindex_entry *ie;
+	pgoff_t bidx[DIR_INDEX_MAX_PROBES];
+	unsigned int slot[DIR_INDEX_MAX_PROBES];
+	f2fs_hash_t namehash;
+	int nr = 0, i;
+
+	*indexed = false;
+	/* no-key lookups of encrypted names match on the hash alone */
+	if (!test_opt(F2FS_I_SB(dir), DIR_INDEX) ||
+		npages < DIR_INDEX_MIN_BLOCKS || fname->hash)
+		return NULL;
+
+	if (!fi->i_dindex)
+		install_dir_index(dir, npages);
+
+	namehash = f2fs_dentry_hash(&name);
+
+	spin_lock(&fi->dindex_lock);
+	di = fi->i_dindex;
+	if (!di) {
+		spin_unlock(&fi->dindex_lock);
+		return NULL;
+	}
+	*indexed = true;
+	di->referenced = true;
+	if (test_bit(dindex_bloom_bit(di, namehash, 0), di->bloom) &&
+		test_bit(dindex_bloom_bit(di, namehash, 1), di->bloom)) {
+		hlist_for_each_entry(ie, dindex_bucket(di, namehash), hnode) {
+			if (ie->hash != namehash)
+				continue;
+			if (nr == DIR_INDEX_MAX_PROBES) {
+				*indexed = false;
+				break;
+			}
+			bidx[nr] = ie->bidx;
+			slot[nr++] = ie->slot;
+		}
+	}
+	spin_unlock(&fi->dindex_lock);
+
+	if (!*indexed)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		de = find_in_index_slot(dir, fname, namehash, bidx[i], slot[i],
+								res_page);
+		if (de)
+			return de;
+	}
+	return NULL;
+}
+
+static void update_dir_index(struct inode *dir, f2fs_hash_t hash,
+							 pgoff_t bidx, unsigned int slot, bool add) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(dir);
+	struct f2fs_inode_info *fi = F2FS_I(dir);
+	struct dir_index *di, *drop = NULL;
+
+	if (!test_opt(sbi, DIR_INDEX))
+		return;
+
+	spin_lock(&fi->dindex_lock);
+	fi->dindex_seq++;
+	di = fi->i_dindex;
+	if (di && add) {
+		/* grown past its table, drop it and rebuild a larger one */
+		if (di->nr_entries >= (DIR_INDEX_MAX_LOAD << di->hash_bits) ||
+			dindex_insert(sbi, di, hash, bidx, slot, GFP_ATOMIC))
+			drop = detach_dir_index(sbi, fi);
+	} else if (di) {
+		dindex_remove(sbi, di, hash, bidx, slot);
+	}
+	spin_unlock(&fi->dindex_lock);
+
+	if (drop)
+		free_dir_index(sbi, drop);
+}
+
+void f2fs_drop_dir_index(struct inode *dir) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(dir);
+	struct f2fs_inode_info *fi = F2FS_I(dir);
+	struct dir_index *di;
+
+	spin_lock(&fi->dindex_lock);
+	di = detach_dir_index(sbi, fi);
+	spin_unlock(&fi->dindex_lock);
+
+	if (di)
+		free_dir_index(sbi, di);
+}
+
+/*
+ * Called from f2fs_balance_fs_bg() like the extent cache shrinker. Indexes
+ * are reclaimed in CLOCK order: one used since the last pass gets a second
+ * chance at the list tail.
+ */
+void f2fs_shrink_dir_index(struct f2fs_sb_info *sbi, int nr_shrink) {
+	struct f2fs_inode_info *fi;
+	struct dir_index *di;
+	LIST_HEAD(victims);
+	int scanned = 0;
+
+	if (available_free_memory(sbi, DIR_INDEX))
+		return;
+
+	spin_lock(&sbi->dindex_list_lock);
+	while (nr_shrink > 0 && !list_empty(&sbi->dindex_list) &&
+		   scanned++ < DIR_INDEX_SHRINK_NUMBER) {
+		di = list_first_entry(&sbi->dindex_list, struct dir_index, list);
+		fi = F2FS_I(di->inode);
+		/* inode lock nests outside the list lock, so only try it */
+		if (di->referenced || !spin_trylock(&fi->dindex_lock)) {
+			di->referenced = false;
+			list_move_tail(&di->list, &sbi->dindex_list);
+			continue;
+		}
+		fi->i_dindex = NULL;
+		list_move_tail(&di->list, &victims);
+		spin_unlock(&fi->dindex_lock);
+		nr_shrink -= di->nr_entries;
+	}
+	spin_unlock(&sbi->dindex_list_lock);
+
+	while (!list_empty(&victims)) {
+		di = list_first_entry(&victims, struct dir_index, list);
+		list_del(&di->list);
+		free_dir_index(sbi, di);
+	}
+}
+
+int __init create_dir_index_cache(void) {
+	dindex_entry_slab = f2fs_kmem_cache_create("f2fs_dindex_entry",
+											   sizeof(struct dindex_entry));
+	if (!dindex_entry_slab)
+		return -ENOMEM;
+	return 0;
+}
+
+void destroy_dir_index_cache(void) {
+	kmem_cache_destroy(dindex_entry_slab);
+}
+
 /*
  * Find an entry in the specified directory with the wanted name.
  * It returns the page where the entry was found (as a parameter - res_page),
@@ -212,6 +628,7 @@ struct f2fs_dir_entry *f2fs_find_entry(struct inode *dir,
 	unsigned int max_depth;
 	unsigned int level;
 	struct f2fs_filename fname;
+	bool indexed;
 	int err;
 
 	*res_page = NULL;
@@ -228,6 +645,10 @@ struct f2fs_dir_entry *f2fs_find_entry(struct inode *dir,
 	if (npages == 0)
 		goto out;
 
+	de = find_in_dir_index(dir, &fname, npages, res_page, &indexed);
+	if (indexed)
+		goto out;
+
 	max_depth = F2FS_I(dir)->i_current_depth;
 
 	for (level = 0; level < max_depth; level++) {
@@ -550,6 +971,8 @@ int __f2fs_add_link(struct inode *dir, const struct qstr *name,
 	bidx = dir_block_index(level, F2FS_I(dir)->i_dir_level,
 						   (le32_to_cpu(dentry_hash) % nbucket));
 
+	ra_dentry_bucket(dir, bidx, nblock);
+
 	for (block = bidx; block <= (bidx + nblock - 1); block++) {
 		dentry_page = get_new_data_page(dir, NULL, block, true);
 		if (IS_ERR(dentry_page)) {
@@ -586,6 +1009,7 @@ int __f2fs_add_link(struct inode *dir, const struct qstr *name,
 
 	make_dentry_ptr(NULL, &d, (void *) dentry_blk, 1);
 	f2fs_update_dentry(ino, mode, &d, &new_name, dentry_hash, bit_pos);
+	update_dir_index(dir, dentry_hash, block, bit_pos, true);
 
 	set_page_dirty(dentry_page);
 
@@ -681,6 +1105,7 @@ void f2fs_delete_entry(struct f2fs_dir_entry *dentry, struct page *page,
 	bit_pos = dentry - dentry_blk->dentry;
 	for (i = 0; i < slots; i++)
 		clear_bit_le(bit_pos + i, &dentry_blk->dentry_bitmap);
+	update_dir_index(dir, dentry->hash_code, page->index, bit_pos, false);
 
 	/* Let's check and deallocate this dentry page */
 	bit_pos = find_next_bit_le(&dentry_blk->dentry_bitmap, NR_DENTRY_IN_BLOCK, 0);
@@ -689,9 +1114,6 @@ void f2fs_delete_entry(struct f2fs_dir_entry *dentry, struct page *page,
 
 	dir->i_ctime = dir->i_mtime = CURRENT_TIME;
 
-	if (inode)
-		f2fs_drop_nlink(dir, inode, NULL);
-
 	if (bit_pos == NR_DENTRY_IN_BLOCK) {
 		truncate_hole(dir, page->index, page->index + 1);
 		clear_page_dirty_for_io(page);
@@ -700,6 +1122,10 @@ void f2fs_delete_entry(struct f2fs_dir_entry *dentry, struct page *page,
 		inode_dec_dirty_pages(dir);
 	}
 	f2fs_put_page(page, 1);
+
+	/* the victim's inode update does not need the dentry page locked */
+	if (inode)
+		f2fs_drop_nlink(dir, inode, NULL);
 }
 
 bool f2fs_empty_dir(struct inode *dir) {
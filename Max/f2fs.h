@@ -17,6 +17,9 @@
 
 #define PER_CORE_COUNTERS
 #define PER_CORE_NID_LIST
+#define LOCKFREE_SIT
+#define DIRTY_NODE_INDEX
+#define RCU_NAT_CACHE
 
 #include <linux/types.h>
 #include <linux/page-flags.h>
@@ -70,6 +73,9 @@
 #define F2FS_MOUNT_NOBARRIER        0x00000800
 #define F2FS_MOUNT_FASTBOOT        0x00001000
 #define F2FS_MOUNT_EXTENT_CACHE        0x00002000
+#define F2FS_MOUNT_EPOCH_CP        0x00004000
+#define F2FS_MOUNT_DIR_INDEX        0x00010000
+#define F2FS_MOUNT_BMAP_CACHE        0x00020000
 
 #define clear_opt(sbi, option)    (sbi->mount_opt.opt &= ~F2FS_MOUNT_##option)
 #define set_opt(sbi, option)    (sbi->mount_opt.opt |= F2FS_MOUNT_##option)
@@ -145,6 +151,7 @@ struct cp_control {
 	__u64 trim_end;
 	__u64 trim_minlen;
 	__u64 trimmed;
+	bool epoch;		/* commit the CP pack with operations unblocked */
 };
 
 /*
@@ -169,6 +176,7 @@ enum {
 struct ino_entry {
 	struct list_head list;    /* list head */
 	nid_t ino;        /* inode number */
+	unsigned int epoch;    /* checkpoint epoch of the last update */
 };
 
 /*
@@ -197,6 +205,7 @@ struct fsync_inode_entry {
 	block_t blkaddr;    /* block address locating the last fsync */
 	block_t last_dentry;    /* block address locating the last dentry */
 	block_t last_inode;    /* block address locating the last inode */
+	unsigned int seq;    /* position of blkaddr in the recovery stream */
 };
 
 #define nats_in_cursum(sum)        (le16_to_cpu(sum->n_nats))
@@ -242,6 +251,24 @@ static inline bool __has_cursum_space(struct f2fs_summary_block *sum, int size,
 #define F2FS_IOC_START_VOLATILE_WRITE    _IO(F2FS_IOCTL_MAGIC, 3)
 #define F2FS_IOC_RELEASE_VOLATILE_WRITE    _IO(F2FS_IOCTL_MAGIC, 4)
 #define F2FS_IOC_ABORT_VOLATILE_WRITE    _IO(F2FS_IOCTL_MAGIC, 5)
+#define F2FS_IOC_PREFETCH_MAP        _IOW(F2FS_IOCTL_MAGIC, 6,    \
+                        struct f2fs_prefetch_range)
+
+/* byte range whose node blocks F2FS_IOC_PREFETCH_MAP reads ahead */
+struct f2fs_prefetch_range {
+	__u64 start;
+	__u64 len;
+};
+
+#define F2FS_IOC_COMMIT_ATOMIC_TXN    _IOW(F2FS_IOCTL_MAGIC, 7,    \
+                        struct f2fs_atomic_txn)
+
+/* atomic files committed together by F2FS_IOC_COMMIT_ATOMIC_TXN */
+struct f2fs_atomic_txn {
+	__u64 fds;        /* user pointer to an array of __s32 fds */
+	__u32 nr_fds;
+	__u32 flags;        /* must be 0 */
+};
 
 #define F2FS_IOC_SET_ENCRYPTION_POLICY                    \
         _IOR('f', 19, struct f2fs_encryption_policy)
@@ -346,6 +373,59 @@ enum {
 /* number of extent info in extent cache we try to shrink */
 #define EXTENT_CACHE_SHRINK_NUMBER    128
 
+/* extent trees and their lru lists are sharded by inode number */
+#define EXT_TREE_SHARDS    64
+#define EXT_SHARD(ino)    ((ino) % EXT_TREE_SHARDS)
+
+/*
+ * In-memory dentry index of a large directory (dir_index mount option).
+ * It maps a dentry hash to the (block, slot) holding the dentry, and a
+ * Bloom filter in front of it answers most misses without any page.
+ */
+#define DIR_INDEX_MIN_BLOCKS    8    /* only index directories this large */
+#define DIR_INDEX_MIN_BITS    6
+#define DIR_INDEX_MAX_BITS    16
+#define DIR_INDEX_BLOOM_SHIFT    4    /* 16 bloom bits per hash bucket */
+#define DIR_INDEX_MAX_LOAD    4    /* rebuild past 4 entries per bucket */
+#define DIR_INDEX_MAX_PROBES    4    /* same-hash candidates we check */
+#define DIR_INDEX_SHRINK_NUMBER    1024
+
+struct dindex_entry {
+	struct hlist_node hnode;    /* hash chain in dir_index */
+	f2fs_hash_t hash;        /* dentry hash code */
+	unsigned int bidx;        /* dentry block index in the directory */
+	unsigned int slot;        /* first slot of the dentry in the block */
+};
+
+struct dir_index {
+	struct list_head list;        /* sbi->dindex_list, for the shrinker */
+	struct inode *inode;        /* indexed directory */
+	bool referenced;        /* used since the shrinker last saw it */
+	unsigned int nr_entries;    /* # of dindex_entry */
+	unsigned int hash_bits;        /* log2 of table size */
+	unsigned int bloom_bits;    /* log2 of bloom filter bits */
+	struct hlist_head *table;    /* hash -> dindex_entry */
+	unsigned long *bloom;        /* bloom filter of dentry hashes */
+	size_t mem_size;        /* bytes of this, table and bloom */
+};
+
+/*
+ * Per-inode block-map cache (bmap_cache mount option): data block addresses
+ * of large regular files resolved by reads, keyed by file offset.
+ */
+#define BMAP_CACHE_SHRINK_NUMBER    1024
+#define BMAP_ENTRY_SIZE    (2 * sizeof(void *))    /* slot and radix node share */
+#define RA_DNODE_BATCH    16    /* offsets whose dnode paths are read together */
+
+struct block_map {
+	struct list_head list;        /* sbi->bmap_list, for the shrinker */
+	struct inode *inode;        /* owner inode */
+	bool referenced;        /* used since the shrinker last saw it */
+	unsigned int nr_entries;    /* # of cached block addresses */
+	struct radix_tree_root root;    /* file offset -> block address */
+	struct rcu_head rcu;
+};
+
 struct extent_info {
 	unsigned int fofs;        /* start offset in a file */
 	u32 blk;            /* start block address of the extent */
@@ -354,8 +434,9 @@ struct extent_info {
 
 struct extent_node {
 	struct rb_node rb_node;        /* rb node located in rb-tree */
-	struct list_head list;        /* node in global extent list of sbi */
+	struct list_head list;        /* node in shard extent list of sbi */
 	struct extent_info ei;        /* extent info */
+	bool referenced;        /* hit since the shrinker last saw it */
 };
 
 struct extent_tree {
@@ -363,8 +444,10 @@ struct extent_tree {
 	struct rb_root root;        /* root of extent info rb-tree */
 	struct extent_node *cached_en;    /* recently accessed extent node */
 	rwlock_t lock;            /* protect extent info rb-tree */
+	seqcount_t seq;            /* lockless lookup against lock holders */
 	atomic_t refcount;        /* reference count of rb-tree */
 	unsigned int count;        /* # of extent node in rb-tree*/
+	struct rcu_head rcu;        /* free after lockless lookups are done */
 };
 
 /*
@@ -442,6 +525,13 @@ struct f2fs_inode_info {
 	struct list_head inmem_pages;    /* inmemory pages managed by f2fs */
 	struct mutex inmem_lock;    /* lock for inmemory pages */
 
+	struct dir_index *i_dindex;    /* in-memory dentry index */
+	spinlock_t dindex_lock;        /* protects i_dindex and dindex_seq */
+	unsigned int dindex_seq;    /* bumped by every dentry add/delete */
+	unsigned long dindex_next_build;    /* jiffies of next build attempt */
+	struct block_map *i_bmap;    /* block-map cache */
+	spinlock_t bmap_lock;        /* protects i_bmap updates */
+
 #ifdef CONFIG_F2FS_FS_ENCRYPTION
 	/* Encryption params */
 	struct f2fs_crypt_info *i_crypt_info;
@@ -491,6 +581,35 @@ static inline bool __is_front_mergeable(struct extent_info *cur,
 	return __is_extent_mergeable(cur, front);
 }
 
+/* policies to pick the free nid list a new node id comes from */
+enum {
+	NID_ROUND_ROBIN,	/* spread allocations over all free nid lists */
+	NID_CELL_LOCAL,		/* prefer nids of the caller's file cell */
+	NID_POLICY_MAX,
+};
+
+#ifdef DIRTY_NODE_INDEX
+/*
+ * Per-inode index of node pages that are dirty or under writeback, so that
+ * fsync finds an inode's dnodes without scanning the whole node mapping.
+ */
+#define DIRTY_NODE_SHARDS    64
+#define DIRTY_NIDS_PER_INO    30
+
+struct dirty_node_entry {
+	nid_t ino;            /* owner inode */
+	bool overflow;            /* more nodes than nids[] can hold */
+	unsigned int cnt;        /* # of valid nids[] */
+	nid_t nids[DIRTY_NIDS_PER_INO];    /* dirty or writeback node pages */
+};
+
+struct dirty_node_shard {
+	spinlock_t lock;        /* protects root and its entries */
+	struct radix_tree_root root;    /* ino -> dirty_node_entry */
+	bool overflow;            /* an entry could not be allocated */
+};
+#endif
+
 struct f2fs_nm_info {
 	block_t nat_blkaddr;        /* base disk address of NAT */
 	nid_t max_nid;            /* maximum possible node ids */
@@ -526,6 +645,12 @@ struct f2fs_nm_info {
 	atomic_t next_allocator;
 	int nid_list_count;
 	int nid_chunk;
+	nid_t *next_scan_nids;        /* per-list NAT scan cursor */
+	unsigned long *nid_build_map;    /* lists being scanned */
+	unsigned long *nid_refill_map;    /* lists waiting for a refill */
+	struct work_struct refill_work;    /* background free nid refill */
+	struct f2fs_sb_info *sbi;
+	unsigned int nid_policy;    /* NID_* placement policy */
 #else
 	struct radix_tree_root free_nid_root;/* root of the free_nid cache */
 	struct list_head free_nid_list;    /* a list for free nids */
@@ -534,6 +659,11 @@ struct f2fs_nm_info {
 	unsigned int fcnt;        /* the number of free node id */
 	struct mutex build_lock;    /* lock for build free nids */
 
+#ifdef DIRTY_NODE_INDEX
+/* dirty node pages per inode, for fsync */
+	struct dirty_node_shard dn_shards[DIRTY_NODE_SHARDS];
+#endif
+
 /* for checkpoint */
 	char *nat_bitmap;        /* NAT bitmap pointer */
 	int bitmap_size;        /* bitmap size */
@@ -595,14 +725,30 @@ enum {
 struct flush_cmd {
 	struct completion wait;
 	struct llist_node llnode;
+	unsigned int seq;            /* order in which it was queued */
 	int ret;
 };
 
-struct flush_cmd_control {
+/* one per NUMA node, served by its own flush thread */
+struct flush_cmd_queue {
+	struct f2fs_sb_info *sbi;
 	struct task_struct *f2fs_issue_flush;    /* flush thread */
 	wait_queue_head_t flush_wait_queue;    /* waiting queue for wake-up */
 	struct llist_head issue_list;        /* list for command issue */
 	struct llist_node *dispatch_list;    /* list for command dispatch */
+	unsigned int window;            /* usecs to wait for more fsyncs */
+};
+
+struct flush_cmd_control {
+	struct flush_cmd_queue *queues;        /* per-node queues */
+	int nr_queues;
+	atomic_t queued_seq;            /* last seq handed to a command */
+	atomic_t inflight_seq;            /* covered by a flush in flight */
+	atomic_t flushed_seq;            /* covered by a completed flush */
+	spinlock_t flushed_lock;        /* orders flushed_seq and the error */
+	unsigned int err_lo, err_hi;        /* seqs covered by failed flushes */
+	int flushed_err;            /* sticky error of those flushes */
+	wait_queue_head_t flushed_wait;        /* waiting for inflight flush */
 };
 
 struct f2fs_sm_info {
@@ -687,6 +833,17 @@ enum page_type {
 	OPU,
 };
 
+#ifdef MLOG
+/*
+ * A writeback context writes back one inode at a time, so that its dirty
+ * pages get allocated as a sequential run of the log it is bound to.
+ */
+struct f2fs_wb_ctx {
+	struct mutex lock;        /* held across one writepages call */
+	int mlog;            /* log the context allocates from */
+};
+#endif
+
 struct f2fs_io_info {
 	struct f2fs_sb_info *sbi;    /* f2fs_sb_info pointer */
 	enum page_type type;    /* contains DATA/NODE/META/META_FLUSH */
@@ -694,6 +851,10 @@ struct f2fs_io_info {
 	block_t blk_addr;    /* block address to be written */
 	struct page *page;    /* page to be written */
 	struct page *encrypted_page;    /* encrypted page */
+#ifdef MLOG
+	int mlog;            /* log the block was allocated from */
+	struct f2fs_wb_ctx *wb_ctx;    /* writeback context, or NULL */
+#endif
 };
 
 #define is_read_io(rw)    (((rw) & 1) == READ)
@@ -748,6 +909,9 @@ struct f2fs_sb_info {
 /* for bio operations */
 	struct f2fs_bio_info read_io;            /* for read bios */
 	struct f2fs_bio_info write_io[NR_PAGE_TYPE];    /* for write bios */
+#ifdef MLOG
+	struct f2fs_bio_info *mlog_write_io[META];    /* per-mlog DATA/NODE write bios */
+#endif
 
 /* for checkpoint */
 	struct f2fs_checkpoint *ckpt;        /* raw checkpoint pointer */
@@ -755,8 +919,16 @@ struct f2fs_sb_info {
 	struct mutex cp_mutex;            /* checkpoint procedure lock */
 	struct rw_semaphore cp_rwsem;        /* blocking FS operations */
 	struct rw_semaphore node_write;        /* locking node writes */
+#ifdef MLOG
+	struct f2fs_wb_ctx *wb_ctxs;        /* per-log writeback contexts */
+	unsigned int nr_wb_ctxs;        /* # of writeback contexts */
+#else
 	struct mutex writepages;        /* mutex for writepages() */
+#endif
 	wait_queue_head_t cp_wait;
+	unsigned int cp_epoch;            /* # of times operations were frozen */
+	atomic_t node_seq;            /* write order of node blocks, see seq_of_node */
+	bool cp_committing;            /* CP pack is committed unblocked */
 #ifdef FILE_CELL
 	struct inode_management **im;      /* manage inode cache */
 	int inode_cache_count;
@@ -771,12 +943,24 @@ struct f2fs_sb_info {
 	struct list_head dir_inode_list;    /* dir inode list */
 	spinlock_t dir_inode_lock;        /* for dir inode list lock */
 
+/* for in-memory directory indexes */
+	struct list_head dindex_list;        /* indexed dirs, for the shrinker */
+	spinlock_t dindex_list_lock;        /* protects dindex_list */
+	atomic_t total_dindex_entries;        /* # of dindex_entry */
+	atomic_long_t total_dindex_mem;        /* bytes of dir_index and arrays */
+
+/* for block-map caches */
+	struct list_head bmap_list;        /* cached maps, for the shrinker */
+	spinlock_t bmap_list_lock;        /* protects bmap_list */
+	atomic_t total_bmap_entries;        /* # of cached block addresses */
+
 /* for extent tree cache */
-	struct radix_tree_root extent_tree_root;/* cache extent cache entries */
-	struct rw_semaphore extent_tree_lock;    /* locking extent radix tree */
-	struct list_head extent_list;        /* lru list for shrinker */
-	spinlock_t extent_lock;            /* locking extent lru list */
-	int total_ext_tree;            /* extent tree count */
+	struct radix_tree_root extent_tree_root[EXT_TREE_SHARDS];/* cache extent cache entries */
+	struct rw_semaphore extent_tree_lock[EXT_TREE_SHARDS];    /* locking extent radix tree */
+	struct list_head extent_list[EXT_TREE_SHARDS];        /* lru list for shrinker */
+	spinlock_t extent_lock[EXT_TREE_SHARDS];            /* locking extent lru list */
+	unsigned int ext_shrink_shard;        /* shard the shrinker starts from */
+	atomic_t total_ext_tree;            /* extent tree count */
 	atomic_t total_ext_node;        /* extent info count */
 
 /* basic filesystem units */
@@ -800,7 +984,11 @@ struct f2fs_sb_info {
 	block_t user_block_count;        /* # of user blocks */
 	block_t total_valid_block_count;    /* # of valid blocks */
 	block_t alloc_valid_block_count;    /* # of allocated blocks */
+#ifdef LOCKFREE_SIT
+	struct percpu_counter discard_blks;    /* discard command candidats */
+#else
 	block_t discard_blks;            /* discard command candidats */
+#endif
 	block_t last_valid_block_count;        /* for recovery */
 	u32 s_next_generation;            /* for NFS support */
 	atomic_t nr_pages[NR_COUNT_TYPE];    /* # of pages, see count_type */
@@ -813,9 +1001,14 @@ struct f2fs_sb_info {
 	struct f2fs_mount_info mount_opt;    /* mount options */
 
 /* for cleaning operations */
-	struct mutex gc_mutex;            /* mutex for GC */
-	struct f2fs_gc_kthread *gc_thread;    /* GC thread */
-	unsigned int cur_victim_sec;        /* current victim section num */
+	struct rw_semaphore gc_rwsem;        /* shared by GC, exclusive for sync */
+	struct f2fs_gc_kthread *gc_thread;    /* GC threads */
+	unsigned int nr_gc_workers;        /* # of concurrent GC workers */
+	atomic_t nr_fg_gc;            /* # of writers running foreground GC */
+	wait_queue_head_t fg_gc_wait;        /* writers waiting for free sections */
+	atomic_t nr_fg_collectors;        /* # of f2fs_gc calls in FG mode */
+	struct mutex fg_gc_cp_mutex;        /* serializes FG GC checkpoints */
+	atomic_t fg_gc_cp_seq;            /* # of FG GC checkpoints started */
 
 /* maximum # of trials to find a victim segment for SSR and GC */
 	unsigned int max_victim_search;
@@ -828,6 +1021,8 @@ struct f2fs_sb_info {
 #ifdef MLOG
 	uint nr_mlog;
 	atomic_t next_mlog;
+	unsigned int mlog_policy;	/* how writers pick a log, MLOG_* */
+	struct mutex replace_mutex;	/* log selection of __f2fs_replace_block */
 #endif
 /*
  * for stat information.
@@ -929,6 +1124,35 @@ static inline struct address_space *NODE_MAPPING(struct f2fs_sb_info *sbi) {
 
 #endif
 
+#ifdef MLOG
+
+/* policies to pick the log a DATA/NODE block is allocated from */
+enum {
+	MLOG_ROUND_ROBIN,	/* spread every block over all logs */
+	MLOG_PER_CPU,		/* log of the running cpu */
+	MLOG_INODE_HASH,	/* log hashed by the owner inode */
+	MLOG_PER_CELL,		/* log of the owner's file cell */
+	MLOG_ADAPTIVE,		/* per-cpu, move to an idle log under contention */
+	MLOG_POLICY_MAX,
+};
+
+/*
+ * DATA and NODE writes are merged per log, so that each log keeps building
+ * its own sequential bio. META still goes through the single write_io[META].
+ */
+static inline int NR_WRITE_IO(struct f2fs_sb_info *sbi, enum page_type btype) {
+	return btype == META ? 1 : sbi->nr_mlog;
+}
+
+static inline struct f2fs_bio_info *WRITE_IO(struct f2fs_sb_info *sbi,
+											 enum page_type btype, int mlog) {
+	if (btype == META)
+		return &sbi->write_io[META];
+	return &sbi->mlog_write_io[btype][mlog];
+}
+
+#endif
+
 static inline bool is_sbi_flag_set(struct f2fs_sb_info *sbi, unsigned int type) {
 	return sbi->s_flag & (0x01 << type);
 }
@@ -1174,6 +1398,20 @@ static inline block_t valid_user_blocks(struct f2fs_sb_info *sbi) {
 
 #endif
 
+#ifdef LOCKFREE_SIT
+
+static inline block_t discard_blocks(struct f2fs_sb_info *sbi) {
+	return (block_t) percpu_counter_sum_positive(&sbi->discard_blks);
+}
+
+#else
+
+static inline block_t discard_blocks(struct f2fs_sb_info *sbi) {
+	return sbi->discard_blks;
+}
+
+#endif
+
 static inline unsigned long __bitmap_size(struct f2fs_sb_info *sbi, int flag) {
 	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
 
@@ -1470,6 +1708,21 @@ static inline void f2fs_change_bit(unsigned int nr, char *addr) {
 	*addr ^= mask;
 }
 
+#ifdef LOCKFREE_SIT
+/*
+ * Atomic versions of the SIT bitmap operations. f2fs counts bits from the
+ * MSB of each byte, which is bit (nr ^ 7) in little-endian bit order.
+ * The bitmap should be aligned to unsigned long.
+ */
+static inline int f2fs_test_and_set_bit_atomic(unsigned int nr, char *addr) {
+	return test_and_set_bit_le(nr ^ 7, addr);
+}
+
+static inline int f2fs_test_and_clear_bit_atomic(unsigned int nr, char *addr) {
+	return test_and_clear_bit_le(nr ^ 7, addr);
+}
+#endif
+
 /* used for f2fs_inode_info->flags */
 enum {
 	FI_NEW_INODE,        /* indicate newly allocated inode */
@@ -1493,6 +1746,7 @@ enum {
 	FI_DROP_CACHE,        /* drop dirty page cache */
 	FI_DATA_EXIST,        /* indicate data exists */
 	FI_INLINE_DOTS,        /* indicate inline dot dentries */
+	FI_DINDEX_BUILD,    /* dentry index is being built */
 };
 
 static inline void set_inode_flag(struct f2fs_inode_info *fi, int flag) {
@@ -1756,6 +2010,14 @@ int f2fs_do_tmpfile(struct inode *, struct inode *);
 
 bool f2fs_empty_dir(struct inode *);
 
+void f2fs_drop_dir_index(struct inode *);
+
+void f2fs_shrink_dir_index(struct f2fs_sb_info *, int);
+
+int __init create_dir_index_cache(void);
+
+void destroy_dir_index_cache(void);
+
 static inline int f2fs_add_link(struct dentry *dentry, struct inode *inode) {
 	return __f2fs_add_link(d_inode(dentry->d_parent), &dentry->d_name,
 						   inode, inode->i_ino, inode->i_mode);
@@ -1800,6 +2062,16 @@ int truncate_xattr_node(struct inode *, struct page *);
 
 int wait_on_node_pages_writeback(struct f2fs_sb_info *, nid_t);
 
+#ifdef DIRTY_NODE_INDEX
+
+void prune_dirty_node_index(struct f2fs_sb_info *);
+
+int txn_node_pages(struct f2fs_sb_info *, nid_t, struct writeback_control *);
+
+int write_txn_record(struct f2fs_sb_info *, struct inode **, int);
+
+#endif
+
 void remove_inode_page(struct inode *);
 
 struct page *new_inode_page(struct inode *);
@@ -1812,6 +2084,8 @@ struct page *get_node_page(struct f2fs_sb_info *, pgoff_t);
 
 struct page *get_node_page_ra(struct page *, int);
 
+void ra_dnode_paths(struct inode *, pgoff_t *, int);
+
 void sync_inode_page(struct dnode_of_data *);
 
 #ifdef FILE_CELL
@@ -1826,6 +2100,8 @@ int sync_node_pages(struct f2fs_sb_info *sbi, nid_t ino, struct writeback_contro
 
 bool alloc_nid(struct f2fs_sb_info *, nid_t *);
 
+bool alloc_nid_for_inode(struct f2fs_sb_info *, nid_t *, nid_t);
+
 void alloc_nid_done(struct f2fs_sb_info *, nid_t);
 
 void alloc_nid_failed(struct f2fs_sb_info *, nid_t);
@@ -1849,6 +2125,8 @@ void flush_nat_entries_per_core(struct f2fs_sb_info *);
 
 int build_node_manager(struct f2fs_sb_info *);
 
+void stop_free_nid_refill(struct f2fs_sb_info *);
+
 void destroy_node_manager(struct f2fs_sb_info *);
 
 int __init create_node_manager_caches(void);
@@ -1862,6 +2140,8 @@ void register_inmem_page(struct inode *, struct page *);
 
 void commit_inmem_pages(struct inode *, bool);
 
+void commit_inmem_pages_txn(struct inode **, int);
+
 void f2fs_balance_fs(struct f2fs_sb_info *);
 
 void f2fs_balance_fs_bg(struct f2fs_sb_info *);
@@ -1878,6 +2158,8 @@ void refresh_sit_entry(struct f2fs_sb_info *, block_t, block_t);
 
 void clear_prefree_segments(struct f2fs_sb_info *, struct cp_control *);
 
+void thaw_prefree_segments(struct f2fs_sb_info *);
+
 void release_discard_addrs(struct f2fs_sb_info *);
 
 void discard_next_dnode(struct f2fs_sb_info *, block_t);
@@ -1903,8 +2185,11 @@ void rewrite_data_page(struct f2fs_io_info *);
 void f2fs_replace_block(struct f2fs_sb_info *, struct dnode_of_data *,
 						block_t, block_t, unsigned char, bool);
 
-void allocate_data_block(struct f2fs_sb_info *, struct page *,
-						 block_t, block_t *, struct f2fs_summary *, int);
+int allocate_data_block(struct f2fs_sb_info *, struct page *,
+						block_t, block_t *, struct f2fs_summary *, int);
+
+int allocate_data_blocks(struct f2fs_sb_info *, struct f2fs_summary *,
+						 unsigned int, block_t *, int);
 
 void f2fs_wait_on_page_writeback(struct page *, enum page_type);
 
@@ -1934,6 +2219,8 @@ struct page *grab_meta_page(struct f2fs_sb_info *, pgoff_t);
 
 struct page *get_meta_page(struct f2fs_sb_info *, pgoff_t);
 
+struct page *get_next_meta_page(struct f2fs_sb_info *, pgoff_t, pgoff_t);
+
 bool is_valid_blkaddr(struct f2fs_sb_info *, block_t, int);
 
 int ra_meta_pages(struct f2fs_sb_info *, block_t, int, int);
@@ -1972,6 +2259,14 @@ void sync_dirty_dir_inodes(struct f2fs_sb_info *);
 
 void write_checkpoint(struct f2fs_sb_info *, struct cp_control *);
 
+void wait_on_checkpoint_commit(struct f2fs_sb_info *);
+
+#ifdef FILE_CELL
+int init_node_flush_works(struct f2fs_sb_info *);
+
+void destroy_node_flush_works(struct f2fs_sb_info *);
+#endif
+
 void init_ino_entry_info(struct f2fs_sb_info *);
 
 int __init create_checkpoint_caches(void);
@@ -1987,6 +2282,14 @@ int f2fs_submit_page_bio(struct f2fs_io_info *);
 
 void f2fs_submit_page_mbio(struct f2fs_io_info *);
 
+#ifdef MLOG
+void f2fs_submit_merged_bio_mlog(struct f2fs_sb_info *, enum page_type, int);
+
+int init_mlog_write_io(struct f2fs_sb_info *);
+
+void destroy_mlog_write_io(struct f2fs_sb_info *);
+#endif
+
 void set_data_blkaddr(struct dnode_of_data *);
 
 int reserve_new_block(struct dnode_of_data *);
@@ -2003,6 +2306,10 @@ void f2fs_update_extent_cache(struct dnode_of_data *);
 
 void f2fs_preserve_extent_tree(struct inode *);
 
+void f2fs_drop_block_map(struct inode *);
+
+void f2fs_shrink_block_map(struct f2fs_sb_info *, int);
+
 struct page *get_read_data_page(struct inode *, pgoff_t, int);
 
 struct page *find_data_page(struct inode *, pgoff_t);
@@ -2311,6 +2618,8 @@ int f2fs_decrypt(struct f2fs_crypto_ctx *, struct page *);
 
 int f2fs_decrypt_one(struct inode *, struct page *);
 
+void f2fs_decrypt_bio(struct bio *);
+
 void f2fs_end_io_crypto_work(struct f2fs_crypto_ctx *, struct bio *);
 
 /* crypto_key.c */
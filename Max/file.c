@@ -19,6 +19,7 @@
 #include <linux/compat.h>
 #include <linux/uaccess.h>
 #include <linux/mount.h>
+#include <linux/file.h>
 #include <linux/pagevec.h>
 #include <linux/random.h>
 
@@ -271,6 +272,7 @@ int f2fs_sync_file(struct file *file, loff_t start, loff_t end, int datasync) {
 	flush_out:
 	remove_dirty_inode(sbi, ino, UPDATE_INO);
 	clear_inode_flag(fi, FI_UPDATE_WRITE);
+	wait_on_checkpoint_commit(sbi);
 	ret = f2fs_issue_flush(sbi);
 	out:
 	trace_f2fs_sync_file_exit(inode, need_cp, datasync, ret);
@@ -1317,6 +1319,132 @@ static int f2fs_ioc_commit_atomic_write(struct file *filp) {
 	return ret;
 }
 
+/*
+ * Commit the atomic writes of several files as one unit. The dnodes of all
+ * members go out without fsync marks and a single record naming their last
+ * node blocks is flushed behind them, so roll-forward replays either every
+ * member or none. Members that cannot be rolled forward make the whole
+ * transaction a checkpoint.
+ */
+static int f2fs_ioc_commit_atomic_txn(struct file *filp, unsigned long arg) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(file_inode(filp));
+	struct inode *inodes[F2FS_TXN_MAX_MEMBERS];
+	struct fd fds[F2FS_TXN_MAX_MEMBERS];
+	struct f2fs_atomic_txn txn;
+	struct inode *inode;
+	bool need_cp = false;
+	int nr = 0, i, j, ret;
+	__s32 fd;
+	struct writeback_control wbc = {
+			.sync_mode = WB_SYNC_ALL,
+			.nr_to_write = LONG_MAX,
+			.for_reclaim = 0,
+	};
+
+	if (copy_from_user(&txn, (struct f2fs_atomic_txn __user *) arg,
+					   sizeof(txn)))
+		return -EFAULT;
+	if (txn.flags || !txn.nr_fds || txn.nr_fds > F2FS_TXN_MAX_MEMBERS)
+		return -EINVAL;
+
+	for (i = 0; i < txn.nr_fds; i++) {
+		ret = -EFAULT;
+		if (get_user(fd, (__s32 __user *) (unsigned long) txn.fds + i))
+			goto put_fds;
+		ret = -EBADF;
+		fds[nr] = fdget(fd);
+		if (!fds[nr].file)
+			goto put_fds;
+		inode = file_inode(fds[nr].file);
+		inodes[nr++] = inode;
+
+		if (!(fds[nr - 1].file->f_mode & FMODE_WRITE))
+			goto put_fds;
+		ret = -EXDEV;
+		if (inode->i_sb != sbi->sb)
+			goto put_fds;
+		ret = -EACCES;
+		if (!inode_owner_or_capable(inode))
+			goto put_fds;
+		ret = -EINVAL;
+		if (!S_ISREG(inode->i_mode) || !f2fs_is_atomic_file(inode))
+			goto put_fds;
+		for (j = 0; j < nr - 1; j++)
+			if (inodes[j] == inode)
+				goto put_fds;
+	}
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		goto put_fds;
+
+	commit_inmem_pages_txn(inodes, nr);
+
+	for (i = 0; i < nr; i++) {
+		ret = filemap_write_and_wait(inodes[i]->i_mapping);
+		if (ret)
+			goto drop_write;
+	}
+
+	f2fs_balance_fs(sbi);
+
+	for (i = 0; i < nr; i++) {
+		down_read(&F2FS_I(inodes[i])->i_sem);
+		if (need_do_checkpoint(inodes[i]) ||
+			need_dentry_mark(sbi, inodes[i]->i_ino))
+			need_cp = true;
+		up_read(&F2FS_I(inodes[i])->i_sem);
+	}
+#ifndef DIRTY_NODE_INDEX
+	need_cp = true;
+#else
+	for (i = 0; i < nr && !need_cp; i++) {
+		/* the record names the inode block, so it is always rewritten */
+		update_inode_page(inodes[i]);
+		ret = txn_node_pages(sbi, inodes[i]->i_ino, &wbc);
+		if (ret == -EAGAIN)
+			need_cp = true;
+		else if (ret < 0)
+			goto drop_write;
+	}
+#endif
+	if (need_cp) {
+		ret = f2fs_sync_fs(sbi->sb, 1);
+		for (i = 0; i < nr; i++) {
+			clear_inode_flag(F2FS_I(inodes[i]), FI_APPEND_WRITE);
+			clear_inode_flag(F2FS_I(inodes[i]), FI_UPDATE_WRITE);
+		}
+		goto drop_write;
+	}
+
+	ret = -EIO;
+	if (unlikely(f2fs_cp_error(sbi)))
+		goto drop_write;
+	for (i = 0; i < nr; i++) {
+		ret = wait_on_node_pages_writeback(sbi, inodes[i]->i_ino);
+		if (ret)
+			goto drop_write;
+	}
+
+	wait_on_checkpoint_commit(sbi);
+	ret = write_txn_record(sbi, inodes, nr);
+	if (ret)
+		goto drop_write;
+
+	for (i = 0; i < nr; i++) {
+		remove_dirty_inode(sbi, inodes[i]->i_ino, APPEND_INO);
+		remove_dirty_inode(sbi, inodes[i]->i_ino, UPDATE_INO);
+		clear_inode_flag(F2FS_I(inodes[i]), FI_APPEND_WRITE);
+		clear_inode_flag(F2FS_I(inodes[i]), FI_UPDATE_WRITE);
+	}
+	drop_write:
+	mnt_drop_write_file(filp);
+	put_fds:
+	for (i = 0; i < nr; i++)
+		fdput(fds[i]);
+	return ret;
+}
+
 static int f2fs_ioc_start_volatile_write(struct file *filp) {
 	struct inode *inode = file_inode(filp);
 
@@ -1436,6 +1564,56 @@ static int f2fs_ioc_fitrim(struct file *filp, unsigned long arg) {
 	return 0;
 }
 
+/*
+ * Read ahead the node blocks mapping a byte range, one offset per dnode,
+ * for readers about to access a large file at random. The dnode reads are
+ * still in flight when this returns.
+ */
+static int f2fs_ioc_prefetch_map(struct file *filp, unsigned long arg) {
+	struct inode *inode = file_inode(filp);
+	struct f2fs_prefetch_range range;
+	pgoff_t index[RA_DNODE_BATCH];
+	pgoff_t pgofs, end;
+	loff_t isize;
+	int nr = 0;
+
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (!S_ISREG(inode->i_mode))
+		return -EINVAL;
+	if (copy_from_user(&range, (struct f2fs_prefetch_range __user *) arg,
+					   sizeof(range)))
+		return -EFAULT;
+
+	isize = i_size_read(inode);
+	if (f2fs_has_inline_data(inode) || range.start >= isize || !range.len)
+		return 0;
+	if (range.len > isize - range.start)
+		range.len = isize - range.start;
+
+	pgofs = range.start >> PAGE_CACHE_SHIFT;
+	end = DIV_ROUND_UP(range.start + range.len, PAGE_CACHE_SIZE);
+	while (pgofs < end) {
+		index[nr++] = pgofs;
+		/* a dnode maps ADDRS_PER_BLOCK offsets, end - 1 gets the last one */
+		if (end - pgofs > ADDRS_PER_BLOCK)
+			pgofs += ADDRS_PER_BLOCK;
+		else if (pgofs < end - 1)
+			pgofs = end - 1;
+		else
+			pgofs = end;
+
+		if (nr < RA_DNODE_BATCH && pgofs < end)
+			continue;
+		ra_dnode_paths(inode, index, nr);
+		nr = 0;
+		if (fatal_signal_pending(current))
+			return -EINTR;
+		cond_resched();
+	}
+	return 0;
+}
+
 static bool uuid_is_nonzero(__u8 u[16]) {
 	int i;
 
@@ -1524,6 +1702,8 @@ long f2fs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 			return f2fs_ioc_start_atomic_write(filp);
 		case F2FS_IOC_COMMIT_ATOMIC_WRITE:
 			return f2fs_ioc_commit_atomic_write(filp);
+		case F2FS_IOC_COMMIT_ATOMIC_TXN:
+			return f2fs_ioc_commit_atomic_txn(filp, arg);
 		case F2FS_IOC_START_VOLATILE_WRITE:
 			return f2fs_ioc_start_volatile_write(filp);
 		case F2FS_IOC_RELEASE_VOLATILE_WRITE:
@@ -1534,6 +1714,8 @@ long f2fs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
 			return f2fs_ioc_shutdown(filp, arg);
 		case FITRIM:
 			return f2fs_ioc_fitrim(filp, arg);
+		case F2FS_IOC_PREFETCH_MAP:
+			return f2fs_ioc_prefetch_map(filp, arg);
 		case F2FS_IOC_SET_ENCRYPTION_POLICY:
 			return f2fs_ioc_set_encryption_policy(filp, arg);
 		case F2FS_IOC_GET_ENCRYPTION_POLICY:
@@ -1565,6 +1747,9 @@ long f2fs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case F2FS_IOC32_SETFLAGS:
 		cmd = F2FS_IOC_SETFLAGS;
 		break;
+	case F2FS_IOC_PREFETCH_MAP:
+	case F2FS_IOC_COMMIT_ATOMIC_TXN:
+		break;
 	default:
 		return -ENOIOCTLCMD;
 	}
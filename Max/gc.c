@@ -24,6 +24,103 @@
 #include "gc.h"
 #include <trace/events/f2fs.h>
 
+/* sections that have to stay free, as in has_not_enough_free_secs() */
+static unsigned int gc_needed_secs(struct f2fs_sb_info *sbi) {
+	return get_blocktype_secs(sbi, F2FS_DIRTY_NODES) +
+		   2 * get_blocktype_secs(sbi, F2FS_DIRTY_DENTS) +
+		   reserved_sections(sbi);
+}
+
+/*
+ * Resample the writeback load and the slope of free sections, at most once
+ * per GC_SCHED_SAMPLE_MS, and turn the projected time left until
+ * has_not_enough_free_secs() into an urgency.
+ */
+static void gc_sched_update(struct f2fs_sb_info *sbi,
+							struct f2fs_gc_kthread *gc_th) {
+	unsigned int free_secs, needed, consumed, elapsed, urgency;
+	u64 rate;
+
+	spin_lock(&gc_th->sched_lock);
+	elapsed = jiffies_to_msecs(jiffies - gc_th->last_sample);
+	if (elapsed < GC_SCHED_SAMPLE_MS)
+		goto out;
+
+	free_secs = free_sections(sbi);
+	needed = gc_needed_secs(sbi);
+	consumed = gc_th->last_free_secs > free_secs ?
+			   gc_th->last_free_secs - free_secs : 0;
+	rate = div_u64((u64) consumed * 1000 * MSEC_PER_SEC, elapsed);
+	gc_th->alloc_rate = (3 * gc_th->alloc_rate +
+						 (unsigned int) min_t(u64, rate, UINT_MAX / 4)) / 4;
+	gc_th->last_free_secs = free_secs;
+	gc_th->last_sample = jiffies;
+
+	if (free_secs <= needed)
+		gc_th->runway = 0;
+	else if (!gc_th->alloc_rate)
+		gc_th->runway = GC_RUNWAY_INFINITE;
+	else
+		gc_th->runway = min_t(u64, div_u64((u64) (free_secs - needed) * 1000,
+										   gc_th->alloc_rate),
+							  GC_RUNWAY_INFINITE - 1);
+
+	if (gc_th->runway <= gc_th->urgent_horizon)
+		urgency = GC_URGENCY_SCALE;
+	else if (gc_th->runway >= gc_th->relaxed_horizon)
+		urgency = 0;
+	else
+		urgency = div_u64((u64) GC_URGENCY_SCALE *
+						  (gc_th->relaxed_horizon - gc_th->runway),
+						  gc_th->relaxed_horizon - gc_th->urgent_horizon);
+
+	/* piled up garbage keeps some cleaning going, as the legacy policy */
+	if (urgency < GC_URGENCY_SCALE / 4 && has_enough_invalid_blocks(sbi))
+		urgency = GC_URGENCY_SCALE / 4;
+
+	gc_th->urgency = urgency;
+	gc_th->wb_pages = get_pages(sbi, F2FS_WRITEBACK);
+	out:
+	spin_unlock(&gc_th->sched_lock);
+}
+
+static void gc_sched_decide(struct f2fs_gc_kthread *gc_th, unsigned int decision) {
+	spin_lock(&gc_th->sched_lock);
+	gc_th->decision = decision;
+	gc_th->nr_decisions[decision]++;
+	spin_unlock(&gc_th->sched_lock);
+}
+
+/*
+ * The interval between cleaned sections shrinks from max_sleep_time to
+ * urgent_sleep_time as urgency grows; it drops at once but grows back
+ * gradually. Cleaning is skipped while our own writeback is in flight,
+ * unless free sections are about to run out.
+ */
+static bool gc_sched_should_run(struct f2fs_sb_info *sbi,
+								struct f2fs_gc_kthread *gc_th, long *wait_ms) {
+	unsigned int urgency, hi, lo;
+	long target;
+
+	gc_sched_update(sbi, gc_th);
+	urgency = READ_ONCE(gc_th->urgency);
+
+	hi = gc_th->max_sleep_time;
+	lo = min(gc_th->urgent_sleep_time, hi);
+	target = hi - (long) div_u64((u64) (hi - lo) * urgency, GC_URGENCY_SCALE);
+	if (target < *wait_ms)
+		*wait_ms = target;
+	else
+		*wait_ms += (target - *wait_ms) / 4;
+
+	if (READ_ONCE(gc_th->wb_pages) > gc_th->busy_wb_pages &&
+		urgency < GC_URGENCY_SCALE / 2) {
+		gc_sched_decide(gc_th, GC_DECIDE_BUSY);
+		return false;
+	}
+	return true;
+}
+
 static int gc_thread_func(void *data) {
 	struct f2fs_sb_info *sbi = data;
 	struct f2fs_gc_kthread *gc_th = sbi->gc_thread;
@@ -44,12 +141,19 @@ static int gc_thread_func(void *data) {
 
 		if (sbi->sb->s_writers.frozen >= SB_FREEZE_WRITE) {
 			increase_sleep_time(gc_th, &wait_ms);
+			if (gc_th->gc_sched == GC_SCHED_ADAPTIVE)
+				gc_sched_decide(gc_th, GC_DECIDE_FROZEN);
 			continue;
 		}
 
+		if (gc_th->gc_sched == GC_SCHED_ADAPTIVE) {
+			if (!gc_sched_should_run(sbi, gc_th, &wait_ms))
+				continue;
+			goto do_gc;
+		}
+
 		/*
 		 * [GC triggering condition]
-		 * 0. GC is not conducted currently.
 		 * 1. There are enough dirty segments.
 		 * 2. IO subsystem is idle by checking the # of writeback pages.
 		 * 3. IO subsystem is idle by checking the # of requests in
@@ -59,13 +163,12 @@ static int gc_thread_func(void *data) {
 		 * Because it is possible that some segments can be
 		 * invalidated soon after by user update or deletion.
 		 * So, I'd like to wait some time to collect dirty segments.
+		 *
+		 * Other workers may be cleaning at the same time, victims are
+		 * kept disjoint by get_victim_by_default().
 		 */
-		if (!mutex_trylock(&sbi->gc_mutex))
-			continue;
-
 		if (!is_idle(sbi)) {
 			increase_sleep_time(gc_th, &wait_ms);
-			mutex_unlock(&sbi->gc_mutex);
 			continue;
 		}
 
@@ -74,11 +177,17 @@ static int gc_thread_func(void *data) {
 		else
 			increase_sleep_time(gc_th, &wait_ms);
 
+		do_gc:
 		stat_inc_bggc_count(sbi);
 
 		/* if return value is not zero, no victim was selected */
-		if (f2fs_gc(sbi))
+		if (f2fs_gc(sbi)) {
 			wait_ms = gc_th->no_gc_sleep_time;
+			if (gc_th->gc_sched == GC_SCHED_ADAPTIVE)
+				gc_sched_decide(gc_th, GC_DECIDE_NO_VICTIM);
+		} else if (gc_th->gc_sched == GC_SCHED_ADAPTIVE) {
+			gc_sched_decide(gc_th, GC_DECIDE_RUN);
+		}
 
 		/* balancing f2fs's metadata periodically */
 		f2fs_balance_fs_bg(sbi);
@@ -87,10 +196,20 @@ static int gc_thread_func(void *data) {
 	return 0;
 }
 
+static void __stop_gc_workers(struct f2fs_sb_info *sbi,
+							  struct f2fs_gc_kthread *gc_th) {
+	int i;
+
+	for (i = 0; i < sbi->nr_gc_workers; i++)
+		if (!IS_ERR_OR_NULL(gc_th->f2fs_gc_tasks[i]))
+			kthread_stop(gc_th->f2fs_gc_tasks[i]);
+	kfree(gc_th->f2fs_gc_tasks);
+}
+
 int start_gc_thread(struct f2fs_sb_info *sbi) {
 	struct f2fs_gc_kthread *gc_th;
 	dev_t dev = sbi->sb->s_bdev->bd_dev;
-	int err = 0;
+	int err = 0, i;
 
 	gc_th = kmalloc(sizeof(struct f2fs_gc_kthread), GFP_KERNEL);
 	if (!gc_th) {
@@ -98,20 +217,48 @@ int start_gc_thread(struct f2fs_sb_info *sbi) {
 		goto out;
 	}
 
+	gc_th->f2fs_gc_tasks = kcalloc(sbi->nr_gc_workers,
+								   sizeof(struct task_struct *), GFP_KERNEL);
+	if (!gc_th->f2fs_gc_tasks) {
+		kfree(gc_th);
+		err = -ENOMEM;
+		goto out;
+	}
+
 	gc_th->min_sleep_time = DEF_GC_THREAD_MIN_SLEEP_TIME;
 	gc_th->max_sleep_time = DEF_GC_THREAD_MAX_SLEEP_TIME;
 	gc_th->no_gc_sleep_time = DEF_GC_THREAD_NOGC_SLEEP_TIME;
 
 	gc_th->gc_idle = 0;
 
+	gc_th->gc_sched = GC_SCHED_ADAPTIVE;
+	gc_th->urgent_sleep_time = DEF_GC_URGENT_SLEEP_TIME;
+	gc_th->busy_wb_pages = DEF_GC_BUSY_WB_PAGES;
+	gc_th->urgent_horizon = DEF_GC_URGENT_HORIZON;
+	gc_th->relaxed_horizon = DEF_GC_RELAXED_HORIZON;
+	spin_lock_init(&gc_th->sched_lock);
+	gc_th->last_sample = jiffies;
+	gc_th->last_free_secs = free_sections(sbi);
+	gc_th->alloc_rate = 0;
+	gc_th->runway = GC_RUNWAY_INFINITE;
+	gc_th->urgency = 0;
+	gc_th->wb_pages = 0;
+	gc_th->decision = GC_DECIDE_NONE;
+	memset(gc_th->nr_decisions, 0, sizeof(gc_th->nr_decisions));
+
 	sbi->gc_thread = gc_th;
 	init_waitqueue_head(&sbi->gc_thread->gc_wait_queue_head);
-	sbi->gc_thread->f2fs_gc_task = kthread_run(gc_thread_func, sbi,
-											   "f2fs_gc-%u:%u", MAJOR(dev), MINOR(dev));
-	if (IS_ERR(gc_th->f2fs_gc_task)) {
-		err = PTR_ERR(gc_th->f2fs_gc_task);
-		kfree(gc_th);
-		sbi->gc_thread = NULL;
+	for (i = 0; i < sbi->nr_gc_workers; i++) {
+		gc_th->f2fs_gc_tasks[i] = kthread_run(gc_thread_func, sbi,
+											  "f2fs_gc-%u:%u-%d", MAJOR(dev),
+											  MINOR(dev), i);
+		if (IS_ERR(gc_th->f2fs_gc_tasks[i])) {
+			err = PTR_ERR(gc_th->f2fs_gc_tasks[i]);
+			__stop_gc_workers(sbi, gc_th);
+			kfree(gc_th);
+			sbi->gc_thread = NULL;
+			break;
+		}
 	}
 	out:
 	return err;
@@ -121,7 +268,7 @@ void stop_gc_thread(struct f2fs_sb_info *sbi) {
 	struct f2fs_gc_kthread *gc_th = sbi->gc_thread;
 	if (!gc_th)
 		return;
-	kthread_stop(gc_th->f2fs_gc_task);
+	__stop_gc_workers(sbi, gc_th);
 	kfree(gc_th);
 	sbi->gc_thread = NULL;
 }
@@ -145,12 +292,12 @@ static void select_policy(struct f2fs_sb_info *sbi, int gc_type,
 	if (p->alloc_mode == SSR) {
 		p->gc_mode = GC_GREEDY;
 		p->dirty_segmap = dirty_i->dirty_segmap[type];
-		p->max_search = dirty_i->nr_dirty[type];
+		p->max_search = get_nr_dirty(dirty_i, type);
 		p->ofs_unit = 1;
 	} else {
 		p->gc_mode = select_gc_type(sbi->gc_thread, gc_type);
 		p->dirty_segmap = dirty_i->dirty_segmap[DIRTY];
-		p->max_search = dirty_i->nr_dirty[DIRTY];
+		p->max_search = get_nr_dirty(dirty_i, DIRTY);
 		p->ofs_unit = sbi->segs_per_sec;
 	}
 
@@ -213,8 +360,12 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno) {
 	/* Handle if the system time has changed by the user */
 	if (mtime < sit_i->min_mtime)
 		sit_i->min_mtime = mtime;
+#ifdef LOCKFREE_SIT
+	advance_mtime(&sit_i->max_mtime, mtime);
+#else
 	if (mtime > sit_i->max_mtime)
 		sit_i->max_mtime = mtime;
+#endif
 	if (sit_i->max_mtime != sit_i->min_mtime)
 		age = 100 - div64_u64(100 * (mtime - sit_i->min_mtime),
 							  sit_i->max_mtime - sit_i->min_mtime);
@@ -225,7 +376,7 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno) {
 static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 									   unsigned int segno, struct victim_sel_policy *p) {
 	if (p->alloc_mode == SSR)
-		return get_seg_entry(sbi, segno)->ckpt_valid_blocks;
+		return get_ckpt_valid_blocks(get_seg_entry(sbi, segno));
 
 	/* alloc_mode == LFS */
 	if (p->gc_mode == GC_GREEDY)
@@ -234,6 +385,94 @@ static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 		return get_cb_cost(sbi, segno);
 }
 
+/*
+ * Evaluate the dirty segments of a candidate section, keeping the cheapest
+ * one in @p. Returns the number of segments evaluated.
+ */
+static int __check_victim_sec(struct f2fs_sb_info *sbi, unsigned int secno,
+							  int gc_type, struct victim_sel_policy *p,
+							  unsigned int max_cost) {
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int start = secno * sbi->segs_per_sec;
+	unsigned int segno, cost;
+	int nsearched = 0;
+
+	if (sec_usage_check(sbi, secno))
+		return 0;
+	if (gc_type == BG_GC && test_bit(secno, dirty_i->victim_secmap))
+		return 0;
+
+	for (segno = start; segno < start + sbi->segs_per_sec;
+		 segno += p->ofs_unit) {
+		/* LFS picks a whole section if any of its segments is dirty */
+		if (p->ofs_unit > 1)
+			segno = find_next_bit(p->dirty_segmap, start + sbi->segs_per_sec,
+								  start);
+		else if (!test_bit(segno, p->dirty_segmap))
+			continue;
+		if (segno >= start + sbi->segs_per_sec)
+			break;
+
+		cost = get_gc_cost(sbi, segno, p);
+		nsearched++;
+		if (cost == max_cost)
+			continue;
+		if (p->min_cost > cost) {
+			p->min_segno = segno;
+			p->min_cost = cost;
+		}
+	}
+	return nsearched;
+}
+
+/*
+ * Walk the valid block buckets from the emptiest one and stop in the first
+ * bucket that gives a victim, after at most max_search candidates in total.
+ * Sections in one bucket differ by less than 1/NR_GC_BUCKETS in
+ * utilization, so this is greedy up to the bucket width; cost-benefit
+ * additionally weighs the age of the candidates found there.
+ */
+static void __get_victim_indexed(struct f2fs_sb_info *sbi, int gc_type,
+								 struct victim_sel_policy *p,
+								 unsigned int max_cost) {
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int start = GET_SECNO(sbi, p->offset);
+	unsigned int secno, nsearched = 0;
+	bool wrapped;
+	int b;
+
+	if (start >= MAIN_SECS(sbi))
+		start = 0;
+
+	for (b = 0; b < NR_GC_BUCKETS && nsearched < p->max_search; b++) {
+		unsigned long *bucket = dirty_i->gc_buckets[b];
+
+		if (!atomic_read(&dirty_i->nr_gc_bucket[b]))
+			continue;
+
+		wrapped = false;
+		secno = find_next_bit(bucket, MAIN_SECS(sbi), start);
+		while (nsearched < p->max_search) {
+			if (secno >= MAIN_SECS(sbi)) {
+				if (wrapped || !start)
+					break;
+				wrapped = true;
+				secno = find_next_bit(bucket, MAIN_SECS(sbi), 0);
+				continue;
+			}
+			if (wrapped && secno >= start)
+				break;
+			nsearched += __check_victim_sec(sbi, secno, gc_type, p, max_cost);
+			secno = find_next_bit(bucket, MAIN_SECS(sbi), secno + 1);
+		}
+
+		if (p->min_segno != NULL_SEGNO) {
+			sbi->last_victim[p->gc_mode] = p->min_segno + p->ofs_unit;
+			return;
+		}
+	}
+}
+
 /*
  * This function is called from two paths.
  * One is garbage collection and the other is SSR segment selection.
@@ -247,7 +486,6 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	struct victim_sel_policy p;
 	unsigned int secno, max_cost;
-	int nsearched = 0;
 
 	mutex_lock(&dirty_i->seglist_lock);
 
@@ -263,58 +501,22 @@ static int get_victim_by_default(struct f2fs_sb_info *sbi,
 			goto got_it;
 	}
 
-	while (1) {
-		unsigned long cost;
-		unsigned int segno;
-
-		segno = find_next_bit(p.dirty_segmap, MAIN_SEGS(sbi), p.offset);
-		if (segno >= MAIN_SEGS(sbi)) {
-			if (sbi->last_victim[p.gc_mode]) {
-				sbi->last_victim[p.gc_mode] = 0;
-				p.offset = 0;
-				continue;
-			}
-			break;
-		}
-
-		p.offset = segno + p.ofs_unit;
-		if (p.ofs_unit > 1)
-			p.offset -= segno % p.ofs_unit;
-
-		secno = GET_SECNO(sbi, segno);
-
-		if (sec_usage_check(sbi, secno))
-			continue;
-		if (gc_type == BG_GC && test_bit(secno, dirty_i->victim_secmap))
-			continue;
-
-		cost = get_gc_cost(sbi, segno, &p);
-
-		if (p.min_cost > cost) {
-			p.min_segno = segno;
-			p.min_cost = cost;
-		} else if (unlikely(cost == max_cost)) {
-			continue;
-		}
+	__get_victim_indexed(sbi, gc_type, &p, max_cost);
 
-		if (nsearched++ >= p.max_search) {
-			sbi->last_victim[p.gc_mode] = segno;
-			break;
-		}
-	}
 	if (p.min_segno != NULL_SEGNO) {
 		got_it:
+		secno = NULL_SECNO;
 		if (p.alloc_mode == LFS) {
 			secno = GET_SECNO(sbi, p.min_segno);
-			if (gc_type == FG_GC)
-				sbi->cur_victim_sec = secno;
-			else
+			/* keep other workers and SSR off the section being cleaned */
+			set_bit(secno, dirty_i->gc_busy_secmap);
+			if (gc_type == BG_GC)
 				set_bit(secno, dirty_i->victim_secmap);
 		}
 		*result = (p.min_segno / p.ofs_unit) * p.ofs_unit;
 
 		trace_f2fs_get_victim(sbi->sb, type, gc_type, &p,
-							  sbi->cur_victim_sec,
+							  gc_type == FG_GC ? secno : NULL_SECNO,
 							  prefree_segments(sbi), free_segments(sbi));
 	}
 	mutex_unlock(&dirty_i->seglist_lock);
@@ -365,10 +567,16 @@ static int check_valid_map(struct f2fs_sb_info *sbi,
 	struct seg_entry *sentry;
 	int ret;
 
+#ifdef LOCKFREE_SIT
+	/* the valid map is updated atomically, no need of sentry_lock */
+	sentry = get_seg_entry(sbi, segno);
+	ret = f2fs_test_bit(offset, sentry->cur_valid_map);
+#else
 	mutex_lock(&sit_i->sentry_lock);
 	sentry = get_seg_entry(sbi, segno);
 	ret = f2fs_test_bit(offset, sentry->cur_valid_map);
 	mutex_unlock(&sit_i->sentry_lock);
+#endif
 	return ret;
 }
 
@@ -565,8 +773,13 @@ static void move_encrypted_block(struct inode *inode, block_t bidx) {
 
 	/* allocate block address */
 	f2fs_wait_on_page_writeback(dn.node_page, NODE);
+#ifdef MLOG
+	fio.mlog = allocate_data_block(fio.sbi, NULL, fio.blk_addr,
+								   &fio.blk_addr, &sum, CURSEG_COLD_DATA);
+#else
 	allocate_data_block(fio.sbi, NULL, fio.blk_addr,
 						&fio.blk_addr, &sum, CURSEG_COLD_DATA);
+#endif
 	fio.rw = WRITE_SYNC;
 	f2fs_submit_page_mbio(&fio);
 
@@ -771,6 +984,48 @@ static void do_garbage_collect(struct f2fs_sb_info *sbi, unsigned int segno,
 	f2fs_put_page(sum_page, 0);
 }
 
+/*
+ * The first foreground collector in writes a checkpoint to turn prefree
+ * sections into free ones; later ones wait for a checkpoint in flight.
+ */
+static void start_fg_gc(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
+	if (atomic_inc_return(&sbi->nr_fg_collectors) == 1 &&
+		mutex_trylock(&sbi->cp_mutex)) {
+		mutex_unlock(&sbi->cp_mutex);
+		write_checkpoint(sbi, cpc);
+		return;
+	}
+	mutex_lock(&sbi->cp_mutex);
+	mutex_unlock(&sbi->cp_mutex);
+}
+
+/*
+ * A foreground collector that freed sections needs a checkpoint started
+ * after it finished cleaning. Collectors queued behind one checkpoint all
+ * reuse it, and none waits for more than the one in flight plus its own.
+ */
+static void finish_fg_gc(struct f2fs_sb_info *sbi, struct cp_control *cpc,
+						 int nfree) {
+	int seq;
+
+	atomic_dec(&sbi->nr_fg_collectors);
+	if (!nfree)
+		return;
+
+	seq = atomic_read(&sbi->fg_gc_cp_seq);
+	mutex_lock(&sbi->fg_gc_cp_mutex);
+	if (atomic_read(&sbi->fg_gc_cp_seq) == seq) {
+		atomic_inc(&sbi->fg_gc_cp_seq);
+		write_checkpoint(sbi, cpc);
+	}
+	mutex_unlock(&sbi->fg_gc_cp_mutex);
+}
+
+/*
+ * Clean victim sections until there are enough free ones. Several callers
+ * may run this concurrently; each of them cleans its own victims, which
+ * stay marked in gc_busy_secmap until they are collected.
+ */
 int f2fs_gc(struct f2fs_sb_info *sbi) {
 	unsigned int segno, i;
 	int gc_type = BG_GC;
@@ -782,6 +1037,7 @@ int f2fs_gc(struct f2fs_sb_info *sbi) {
 			.iroot = RADIX_TREE_INIT(GFP_NOFS),
 	};
 
+	down_read(&sbi->gc_rwsem);
 	cpc.reason = __get_cp_reason(sbi);
 	gc_more:
 	if (unlikely(!(sbi->sb->s_flags & MS_ACTIVE)))
@@ -791,7 +1047,7 @@ int f2fs_gc(struct f2fs_sb_info *sbi) {
 
 	if (gc_type == BG_GC && has_not_enough_free_secs(sbi, nfree)) {
 		gc_type = FG_GC;
-		write_checkpoint(sbi, &cpc);
+		start_fg_gc(sbi, &cpc);
 	}
 
 	if (!__get_victim(sbi, &segno, gc_type))
@@ -806,8 +1062,8 @@ int f2fs_gc(struct f2fs_sb_info *sbi) {
 	for (i = 0; i < sbi->segs_per_sec; i++)
 		do_garbage_collect(sbi, segno + i, &gc_list, gc_type);
 
+	clear_bit(GET_SECNO(sbi, segno), DIRTY_I(sbi)->gc_busy_secmap);
 	if (gc_type == FG_GC) {
-		sbi->cur_victim_sec = NULL_SEGNO;
 		nfree++;
 		WARN_ON(get_valid_blocks(sbi, segno, sbi->segs_per_sec));
 	}
@@ -815,10 +1071,10 @@ int f2fs_gc(struct f2fs_sb_info *sbi) {
 	if (has_not_enough_free_secs(sbi, nfree))
 		goto gc_more;
 
-	if (gc_type == FG_GC)
-		write_checkpoint(sbi, &cpc);
 	stop:
-	mutex_unlock(&sbi->gc_mutex);
+	if (gc_type == FG_GC)
+		finish_fg_gc(sbi, &cpc, nfree);
+	up_read(&sbi->gc_rwsem);
 
 	put_gc_inode(&gc_list);
 	return ret;
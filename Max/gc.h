@@ -24,11 +24,37 @@
 #define LIMIT_INVALID_BLOCK	40 /* percentage over total user space */
 #define LIMIT_FREE_BLOCK	40 /* percentage over invalid + free space */
 
+/* adaptive background GC scheduler, see gc_sched_update() */
+#define DEF_GC_URGENT_SLEEP_TIME	100	/* ms, at full cleaning bandwidth */
+#define DEF_GC_BUSY_WB_PAGES		256	/* in-flight pages to call it busy */
+#define DEF_GC_URGENT_HORIZON		60	/* seconds of free sections left */
+#define DEF_GC_RELAXED_HORIZON		3600
+#define GC_SCHED_SAMPLE_MS		1000	/* min. interval between samples */
+#define GC_URGENCY_SCALE		1024
+#define GC_RUNWAY_INFINITE		UINT_MAX
+
+enum {
+	GC_SCHED_LEGACY,	/* is_idle() and fixed sleep time backoff */
+	GC_SCHED_ADAPTIVE,	/* writeback load and free section slope */
+};
+
+/* last decision of the adaptive scheduler, shown in debugfs */
+enum {
+	GC_DECIDE_NONE,		/* not woken up yet */
+	GC_DECIDE_RUN,		/* cleaned a section */
+	GC_DECIDE_BUSY,		/* skipped, foreground writeback in flight */
+	GC_DECIDE_NO_VICTIM,	/* nothing to clean */
+	GC_DECIDE_FROZEN,	/* filesystem frozen */
+};
+
+/* default # of GC workers, one for every DEF_MLOGS_PER_GC_WORKER mlogs */
+#define DEF_MLOGS_PER_GC_WORKER	4
+
 /* Search max. number of dirty segments to select a victim segment */
 #define DEF_MAX_VICTIM_SEARCH 4096 /* covers 8GB */
 
 struct f2fs_gc_kthread {
-	struct task_struct *f2fs_gc_task;
+	struct task_struct **f2fs_gc_tasks;	/* sbi->nr_gc_workers threads */
 	wait_queue_head_t gc_wait_queue_head;
 
 	/* for gc sleep time */
@@ -38,6 +64,24 @@ struct f2fs_gc_kthread {
 
 	/* for changing gc mode */
 	unsigned int gc_idle;
+
+	/* adaptive scheduler tunables, in sysfs */
+	unsigned int gc_sched;			/* GC_SCHED_* */
+	unsigned int urgent_sleep_time;		/* ms, at full urgency */
+	unsigned int busy_wb_pages;		/* writeback pages meaning busy */
+	unsigned int urgent_horizon;		/* seconds, full urgency below */
+	unsigned int relaxed_horizon;		/* seconds, no urgency above */
+
+	/* adaptive scheduler state, protected by sched_lock */
+	spinlock_t sched_lock;
+	unsigned long last_sample;		/* jiffies */
+	unsigned int last_free_secs;
+	unsigned int alloc_rate;		/* sections consumed per 1000s */
+	unsigned int runway;			/* seconds until free sections run out */
+	unsigned int urgency;			/* 0 .. GC_URGENCY_SCALE */
+	unsigned int wb_pages;			/* in-flight writeback pages */
+	unsigned int decision;			/* GC_DECIDE_* */
+	unsigned long long nr_decisions[GC_DECIDE_FROZEN + 1];
 };
 
 struct gc_inode_list {
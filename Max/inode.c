@@ -324,6 +324,9 @@ void f2fs_evict_inode(struct inode *inode) {
 	trace_f2fs_evict_inode(inode);
 	truncate_inode_pages_final(&inode->i_data);
 
+	if (S_ISDIR(inode->i_mode))
+		f2fs_drop_dir_index(inode);
+
 #ifdef FILE_CELL
 	if (F2FS_IS_NODE(sbi, inode->i_ino) || inode->i_ino == F2FS_META_INO(sbi))
 		goto out_clear;
@@ -358,6 +361,7 @@ void f2fs_evict_inode(struct inode *inode) {
 	if (inode->i_nlink)
 		f2fs_preserve_extent_tree(inode);
 	f2fs_destroy_extent_tree(inode);
+	f2fs_drop_block_map(inode);
 #ifdef FILE_CELL
 	invalidate_mapping_pages(NODE_MAPPING(sbi, inode->i_ino), inode->i_ino, inode->i_ino);
 #else
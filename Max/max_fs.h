@@ -108,7 +108,13 @@ struct f2fs_super_block {
 
 /*
  * For checkpoint
+ *
+ * CP_NODE_SEQ_FLAG changes the node footer format: cp_ver then holds the
+ * lower 32 bits of the checkpoint version in its lower half, and in its
+ * upper half the order the node block was written in across all logs.
  */
+#define CP_NODE_SEQ_FLAG	0x00000040
+#define NODE_SEQ_CP_VER_MASK	0xffffffffULL	/* cp_ver bits under the flag */
 #define CP_FASTBOOT_FLAG	0x00000020
 #define CP_FSCK_FLAG		0x00000010
 #define CP_ERROR_FLAG		0x00000008
@@ -272,16 +278,37 @@ struct node_footer {
 	__le32 nid;		/* node id */
 	__le32 ino;		/* inode nunmber */
 	__le32 flag;		/* include cold/fsync/dentry marks and offset */
-	__le64 cp_ver;		/* checkpoint version */
+	__le64 cp_ver;		/* checkpoint version, see CP_NODE_SEQ_FLAG */
 	__le32 next_blkaddr;	/* next node page block address */
 } __packed;
 
+/*
+ * Commit record of a multi-file atomic write. It is a warm node block with
+ * nid and ino 0, which roll-forward recovery unaware of it skips. Each
+ * member names the last node block the transaction wrote for that inode.
+ */
+#define F2FS_TXN_MAGIC		0xF2F57A1C
+#define F2FS_TXN_MAX_MEMBERS	16
+
+struct f2fs_txn_member {
+	__le32 ino;		/* member inode number */
+	__le32 blkaddr;		/* its last node block in the transaction */
+} __packed;
+
+struct f2fs_txn_record {
+	__le32 magic;		/* F2FS_TXN_MAGIC */
+	__le32 nr_members;	/* # of valid members */
+	__le32 checksum;	/* crc32 of the members */
+	struct f2fs_txn_member members[F2FS_TXN_MAX_MEMBERS];
+} __packed;
+
 struct f2fs_node {
-	/* can be one of three types: inode, direct, and indirect types */
+	/* can be one of four types: inode, direct, indirect and txn record */
 	union {
 		struct f2fs_inode i;
 		struct direct_node dn;
 		struct indirect_node in;
+		struct f2fs_txn_record txn;
 	};
 	struct node_footer footer;
 } __packed;
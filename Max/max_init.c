@@ -6,16 +6,21 @@
 #include "f2fs.h"
 
 int init_max_info(struct f2fs_sb_info *sbi) {
-	sbi->max_info = kmalloc(sizeof(struct max_info), GFP_KERNEL);
+	sbi->max_info = kzalloc(sizeof(struct max_info), GFP_KERNEL);
 	struct max_info *max_i;
+	int err;
 	max_i = sbi->max_info;
 	if (!max_i) {
 		// error
 		return -ENOMEM;
 	}
 #ifdef RPS
-	rps_init_rwsem(&max_i->rps_cp_rwsem);
-	rps_init_rwsem(&max_i->rps_node_write);
+	err = rps_init_rwsem(&max_i->rps_cp_rwsem);
+	if (err)
+		goto fail;
+	err = rps_init_rwsem(&max_i->rps_node_write);
+	if (err)
+		goto fail;
 #endif
 
 #ifdef FILE_CELL
@@ -26,15 +31,33 @@ int init_max_info(struct f2fs_sb_info *sbi) {
 	
 	if (sbi->node_count > NAT_ENTRY_PER_BLOCK - 3) {
 		f2fs_msg(sbi->sb, KERN_ERR, "Max does support so many file cells");
-		return -1;
+		err = -EINVAL;
+		goto fail;
 	}
+
+	err = init_node_flush_works(sbi);
+	if (err)
+		goto fail;
 #endif
 
+	max_i->meta_flush_wq = alloc_workqueue("max_meta_flush-%s",
+										   WQ_UNBOUND | WQ_MEM_RECLAIM, 0,
+										   sbi->sb->s_id);
+	if (!max_i->meta_flush_wq) {
+		err = -ENOMEM;
+		goto fail;
+	}
+
 #ifdef MLOG
 	atomic_set(&sbi->next_mlog, 0);
 #endif
 
 	return 1;
+
+	fail:
+	/* max_info is zeroed, so a partial setup is torn down safely */
+	destroy_max_info(sbi);
+	return err;
 }
 
 int destroy_max_info(struct f2fs_sb_info *sbi) {
@@ -45,6 +68,11 @@ int destroy_max_info(struct f2fs_sb_info *sbi) {
 	rps_free_rwsem(&max_info->rps_cp_rwsem);
 	rps_free_rwsem(&max_info->rps_node_write);
 #endif
+#ifdef FILE_CELL
+	destroy_node_flush_works(sbi);
+#endif
+	if (max_info->meta_flush_wq)
+		destroy_workqueue(max_info->meta_flush_wq);
 	kfree(max_info);
 	sbi->max_info = NULL;
 	return 1;
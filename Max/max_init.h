@@ -1,9 +1,24 @@
 
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
 
 #include "rps.h"
 
+struct f2fs_sb_info;
+
+/* writes back the dirty node pages of one file cell during checkpoint */
+struct node_flush_work {
+	struct work_struct work;
+	struct f2fs_sb_info *sbi;
+	int cell;
+};
+
 struct max_info {
 	struct rps rps_cp_rwsem;
 	struct rps rps_node_write;
+#ifdef FILE_CELL
+	struct workqueue_struct *node_flush_wq;
+	struct node_flush_work *node_flush_works;	/* one per file cell */
+#endif
+	struct workqueue_struct *meta_flush_wq;	/* NAT/SIT block flush at checkpoint */
 };
\ No newline at end of file
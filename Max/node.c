@@ -14,6 +14,7 @@
 #include <linux/blkdev.h>
 #include <linux/pagevec.h>
 #include <linux/swap.h>
+#include <linux/sort.h>
 
 #include "f2fs.h"
 #include "max_fs.h"
@@ -30,6 +31,9 @@ static struct kmem_cache *nat_entry_set_slab;
 #ifdef FILE_CELL
 static struct kmem_cache *per_core_sets_pack_slab;
 #endif
+#ifdef DIRTY_NODE_INDEX
+static struct kmem_cache *dirty_node_slab;
+#endif
 
 bool available_free_memory(struct f2fs_sb_info *sbi, int type) {
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
@@ -44,7 +48,7 @@ bool available_free_memory(struct f2fs_sb_info *sbi, int type) {
 	avail_ram = val.totalram - val.totalhigh;
 
 	/*
-	 * give 25%, 25%, 50%, 50%, 50% memory for each components respectively
+	 * give 25%, 25%, 50%, 50%, 50%, 12.5%, 12.5% memory for each components respectively
 	 */
 	if (type == FREE_NIDS) {
 #ifdef PER_CORE_NID_LIST
@@ -81,10 +85,19 @@ bool available_free_memory(struct f2fs_sb_info *sbi, int type) {
 #endif
 		res = mem_size < ((avail_ram * nm_i->ram_thresh / 100) >> 1);
 	} else if (type == EXTENT_CACHE) {
-		mem_size = (sbi->total_ext_tree * sizeof(struct extent_tree) +
+		mem_size = (atomic_read(&sbi->total_ext_tree) * sizeof(struct extent_tree) +
 					atomic_read(&sbi->total_ext_node) *
 					sizeof(struct extent_node)) >> PAGE_CACHE_SHIFT;
 		res = mem_size < ((avail_ram * nm_i->ram_thresh / 100) >> 1);
+	} else if (type == DIR_INDEX) {
+		mem_size = (atomic_read(&sbi->total_dindex_entries) *
+					sizeof(struct dindex_entry) +
+					atomic_long_read(&sbi->total_dindex_mem)) >> PAGE_CACHE_SHIFT;
+		res = mem_size < ((avail_ram * nm_i->ram_thresh / 100) >> 3);
+	} else if (type == BMAP_CACHE) {
+		mem_size = (atomic_read(&sbi->total_bmap_entries) *
+					BMAP_ENTRY_SIZE) >> PAGE_CACHE_SHIFT;
+		res = mem_size < ((avail_ram * nm_i->ram_thresh / 100) >> 3);
 	} else {
 		if (sbi->sb->s_bdi->wb.dirty_exceeded)
 			return false;
@@ -119,37 +132,12 @@ static struct page *get_current_nat_page(struct f2fs_sb_info *sbi, nid_t nid) {
 }
 
 static struct page *get_next_nat_page(struct f2fs_sb_info *sbi, nid_t nid) {
-	struct page *src_page;
 	struct page *dst_page;
 	pgoff_t src_off;
-	pgoff_t dst_off;
-	void *src_addr;
-	void *dst_addr;
-	struct f2fs_nm_info *nm_i = NM_I(sbi);
 
 	src_off = current_nat_addr(sbi, nid);
-	dst_off = next_nat_addr(sbi, src_off);
-
-	/* get current nat block page with lock */
-	src_page = get_meta_page(sbi, src_off);
-	dst_page = grab_meta_page(sbi, dst_off);
-#ifdef FILE_CELL
-	// may scan the meta page multiple times during flush, so not a bug in per core NAT.
-	f2fs_bug_on(sbi, PageDirty(src_page));
-#else
-	f2fs_bug_on(sbi, PageDirty(src_page));
-#endif
-
-	src_addr = page_address(src_page);
-	dst_addr = page_address(dst_page);
-	memcpy(dst_addr, src_addr, PAGE_CACHE_SIZE);
-	set_page_dirty(dst_page);
-	f2fs_put_page(src_page, 1);
-#ifdef FILE_CELL
-	set_to_next_nat(nm_i, nid);
-#else
-	set_to_next_nat(nm_i, nid);
-#endif
+	dst_page = get_next_meta_page(sbi, src_off, next_nat_addr(sbi, src_off));
+	set_to_next_nat(NM_I(sbi), nid);
 	return dst_page;
 }
 
@@ -177,6 +165,12 @@ static unsigned int __gang_lookup_nat_cache(struct f2fs_nm_info *nm_i,
 #endif
 
 
+#ifdef RCU_NAT_CACHE
+static void __free_nat_entry_rcu(struct rcu_head *head) {
+	kmem_cache_free(nat_entry_slab, container_of(head, struct nat_entry, rcu));
+}
+#endif
+
 static void __del_from_nat_cache(struct f2fs_nm_info *nm_i, struct nat_entry *e) {
 
 #ifdef FILE_CELL
@@ -190,7 +184,12 @@ static void __del_from_nat_cache(struct f2fs_nm_info *nm_i, struct nat_entry *e)
 	radix_tree_delete(&nm_i->nat_root, nat_get_nid(e));
 	nm_i->nat_cnt--;
 #endif
+#ifdef RCU_NAT_CACHE
+	/* get_node_info() may still be reading it */
+	call_rcu(&e->rcu, __free_nat_entry_rcu);
+#else
 	kmem_cache_free(nat_entry_slab, e);
+#endif
 }
 
 static void __set_nat_cache_dirty(struct f2fs_nm_info *nm_i,
@@ -354,22 +353,25 @@ bool need_inode_block_update(struct f2fs_sb_info *sbi, nid_t ino) {
 	return need_update;
 }
 
-static struct nat_entry *grab_nat_entry(struct f2fs_nm_info *nm_i, nid_t nid) {
+/* @ni is filled in before the entry becomes visible to lockless lookups */
+static struct nat_entry *grab_nat_entry(struct f2fs_nm_info *nm_i, nid_t nid,
+										struct node_info *ni) {
 	struct nat_entry *new;
 	new = f2fs_kmem_cache_alloc(nat_entry_slab, GFP_ATOMIC);
-#ifdef FILE_CELL
-	int tree_idx = TREE_IDX(nid, nm_i);
-	f2fs_radix_tree_insert(&nm_i->nat_root[tree_idx], nid, new);
 	memset(new, 0, sizeof(struct nat_entry));
+	copy_node_info(&new->ni, ni);
 	nat_set_nid(new, nid);
 	nat_reset_flag(new);
+#ifdef RCU_NAT_CACHE
+	seqcount_init(&new->seq);
+#endif
+#ifdef FILE_CELL
+	int tree_idx = TREE_IDX(nid, nm_i);
+	f2fs_radix_tree_insert(&nm_i->nat_root[tree_idx], nid, new);
 	list_add_tail(&new->list, &nm_i->nat_entries[tree_idx]);
 	nm_i->percore_nat_cnt[tree_idx]++;
 #else
 	f2fs_radix_tree_insert(&nm_i->nat_root, nid, new);
-	memset(new, 0, sizeof(struct nat_entry));
-	nat_set_nid(new, nid);
-	nat_reset_flag(new);
 	list_add_tail(&new->list, &nm_i->nat_entries);
 	nm_i->nat_cnt++;
 #endif
@@ -379,22 +381,21 @@ static struct nat_entry *grab_nat_entry(struct f2fs_nm_info *nm_i, nid_t nid) {
 static void cache_nat_entry(struct f2fs_nm_info *nm_i, nid_t nid,
 							struct f2fs_nat_entry *ne) {
 	struct nat_entry *e;
+	struct node_info ni;
+
+	node_info_from_raw_nat(&ni, ne);
 #ifdef FILE_CELL
 	int n = TREE_IDX(nid, nm_i);
 	down_write(&nm_i->nat_tree_lock[n]);
 	e = __lookup_nat_cache(nm_i, nid);
-	if (!e) {
-		e = grab_nat_entry(nm_i, nid);
-		node_info_from_raw_nat(&e->ni, ne);
-	}
+	if (!e)
+		e = grab_nat_entry(nm_i, nid, &ni);
 	up_write(&nm_i->nat_tree_lock[n]);
 #else
 	down_write(&nm_i->nat_tree_lock);
 	e = __lookup_nat_cache(nm_i, nid);
-	if (!e) {
-		e = grab_nat_entry(nm_i, nid);
-		node_info_from_raw_nat(&e->ni, ne);
-	}
+	if (!e)
+		e = grab_nat_entry(nm_i, nid, &ni);
 	up_write(&nm_i->nat_tree_lock);
 #endif
 }
@@ -408,8 +409,7 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 	down_write(&nm_i->nat_tree_lock[tree_idx]);
 	e = __lookup_nat_cache(nm_i, ni->nid);
 	if (!e) {
-		e = grab_nat_entry(nm_i, ni->nid);
-		copy_node_info(&e->ni, ni);
+		e = grab_nat_entry(nm_i, ni->nid, ni);
 		f2fs_bug_on(sbi, ni->blk_addr == NEW_ADDR);
 	} else if (new_blkaddr == NEW_ADDR) {
 		/*
@@ -417,7 +417,9 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 		 * previous nat entry can be remained in nat cache.
 		 * So, reinitialize it with new information.
 		 */
+		nat_write_begin(e);
 		copy_node_info(&e->ni, ni);
+		nat_write_end(e);
 		f2fs_bug_on(sbi, ni->blk_addr != NULL_ADDR);
 	}
 
@@ -431,6 +433,7 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 					 nat_get_blkaddr(e) != NULL_ADDR &&
 					 new_blkaddr == NEW_ADDR);
 
+	nat_write_begin(e);
 	/* increment version no as node is removed */
 	if (nat_get_blkaddr(e) != NEW_ADDR && new_blkaddr == NULL_ADDR) {
 		unsigned char version = nat_get_version(e);
@@ -439,6 +442,7 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 
 	/* change address */
 	nat_set_blkaddr(e, new_blkaddr);
+	nat_write_end(e);
 	if (new_blkaddr == NEW_ADDR || new_blkaddr == NULL_ADDR)
 		set_nat_flag(e, IS_CHECKPOINTED, false);
 	__set_nat_cache_dirty(nm_i, e);
@@ -456,8 +460,7 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 	down_write(&nm_i->nat_tree_lock);
 	e = __lookup_nat_cache(nm_i, ni->nid);
 	if (!e) {
-		e = grab_nat_entry(nm_i, ni->nid);
-		copy_node_info(&e->ni, ni);
+		e = grab_nat_entry(nm_i, ni->nid, ni);
 		f2fs_bug_on(sbi, ni->blk_addr == NEW_ADDR);
 	} else if (new_blkaddr == NEW_ADDR) {
 		/*
@@ -465,7 +468,9 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 		 * previous nat entry can be remained in nat cache.
 		 * So, reinitialize it with new information.
 		 */
+		nat_write_begin(e);
 		copy_node_info(&e->ni, ni);
+		nat_write_end(e);
 		f2fs_bug_on(sbi, ni->blk_addr != NULL_ADDR);
 	}
 
@@ -479,6 +484,7 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 					 nat_get_blkaddr(e) != NULL_ADDR &&
 					 new_blkaddr == NEW_ADDR);
 
+	nat_write_begin(e);
 	/* increment version no as node is removed */
 	if (nat_get_blkaddr(e) != NEW_ADDR && new_blkaddr == NULL_ADDR) {
 		unsigned char version = nat_get_version(e);
@@ -487,6 +493,7 @@ static void set_node_addr(struct f2fs_sb_info *sbi, struct node_info *ni,
 
 	/* change address */
 	nat_set_blkaddr(e, new_blkaddr);
+	nat_write_end(e);
 	if (new_blkaddr == NEW_ADDR || new_blkaddr == NULL_ADDR)
 		set_nat_flag(e, IS_CHECKPOINTED, false);
 	__set_nat_cache_dirty(nm_i, e);
@@ -538,6 +545,28 @@ int try_to_free_nats(struct f2fs_sb_info *sbi, int nr_shrink) {
 	return nr_shrink;
 }
 
+#ifdef RCU_NAT_CACHE
+/* the cache hit path takes no lock and writes no shared cache line */
+static bool lookup_nat_cache_rcu(struct f2fs_nm_info *nm_i, nid_t nid,
+								 struct node_info *ni) {
+	struct nat_entry *e;
+	unsigned int seq;
+
+	rcu_read_lock();
+	e = __lookup_nat_cache(nm_i, nid);
+	if (e) {
+		do {
+			seq = read_seqcount_begin(&e->seq);
+			ni->ino = nat_get_ino(e);
+			ni->blk_addr = nat_get_blkaddr(e);
+			ni->version = nat_get_version(e);
+		} while (read_seqcount_retry(&e->seq, seq));
+	}
+	rcu_read_unlock();
+	return e != NULL;
+}
+#endif
+
 /*
  * This function always returns success
  */
@@ -549,13 +578,18 @@ void get_node_info(struct f2fs_sb_info *sbi, nid_t nid, struct node_info *ni) {
 	struct f2fs_nat_block *nat_blk;
 	struct page *page = NULL;
 	struct f2fs_nat_entry ne;
+#ifndef RCU_NAT_CACHE
 	struct nat_entry *e;
+#endif
 	int i;
 
 	ni->nid = nid;
 
 	/* Check nat cache */
-#ifdef FILE_CELL
+#ifdef RCU_NAT_CACHE
+	if (lookup_nat_cache_rcu(nm_i, nid, ni))
+		return;
+#elif defined(FILE_CELL)
 	int tree_idx = TREE_IDX(nid, nm_i);
 	down_read(&nm_i->nat_tree_lock[tree_idx]); // gains a read semaphore
 	e = __lookup_nat_cache(nm_i, nid);
@@ -757,7 +791,7 @@ int get_dnode_of_data(struct dnode_of_data *dn, pgoff_t index, int mode) {
 
 		if (!nids[i] && mode == ALLOC_NODE) {
 			/* alloc new node */
-			if (!alloc_nid(sbi, &(nids[i]))) {
+			if (!alloc_nid_for_inode(sbi, &(nids[i]), dn->inode->i_ino)) {
 				err = -ENOSPC;
 				goto release_pages;
 			}
@@ -1395,6 +1429,74 @@ struct page *get_node_page_ra(struct page *parent, int start) {
 	return page;
 }
 
+/* the path from an inode to the dnode mapping one file offset */
+struct dnode_path {
+	nid_t nid;            /* node to read at the current level */
+	int level;            /* level of the dnode */
+	int offset[4];
+};
+
+/*
+ * Read ahead the dnodes mapping @nr file offsets. Instead of walking each
+ * path on its own, the nodes of one level are read for every path at once
+ * under a plug, and only then is the next level looked up. A batch of cold
+ * offsets thus waits for at most two rounds of indirect node reads, and
+ * the dnode reads are left in flight for the caller to overlap with.
+ */
+void ra_dnode_paths(struct inode *inode, pgoff_t *index, int nr) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct dnode_path path[RA_DNODE_BATCH];
+	unsigned int noffset[4], last = 0;
+	struct blk_plug plug;
+	struct page *page;
+	int i, lvl, cnt = 0, max_level = 0;
+
+	f2fs_bug_on(sbi, nr > RA_DNODE_BATCH);
+	if (f2fs_has_inline_data(inode))
+		return;
+
+	page = get_node_page(sbi, inode->i_ino);
+	if (IS_ERR(page))
+		return;
+	for (i = 0; i < nr; i++) {
+		struct dnode_path *p = &path[cnt];
+
+		p->level = get_node_path(F2FS_I(inode), index[i], p->offset,
+								 noffset);
+		/* mapped by the inode itself or by the previous dnode */
+		if (!p->level || noffset[p->level] == last)
+			continue;
+		last = noffset[p->level];
+		p->nid = get_nid(page, p->offset[0], true);
+		if (!p->nid)
+			continue;
+		max_level = max(max_level, p->level);
+		cnt++;
+	}
+	f2fs_put_page(page, 1);
+
+	for (lvl = 1; lvl <= max_level; lvl++) {
+		blk_start_plug(&plug);
+		for (i = 0; i < cnt; i++) {
+			if (path[i].nid && path[i].level >= lvl)
+				ra_node_page(sbi, path[i].nid);
+		}
+		blk_finish_plug(&plug);
+
+		for (i = 0; i < cnt; i++) {
+			if (!path[i].nid || path[i].level <= lvl)
+				continue;
+			page = get_node_page(sbi, path[i].nid);
+			if (IS_ERR(page)) {
+				path[i].nid = 0;
+				continue;
+			}
+			path[i].nid = get_nid(page, path[i].offset[lvl], false);
+			f2fs_put_page(page, 1);
+		}
+	}
+}
+
 void sync_inode_page(struct dnode_of_data *dn) {
 	if (IS_INODE(dn->node_page) || dn->inode_page == dn->node_page) {
 		update_inode(dn->inode, dn->node_page);
@@ -1409,6 +1511,335 @@ void sync_inode_page(struct dnode_of_data *dn) {
 	}
 }
 
+#ifdef DIRTY_NODE_INDEX
+
+/*
+ * Every dirty or writeback node page is listed under its owner inode, unless
+ * the entry or its shard overflowed; then fsync falls back to the cell scan
+ * until the next checkpoint empties the index.
+ */
+static inline struct address_space *node_mapping_of(struct f2fs_sb_info *sbi,
+													nid_t nid) {
+#ifdef FILE_CELL
+	return NODE_MAPPING(sbi, nid);
+#else
+	return NODE_MAPPING(sbi);
+#endif
+}
+
+static inline struct dirty_node_shard *dirty_node_shard(struct f2fs_nm_info *nm_i,
+														nid_t ino) {
+	return &nm_i->dn_shards[ino % DIRTY_NODE_SHARDS];
+}
+
+static void record_dirty_node(struct f2fs_sb_info *sbi, struct page *page) {
+	struct dirty_node_shard *shard;
+	struct dirty_node_entry *e;
+	nid_t ino = ino_of_node(page);
+	nid_t nid = page->index;
+	unsigned int i;
+
+	shard = dirty_node_shard(NM_I(sbi), ino);
+	spin_lock(&shard->lock);
+	if (shard->overflow)
+		goto out;
+
+	e = radix_tree_lookup(&shard->root, ino);
+	if (!e) {
+		e = kmem_cache_alloc(dirty_node_slab, GFP_ATOMIC);
+		if (!e) {
+			shard->overflow = true;
+			goto out;
+		}
+		e->ino = ino;
+		e->overflow = false;
+		e->cnt = 0;
+		if (radix_tree_insert(&shard->root, ino, e)) {
+			kmem_cache_free(dirty_node_slab, e);
+			shard->overflow = true;
+			goto out;
+		}
+	}
+	if (e->overflow)
+		goto out;
+	for (i = 0; i < e->cnt; i++)
+		if (e->nids[i] == nid)
+			goto out;
+	if (e->cnt == DIRTY_NIDS_PER_INO)
+		e->overflow = true;
+	else
+		e->nids[e->cnt++] = nid;
+	out:
+	spin_unlock(&shard->lock);
+}
+
+/* copy out the nids of @ino, or return -EAGAIN if the list is incomplete */
+static int get_dirty_nids(struct f2fs_sb_info *sbi, nid_t ino, nid_t *nids) {
+	struct dirty_node_shard *shard = dirty_node_shard(NM_I(sbi), ino);
+	struct dirty_node_entry *e;
+	int cnt = 0;
+
+	spin_lock(&shard->lock);
+	if (shard->overflow) {
+		cnt = -EAGAIN;
+		goto out;
+	}
+	e = radix_tree_lookup(&shard->root, ino);
+	if (!e)
+		goto out;
+	if (e->overflow) {
+		cnt = -EAGAIN;
+		goto out;
+	}
+	cnt = e->cnt;
+	memcpy(nids, e->nids, cnt * sizeof(nid_t));
+	out:
+	spin_unlock(&shard->lock);
+	return cnt;
+}
+
+/*
+ * A listed page stays listed while it is dirty, locked or under writeback.
+ * A locked page may sit in f2fs_write_node_page between
+ * clear_page_dirty_for_io and set_page_writeback.
+ */
+static bool dirty_node_stale(struct f2fs_sb_info *sbi, nid_t ino, nid_t nid) {
+	struct page *page;
+	bool stale;
+
+	page = find_get_page(node_mapping_of(sbi, nid), nid);
+	if (!page)
+		return true;
+	stale = ino_of_node(page) != ino ||
+			(!PageDirty(page) && !PageLocked(page) &&
+			 !PageWriteback(page));
+	f2fs_put_page(page, 0);
+	return stale;
+}
+
+static void __prune_dirty_node_entry(struct f2fs_sb_info *sbi,
+									 struct dirty_node_shard *shard,
+									 struct dirty_node_entry *e) {
+	unsigned int i, cnt = 0;
+
+	for (i = 0; i < e->cnt; i++)
+		if (!dirty_node_stale(sbi, e->ino, e->nids[i]))
+			e->nids[cnt++] = e->nids[i];
+	e->cnt = cnt;
+	if (!cnt && !e->overflow) {
+		radix_tree_delete(&shard->root, e->ino);
+		kmem_cache_free(dirty_node_slab, e);
+	}
+}
+
+static void prune_dirty_node_entry(struct f2fs_sb_info *sbi, nid_t ino) {
+	struct dirty_node_shard *shard = dirty_node_shard(NM_I(sbi), ino);
+	struct dirty_node_entry *e;
+
+	spin_lock(&shard->lock);
+	e = radix_tree_lookup(&shard->root, ino);
+	if (e)
+		__prune_dirty_node_entry(sbi, shard, e);
+	spin_unlock(&shard->lock);
+}
+
+/*
+ * Called by checkpoint with node writes blocked, after every dirty node page
+ * has been written, so dropping overflow marks cannot lose a dirty page.
+ */
+void prune_dirty_node_index(struct f2fs_sb_info *sbi) {
+	struct f2fs_nm_info *nm_i = NM_I(sbi);
+	struct dirty_node_entry *entries[PAGEVEC_SIZE];
+	struct dirty_node_shard *shard;
+	unsigned int found, idx;
+	nid_t ino;
+	int n;
+
+	for (n = 0; n < DIRTY_NODE_SHARDS; n++) {
+		shard = &nm_i->dn_shards[n];
+		spin_lock(&shard->lock);
+		shard->overflow = false;
+		ino = 0;
+		while ((found = radix_tree_gang_lookup(&shard->root,
+							(void **) entries, ino, PAGEVEC_SIZE))) {
+			ino = entries[found - 1]->ino + 1;
+			for (idx = 0; idx < found; idx++) {
+				entries[idx]->overflow = false;
+				__prune_dirty_node_entry(sbi, shard, entries[idx]);
+			}
+		}
+		spin_unlock(&shard->lock);
+		cond_resched();
+	}
+}
+
+static void destroy_dirty_node_index(struct f2fs_nm_info *nm_i) {
+	struct dirty_node_entry *entries[PAGEVEC_SIZE];
+	struct dirty_node_shard *shard;
+	unsigned int found, idx;
+	int n;
+
+	for (n = 0; n < DIRTY_NODE_SHARDS; n++) {
+		shard = &nm_i->dn_shards[n];
+		while ((found = radix_tree_gang_lookup(&shard->root,
+							(void **) entries, 0, PAGEVEC_SIZE))) {
+			for (idx = 0; idx < found; idx++) {
+				radix_tree_delete(&shard->root, entries[idx]->ino);
+				kmem_cache_free(dirty_node_slab, entries[idx]);
+			}
+		}
+	}
+}
+
+struct fsync_node {
+	unsigned int ofs;
+	struct page *page;
+};
+
+static int cmp_fsync_node(const void *a, const void *b) {
+	const struct fsync_node *na = a, *nb = b;
+
+	return na->ofs < nb->ofs ? -1 : na->ofs > nb->ofs;
+}
+
+/* a transaction writes the inode page last, the record points at it */
+static int cmp_txn_node(const void *a, const void *b) {
+	const struct fsync_node *na = a, *nb = b;
+
+	if (!na->ofs != !nb->ofs)
+		return na->ofs ? -1 : 1;
+	return cmp_fsync_node(a, b);
+}
+
+/*
+ * fsync path: write the dirty dnodes of @ino from its index entry in node
+ * offset order, without walking the dirty tags of the node mapping.
+ * With @txn the pages carry no fsync mark; roll-forward only replays them
+ * once it finds the commit record of their transaction.
+ */
+static int fsync_node_pages(struct f2fs_sb_info *sbi, nid_t ino,
+							struct writeback_control *wbc, bool txn) {
+	nid_t nids[DIRTY_NIDS_PER_INO];
+	struct fsync_node nodes[DIRTY_NIDS_PER_INO];
+	int nwritten = 0, wrote = 0;
+	int cnt, nr = 0, i;
+
+	cnt = get_dirty_nids(sbi, ino, nids);
+	if (cnt < 0)
+		return cnt;
+
+	for (i = 0; i < cnt; i++) {
+		struct page *page = find_get_page(node_mapping_of(sbi, nids[i]), nids[i]);
+
+		if (!page)
+			continue;
+		if (!PageDirty(page) || !IS_DNODE(page) || !is_cold_node(page) ||
+			ino_of_node(page) != ino) {
+			f2fs_put_page(page, 0);
+			continue;
+		}
+		nodes[nr].ofs = ofs_of_node(page);
+		nodes[nr++].page = page;
+	}
+	sort(nodes, nr, sizeof(struct fsync_node),
+		 txn ? cmp_txn_node : cmp_fsync_node, NULL);
+
+	for (i = 0; i < nr; i++) {
+		struct page *page = nodes[i].page;
+
+		lock_page(page);
+		if (unlikely(page->mapping != node_mapping_of(sbi, page->index)))
+			goto continue_unlock;
+		if (ino_of_node(page) != ino)
+			goto continue_unlock;
+		if (!PageDirty(page)) {
+			/* someone wrote it for us */
+			goto continue_unlock;
+		}
+		if (!clear_page_dirty_for_io(page))
+			goto continue_unlock;
+
+		set_fsync_mark(page, !txn);
+		if (IS_INODE(page))
+			set_dentry_mark(page, !txn && need_dentry_mark(sbi, ino));
+		nwritten++;
+
+		if (page->mapping->a_ops->writepage(page, wbc))
+			unlock_page(page);
+		else
+			wrote++;
+		wbc->nr_to_write--;
+		goto next;
+
+		continue_unlock:
+		unlock_page(page);
+		next:
+		page_cache_release(page);
+	}
+
+	if (wrote)
+		f2fs_submit_merged_bio(sbi, NODE, WRITE);
+	return nwritten;
+}
+
+/*
+ * Write the dirty dnodes of a transaction member. Returns -EAGAIN when
+ * the index entry of @ino overflowed; the caller falls back to checkpoint.
+ */
+int txn_node_pages(struct f2fs_sb_info *sbi, nid_t ino,
+				   struct writeback_control *wbc) {
+	return fsync_node_pages(sbi, ino, wbc, true);
+}
+
+/*
+ * Commit a transaction whose dnodes are on disk: write one record naming
+ * the last node block of every member, with a flush ahead of it so that
+ * the record is never durable before the blocks it names. The record is
+ * only read back by roll-forward, so its block is released right away.
+ */
+int write_txn_record(struct f2fs_sb_info *sbi, struct inode **inodes, int nr) {
+	struct f2fs_txn_record *txn;
+	struct f2fs_summary sum;
+	struct node_info ni;
+	struct page *page;
+	struct bio *bio;
+	block_t blkaddr;
+	int i, err;
+
+	page = alloc_page(GFP_NOFS | __GFP_ZERO);
+	if (!page)
+		return -ENOMEM;
+
+	txn = &F2FS_NODE(page)->txn;
+	txn->magic = cpu_to_le32(F2FS_TXN_MAGIC);
+	txn->nr_members = cpu_to_le32(nr);
+	for (i = 0; i < nr; i++) {
+		get_node_info(sbi, inodes[i]->i_ino, &ni);
+		txn->members[i].ino = cpu_to_le32(inodes[i]->i_ino);
+		txn->members[i].blkaddr = cpu_to_le32(ni.blk_addr);
+	}
+	txn->checksum = cpu_to_le32(f2fs_crc32(txn->members,
+							nr * sizeof(struct f2fs_txn_member)));
+
+	set_summary(&sum, 0, 0, 0);
+	allocate_data_block(sbi, page, NULL_ADDR, &blkaddr, &sum,
+						CURSEG_WARM_NODE);
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	bio->bi_bdev = sbi->sb->s_bdev;
+	bio->bi_iter.bi_sector = SECTOR_FROM_BLOCK(blkaddr);
+	bio_add_page(bio, page, PAGE_CACHE_SIZE, 0);
+	err = submit_bio_wait(test_opt(sbi, NOBARRIER) ? WRITE_SYNC :
+						  WRITE_FLUSH_FUA, bio);
+	bio_put(bio);
+
+	invalidate_blocks(sbi, blkaddr);
+	__free_page(page);
+	return err;
+}
+
+#endif
+
 #ifdef FILE_CELL
 
 int sync_node_pages(struct f2fs_sb_info *sbi, nid_t ino, nid_t node_idx,
@@ -1418,6 +1849,14 @@ int sync_node_pages(struct f2fs_sb_info *sbi, nid_t ino, nid_t node_idx,
 	int step = ino ? 2 : 0;  // 0: sync all, 2: fsync on file dnodes
 	int nwritten = 0, wrote = 0;
 
+#ifdef DIRTY_NODE_INDEX
+	if (ino) {
+		nwritten = fsync_node_pages(sbi, ino, wbc, false);
+		if (nwritten >= 0)
+			return nwritten;
+		nwritten = 0;
+	}
+#endif
 	pagevec_init(&pvec, 0);
 
 	next_step:
@@ -1522,6 +1961,14 @@ int sync_node_pages(struct f2fs_sb_info *sbi, nid_t ino,
 	int step = ino ? 2 : 0;
 	int nwritten = 0, wrote = 0;
 
+#ifdef DIRTY_NODE_INDEX
+	if (ino) {
+		nwritten = fsync_node_pages(sbi, ino, wbc, false);
+		if (nwritten >= 0)
+			return nwritten;
+		nwritten = 0;
+	}
+#endif
 	pagevec_init(&pvec, 0);
 
 	next_step:
@@ -1621,11 +2068,48 @@ int sync_node_pages(struct f2fs_sb_info *sbi, nid_t ino,
 #endif
 
 
+#ifdef DIRTY_NODE_INDEX
+
+/* returns -EAGAIN if @ino's index entry cannot be trusted */
+static int wait_on_indexed_node_pages(struct f2fs_sb_info *sbi, nid_t ino) {
+	nid_t nids[DIRTY_NIDS_PER_INO];
+	struct page *page;
+	int cnt, i, ret = 0;
+
+	cnt = get_dirty_nids(sbi, ino, nids);
+	if (cnt < 0)
+		return cnt;
+
+	for (i = 0; i < cnt; i++) {
+		page = find_get_page(node_mapping_of(sbi, nids[i]), nids[i]);
+		if (!page)
+			continue;
+		if (ino_of_node(page) == ino) {
+			f2fs_wait_on_page_writeback(page, NODE);
+			if (TestClearPageError(page))
+				ret = -EIO;
+		}
+		f2fs_put_page(page, 0);
+	}
+	prune_dirty_node_entry(sbi, ino);
+	return ret;
+}
+
+#endif
+
 int wait_on_node_pages_writeback(struct f2fs_sb_info *sbi, nid_t ino) {
 	pgoff_t index = 0, end = LONG_MAX;
 	struct pagevec pvec;
 	int ret2 = 0, ret = 0;
 
+#ifdef DIRTY_NODE_INDEX
+	if (ino) {
+		ret = wait_on_indexed_node_pages(sbi, ino);
+		if (ret != -EAGAIN)
+			goto check_mapping;
+		ret = 0;
+	}
+#endif
 	pagevec_init(&pvec, 0);
 
 	while (index <= end) {
@@ -1659,6 +2143,9 @@ int wait_on_node_pages_writeback(struct f2fs_sb_info *sbi, nid_t ino) {
 		cond_resched();
 	}
 
+#ifdef DIRTY_NODE_INDEX
+	check_mapping:
+#endif
 #ifdef FILE_CELL
 	if (unlikely(test_and_clear_bit(AS_ENOSPC, &NODE_MAPPING(sbi, ino)->flags)))
 		ret2 = -ENOSPC;
@@ -1754,6 +2241,10 @@ static int f2fs_write_node_page(struct page *page,
 
 	redirty_out:
 	redirty_page_for_writepage(wbc, page);
+#ifdef DIRTY_NODE_INDEX
+	/* redirty_page_for_writepage bypasses f2fs_set_node_page_dirty */
+	record_dirty_node(sbi, page);
+#endif
 	return AOP_WRITEPAGE_ACTIVATE;
 }
 
@@ -1805,6 +2296,9 @@ static int f2fs_set_node_page_dirty(struct page *page) {
 		inc_dirty_node_page_count(F2FS_P_SB(page), NODE_IDX(nid_of_node(page), F2FS_P_SB(page)));
 #else
 		inc_page_count(F2FS_P_SB(page), F2FS_DIRTY_NODES);
+#endif
+#ifdef DIRTY_NODE_INDEX
+		record_dirty_node(F2FS_P_SB(page), page);
 #endif
 		SetPagePrivate(page);
 		f2fs_trace_pid(page);
@@ -1947,9 +2441,8 @@ static void remove_free_nid(struct f2fs_nm_info *nm_i, nid_t nid) {
 		kmem_cache_free(free_nid_slab, i);
 }
 
-static void scan_nat_page(struct f2fs_sb_info *sbi,
-						  struct page *nat_page, nid_t start_nid) {
-	struct f2fs_nm_info *nm_i = NM_I(sbi);
+static void scan_nat_page(struct f2fs_sb_info *sbi, struct page *nat_page,
+						  nid_t start_nid, nid_t end_nid) {
 	struct f2fs_nat_block *nat_blk = page_address(nat_page);
 	block_t blk_addr;
 	int i;
@@ -1958,7 +2451,7 @@ static void scan_nat_page(struct f2fs_sb_info *sbi,
 
 	for (; i < NAT_ENTRY_PER_BLOCK; i++, start_nid++) {
 
-		if (unlikely(start_nid >= nm_i->max_nid))
+		if (unlikely(start_nid >= end_nid))
 			break;
 		blk_addr = le32_to_cpu(nat_blk->entries[i].block_addr);
 		f2fs_bug_on(sbi, blk_addr == NEW_ADDR);
@@ -1970,93 +2463,114 @@ static void scan_nat_page(struct f2fs_sb_info *sbi,
 }
 
 #ifdef PER_CORE_NID_LIST
-static void build_all_free_nids(struct f2fs_sb_info *sbi) { // scan all nat pages for free nids
-	struct f2fs_nm_info *nm_i = NM_I(sbi);
-	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_HOT_DATA); // only mlog 0 contains NAT journal
-	struct f2fs_summary_block *sum = curseg->sum_blk;
-	struct f2fs_io_info fio = {
-			.sbi = sbi,
-			.type = META,
-			.rw = READ_SYNC | REQ_META | REQ_PRIO,
-			.encrypted_page = NULL,
-	};
-
-	block_t start = NAT_BLOCK_OFFSET(nm_i->next_scan_nid);
-	nid_t nid = nm_i->next_scan_nid;
-	block_t end = NAT_BLOCK_OFFSET(NM_I(sbi)->max_nid);
-	int type = META_NAT;
-	int i = 0;
-	block_t blkno;
-	struct page *page;
-
-	for (blkno = start; blkno < end; blkno++) {
-		if (!is_valid_blkaddr(sbi, blkno, type))
-			goto out;
-		fio.blk_addr = current_nat_addr(sbi, blkno * NAT_ENTRY_PER_BLOCK);
-		page = grab_cache_page(META_MAPPING(sbi), fio.blk_addr);
-		if (!page)
-			continue;
-		if (PageUptodate(page)) {
-			f2fs_put_page(page, 1);
-			continue;
-		}
-		fio.page = page;
-		f2fs_submit_page_mbio(&fio);
-		f2fs_put_page(page, 0);
-	}
-	out:
-	f2fs_submit_merged_bio(sbi, META, READ);
-
-	while (1) {
-		struct page *nat_page = get_current_nat_page(sbi, nid);
-
-		scan_nat_page(sbi, nat_page, nid);
-		f2fs_put_page(nat_page, 1);
-
-		nid += (NAT_ENTRY_PER_BLOCK - (nid % NAT_ENTRY_PER_BLOCK));
+/*
+ * Each free nid list owns the nid range [list * nid_chunk, (list + 1) *
+ * nid_chunk), so its NAT blocks can be scanned on demand instead of
+ * reading the whole NAT area at mount time.
+ */
+static nid_t nid_list_start(struct f2fs_nm_info *nm_i, int list_id) {
+	nid_t start = list_id * nm_i->nid_chunk;
 #ifdef FILE_CELL
-		if (unlikely(nid >= nm_i->max_nid))
-			nid = NAT_ENTRY_PER_BLOCK;
-#else
-		if (unlikely(nid >= nm_i->max_nid))
-			nid = 0;
+	if (start < NAT_ENTRY_PER_BLOCK)
+		start = NAT_ENTRY_PER_BLOCK;
 #endif
-		if (i++ == (blkno - start))
-			break;
-	}
+	return start;
+}
 
-	mutex_lock(&curseg->curseg_mutex);
-	for (i = 0; i < nats_in_cursum(sum); i++) {
-		block_t addr = le32_to_cpu(nat_in_journal(sum, i).block_addr);
-		nid = le32_to_cpu(nid_in_journal(sum, i));
-		if (addr == NULL_ADDR)
-			add_free_nid(sbi, nid, true);
-		else
-			remove_free_nid(nm_i, nid);
-	}
-	mutex_unlock(&curseg->curseg_mutex);
+static nid_t nid_list_end(struct f2fs_nm_info *nm_i, int list_id) {
+	return min_t(nid_t, (list_id + 1) * nm_i->nid_chunk, nm_i->max_nid);
 }
 
-static int build_free_nids(struct f2fs_sb_info *sbi) {
+/*
+ * Only the nids of [start, end) are touched: they belong to the list being
+ * built, so the other lists may keep allocating meanwhile.
+ */
+static void scan_nat_journal(struct f2fs_sb_info *sbi, nid_t start, nid_t end) {
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
 	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_HOT_DATA); // only mlog 0 contains NAT journal
 	struct f2fs_summary_block *sum = curseg->sum_blk;
-	int i = 0;
+	block_t addr;
 	nid_t nid;
-	int build = 0;
-	/* find free nids from current sum_pages */
+	int i;
+
 	mutex_lock(&curseg->curseg_mutex);
 	for (i = 0; i < nats_in_cursum(sum); i++) {
-		block_t addr = le32_to_cpu(nat_in_journal(sum, i).block_addr);
 		nid = le32_to_cpu(nid_in_journal(sum, i));
+		if (nid < start || nid >= end)
+			continue;
+		addr = le32_to_cpu(nat_in_journal(sum, i).block_addr);
 		if (addr == NULL_ADDR)
-			build += add_free_nid(sbi, nid, true);
+			add_free_nid(sbi, nid, true);
 		else
 			remove_free_nid(nm_i, nid);
 	}
 	mutex_unlock(&curseg->curseg_mutex);
 }
 
+/*
+ * Scan the next FREE_NID_PAGES NAT blocks of the range owned by list_id,
+ * wrapping around inside that range. Only list_id is marked as building,
+ * so allocations from the other lists keep going meanwhile.
+ * Caller should hold build_lock.
+ */
+static void build_free_nids(struct f2fs_sb_info *sbi, int list_id) {
+	struct f2fs_nm_info *nm_i = NM_I(sbi);
+	nid_t start = nid_list_start(nm_i, list_id);
+	nid_t end = nid_list_end(nm_i, list_id);
+	nid_t nid = nm_i->next_scan_nids[list_id];
+	int i;
+
+	if (unlikely(start >= end))
+		return;
+	if (nid < start || nid >= end)
+		nid = start;
+
+	set_bit(list_id, nm_i->nid_build_map);
+
+	/* readahead nat pages to be scanned */
+	ra_meta_pages(sbi, NAT_BLOCK_OFFSET(nid), FREE_NID_PAGES, META_NAT);
+
+	for (i = 0; i < FREE_NID_PAGES; i++) {
+		struct page *page = get_current_nat_page(sbi, nid);
+
+		scan_nat_page(sbi, page, nid, end);
+		f2fs_put_page(page, 1);
+
+		nid = START_NID(nid) + NAT_ENTRY_PER_BLOCK;
+		if (nid >= end)
+			nid = start;
+	}
+	nm_i->next_scan_nids[list_id] = nid;
+
+	/* drop the nids the NAT journal says are in use */
+	scan_nat_journal(sbi, start, end);
+
+	clear_bit(list_id, nm_i->nid_build_map);
+}
+
+static void refill_free_nids(struct work_struct *work) {
+	struct f2fs_nm_info *nm_i = container_of(work, struct f2fs_nm_info,
+											 refill_work);
+	struct f2fs_sb_info *sbi = nm_i->sbi;
+	int list_id;
+
+	for_each_set_bit(list_id, nm_i->nid_refill_map, nm_i->nid_list_count) {
+		clear_bit(list_id, nm_i->nid_refill_map);
+
+		f2fs_lock_op(sbi);
+		mutex_lock(&nm_i->build_lock);
+		if (nm_i->percore_fcnt[list_id] < FREE_NID_REFILL_THRESH)
+			build_free_nids(sbi, list_id);
+		mutex_unlock(&nm_i->build_lock);
+		f2fs_unlock_op(sbi);
+	}
+}
+
+static void kick_free_nid_refill(struct f2fs_nm_info *nm_i, int list_id) {
+	if (!test_and_set_bit(list_id, nm_i->nid_refill_map))
+		queue_work(system_unbound_wq, &nm_i->refill_work);
+}
+
 #else
 static void build_free_nids(struct f2fs_sb_info *sbi) {
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
@@ -2075,7 +2589,7 @@ static void build_free_nids(struct f2fs_sb_info *sbi) {
 	while (1) {
 		struct page *page = get_current_nat_page(sbi, nid);
 
-		scan_nat_page(sbi, page, nid);
+		scan_nat_page(sbi, page, nid, nm_i->max_nid);
 		f2fs_put_page(page, 1);
 
 		nid += (NAT_ENTRY_PER_BLOCK - (nid % NAT_ENTRY_PER_BLOCK));
@@ -2106,12 +2620,79 @@ static void build_free_nids(struct f2fs_sb_info *sbi) {
 }
 #endif
 
+#ifdef PER_CORE_NID_LIST
+/* called with free_nid_list_lock[list_id] held, which it releases */
+static void __take_free_nid(struct f2fs_nm_info *nm_i, int list_id,
+							struct free_nid *i, nid_t *nid) {
+	bool low;
+
+	*nid = i->nid;
+	i->state = NID_ALLOC;
+	nm_i->percore_fcnt[list_id]--;
+	low = nm_i->percore_fcnt[list_id] < FREE_NID_REFILL_THRESH;
+	spin_unlock(&nm_i->free_nid_list_lock[list_id]);
+	if (low)
+		kick_free_nid_refill(nm_i, list_id);
+}
+#endif
+
+#if defined(PER_CORE_NID_LIST) && defined(FILE_CELL)
+/* cells are bound to cpus, or split evenly over NUMA nodes if fewer */
+static int local_cell(struct f2fs_sb_info *sbi) {
+	unsigned int cpu = raw_smp_processor_id();
+	unsigned int per_node;
+
+	if (sbi->node_count >= nr_cpu_ids || nr_node_ids == 1)
+		return cpu % sbi->node_count;
+	per_node = sbi->node_count / nr_node_ids;
+	if (!per_node)
+		return cpu_to_node(cpu) % sbi->node_count;
+	return cpu_to_node(cpu) * per_node + cpu % per_node;
+}
+
 /*
- * If this function returns success, caller can obtain a new nid
- * from second parameter of this function.
- * The returned nid could be used ino as well as nid when inode is created.
+ * Free nid lists own nid ranges, so each of them holds nids of every cell.
+ * Look for one of @cell in the running cpu's list first, then borrow from
+ * the next NID_BORROW_LISTS lists. Consecutive nids rotate over the cells,
+ * so the search gives up after 2 * node_count new nids per list.
  */
-bool alloc_nid(struct f2fs_sb_info *sbi, nid_t *nid) {
+static bool alloc_nid_in_cell(struct f2fs_sb_info *sbi, nid_t *nid, int cell) {
+	struct f2fs_nm_info *nm_i = NM_I(sbi);
+	int nid_list_cnt = nm_i->nid_list_count;
+	int first = raw_smp_processor_id() % nid_list_cnt;
+	unsigned int budget = 2 * sbi->node_count;
+	unsigned int scanned;
+	struct free_nid *i;
+	int n, list_id;
+
+	for (n = 0; n <= NID_BORROW_LISTS && n < nid_list_cnt; n++) {
+		list_id = (first + n) % nid_list_cnt;
+		if (!READ_ONCE(nm_i->percore_fcnt[list_id]))
+			continue;
+
+		spin_lock(&nm_i->free_nid_list_lock[list_id]);
+		if (!nm_i->percore_fcnt[list_id] ||
+			test_bit(list_id, nm_i->nid_build_map))
+			goto next;
+		scanned = 0;
+		list_for_each_entry(i, &nm_i->free_nid_list[list_id], list) {
+			if (i->state != NID_NEW)
+				continue;
+			if (i->nid % sbi->node_count == cell) {
+				__take_free_nid(nm_i, list_id, i, nid);
+				return true;
+			}
+			if (++scanned >= budget)
+				break;
+		}
+		next:
+		spin_unlock(&nm_i->free_nid_list_lock[list_id]);
+	}
+	return false;
+}
+#endif
+
+static bool __alloc_nid(struct f2fs_sb_info *sbi, nid_t *nid, int cell) {
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
 	struct free_nid *i = NULL;
 #ifdef PER_CORE_NID_LIST
@@ -2122,30 +2703,31 @@ bool alloc_nid(struct f2fs_sb_info *sbi, nid_t *nid) {
 #else
 	if (unlikely(sbi->total_valid_node_count + 1 > nm_i->available_nids))
 		return false;
+#endif
+#ifdef FILE_CELL
+	if (cell >= 0 && nm_i->nid_policy == NID_CELL_LOCAL &&
+		alloc_nid_in_cell(sbi, nid, cell))
+		return true;
 #endif
 	int nid_list_cnt = nm_i->nid_list_count;
-	int retry_cnt = 0;
 	int list_id = atomic_inc_return(&nm_i->next_allocator) % nid_list_cnt;
 	spin_lock(&nm_i->free_nid_list_lock[list_id]);
 	/* We should not use stale free nids created by build_free_nids */
-	if (nm_i->percore_fcnt[list_id] && !on_build_free_nids(nm_i)) {
+	if (nm_i->percore_fcnt[list_id] &&
+		!test_bit(list_id, nm_i->nid_build_map)) {
 		f2fs_bug_on(sbi, list_empty(&nm_i->free_nid_list[list_id]));
 		list_for_each_entry(i, &nm_i->free_nid_list[list_id], list) if (i->state == NID_NEW)
 				break;
 
 		f2fs_bug_on(sbi, i->state != NID_NEW);
-		*nid = i->nid;
-		i->state = NID_ALLOC;
-		nm_i->percore_fcnt[list_id]--;
-		spin_unlock(&nm_i->free_nid_list_lock[list_id]);
+		__take_free_nid(nm_i, list_id, i, nid);
 		return true;
 	}
 	spin_unlock(&nm_i->free_nid_list_lock[list_id]);
-	build_free_nids:
 	/* Let's scan nat pages and its caches to get free nids */
 	mutex_lock(&nm_i->build_lock);
 	if (nm_i->percore_fcnt[list_id] == 0) {
-		build_free_nids(sbi);
+		build_free_nids(sbi, list_id);
 	}
 	mutex_unlock(&nm_i->build_lock);
 	goto retry;
@@ -2182,6 +2764,28 @@ bool alloc_nid(struct f2fs_sb_info *sbi, nid_t *nid) {
 #endif
 }
 
+/*
+ * If this function returns success, caller can obtain a new nid
+ * from second parameter of this function.
+ * The returned nid could be used ino as well as nid when inode is created.
+ */
+bool alloc_nid(struct f2fs_sb_info *sbi, nid_t *nid) {
+#if defined(PER_CORE_NID_LIST) && defined(FILE_CELL)
+	return __alloc_nid(sbi, nid, local_cell(sbi));
+#else
+	return __alloc_nid(sbi, nid, -1);
+#endif
+}
+
+/* node blocks of an inode stay in the inode's cell */
+bool alloc_nid_for_inode(struct f2fs_sb_info *sbi, nid_t *nid, nid_t ino) {
+#if defined(PER_CORE_NID_LIST) && defined(FILE_CELL)
+	return __alloc_nid(sbi, nid, ino % sbi->node_count);
+#else
+	return __alloc_nid(sbi, nid, -1);
+#endif
+}
+
 /*
  * alloc_nid() should be called prior to this function.
  */
@@ -2401,6 +3005,7 @@ static void remove_nats_in_journal(struct f2fs_sb_info *sbi) {
 	for (i = 0; i < nats_in_cursum(sum); i++) {
 		struct nat_entry *ne;
 		struct f2fs_nat_entry raw_ne;
+		struct node_info ni;
 		nid_t nid = le32_to_cpu(nid_in_journal(sum, i));
 
 		raw_ne = nat_in_journal(sum, i);
@@ -2409,8 +3014,8 @@ static void remove_nats_in_journal(struct f2fs_sb_info *sbi) {
 		down_write(&nm_i->nat_tree_lock[tree_idx]);
 		ne = __lookup_nat_cache(nm_i, nid);
 		if (!ne) {
-			ne = grab_nat_entry(nm_i, nid);
-			node_info_from_raw_nat(&ne->ni, &raw_ne);
+			node_info_from_raw_nat(&ni, &raw_ne);
+			ne = grab_nat_entry(nm_i, nid, &ni);
 		}
 		__set_nat_cache_dirty(nm_i, ne);
 		up_write(&nm_i->nat_tree_lock[tree_idx]);
@@ -2418,8 +3023,8 @@ static void remove_nats_in_journal(struct f2fs_sb_info *sbi) {
 		down_write(&nm_i->nat_tree_lock);
 		ne = __lookup_nat_cache(nm_i, nid);
 		if (!ne) {
-			ne = grab_nat_entry(nm_i, nid);
-			node_info_from_raw_nat(&ne->ni, &raw_ne);
+			node_info_from_raw_nat(&ni, &raw_ne);
+			ne = grab_nat_entry(nm_i, nid, &ni);
 		}
 		__set_nat_cache_dirty(nm_i, ne);
 		up_write(&nm_i->nat_tree_lock);
@@ -2602,33 +3207,29 @@ void flush_nat_entries(struct f2fs_sb_info *sbi) {
 }
 
 #ifdef FILE_CELL
+/*
+ * Flush @sets to the NAT journal if @page is NULL, or else to @page, the
+ * locked next copy of its NAT block. Sets for different NAT blocks may be
+ * flushed concurrently.
+ */
 static void __flush_nat_entry_set_per_core(struct f2fs_sb_info *sbi,
-										   struct per_core_sets_pack *sets) {
+										   struct per_core_sets_pack *sets,
+										   struct page *page) {
 	f2fs_bug_on(sbi, !sets);
 	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_HOT_DATA); // only mlog 0 contains NAT journal
 	struct f2fs_summary_block *sum = curseg->sum_blk;
 	nid_t start_nid = sets->set_id * NAT_ENTRY_PER_BLOCK;
-	bool to_journal = true;
+	bool to_journal = !page;
 	struct f2fs_nat_block *nat_blk;
 	struct nat_entry *ne, *cur;
-	struct page *page = NULL;
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
 	int i;
 	const int total_set = sets->next_set_idx;
 	int tree_idx = -1;
 	int nat_tree_cnt = nm_i->nat_tree_cnt;
-	/*
-	 * there are two steps to flush nat entries:
-	 * #1, flush nat entries to journal in current hot data summary block.
-	 * #2, flush nat entries to nat page.
-	 */
-	if (!__has_cursum_space(sum, sets->entry_cnt, NAT_JOURNAL))
-		to_journal = false;
-
 	if (to_journal) {
 		mutex_lock(&curseg->curseg_mutex);
 	} else {
-		page = get_next_nat_page(sbi, start_nid);
 		nat_blk = page_address(page);
 		f2fs_bug_on(sbi, !nat_blk);
 	}
@@ -2719,6 +3320,76 @@ static void __adjust_nat_entry_set_per_core(struct nat_entry_set *nes,
 
 }
 
+struct nat_flush_work {
+	struct work_struct work;
+	struct f2fs_sb_info *sbi;
+	struct per_core_sets_pack *sets;
+	pgoff_t src_off;        /* current copy of the NAT block */
+	pgoff_t dst_off;        /* copy written by this checkpoint */
+};
+
+static void __flush_nat_block(struct f2fs_sb_info *sbi,
+							  struct per_core_sets_pack *sets,
+							  pgoff_t src_off, pgoff_t dst_off) {
+	struct page *page = get_next_meta_page(sbi, src_off, dst_off);
+
+	__flush_nat_entry_set_per_core(sbi, sets, page);
+	kmem_cache_free(per_core_sets_pack_slab, sets);
+}
+
+static void flush_nat_block_work(struct work_struct *work) {
+	struct nat_flush_work *nfw = container_of(work, struct nat_flush_work,
+											  work);
+
+	__flush_nat_block(nfw->sbi, nfw->sets, nfw->src_off, nfw->dst_off);
+}
+
+/*
+ * Every set left on @sets owns one NAT block. The block addresses and the
+ * NAT version bitmap are settled here; reading the current blocks and
+ * filling the new ones is spread over the meta flush workers.
+ */
+static void flush_nat_blocks(struct f2fs_sb_info *sbi, struct list_head *sets) {
+	struct f2fs_nm_info *nm_i = NM_I(sbi);
+	struct workqueue_struct *wq = sbi->max_info->meta_flush_wq;
+	struct per_core_sets_pack *set, *tmp;
+	struct nat_flush_work *works;
+	unsigned int nr = 0, i = 0;
+	pgoff_t src_off, dst_off;
+	nid_t start_nid;
+
+	list_for_each_entry(set, sets, set_list)
+		nr++;
+	if (!nr)
+		return;
+
+	works = kcalloc(nr, sizeof(struct nat_flush_work), GFP_NOFS | __GFP_NOWARN);
+
+	list_for_each_entry_safe(set, tmp, sets, set_list) {
+		list_del(&set->set_list);
+		start_nid = set->set_id * NAT_ENTRY_PER_BLOCK;
+		src_off = current_nat_addr(sbi, start_nid);
+		dst_off = next_nat_addr(sbi, src_off);
+		set_to_next_nat(nm_i, start_nid);
+
+		if (!works) {
+			__flush_nat_block(sbi, set, src_off, dst_off);
+			continue;
+		}
+		INIT_WORK(&works[i].work, flush_nat_block_work);
+		works[i].sbi = sbi;
+		works[i].sets = set;
+		works[i].src_off = src_off;
+		works[i].dst_off = dst_off;
+		queue_work(wq, &works[i++].work);
+	}
+
+	if (works) {
+		flush_workqueue(wq);
+		kfree(works);
+	}
+}
+
 /*
  * This function is called during the checkpointing process.
  */
@@ -2765,11 +3436,20 @@ void flush_nat_entries_per_core(struct f2fs_sb_info *sbi) {
 		}
 		up_write(&nm_i->nat_tree_lock[i]);
 	}
-	/* flush dirty nats in nat entry set */
+	/*
+	 * there are two steps to flush nat entries:
+	 * #1, flush nat entries to journal in current hot data summary block.
+	 * #2, flush nat entries to nat pages, one work item per nat block.
+	 */
 	list_for_each_entry_safe(set, tmp, &sets, set_list) {
-		__flush_nat_entry_set_per_core(sbi, set);
+		if (!__has_cursum_space(sum, set->entry_cnt, NAT_JOURNAL))
+			continue;
+		list_del(&set->set_list);
+		__flush_nat_entry_set_per_core(sbi, set, NULL);
 		kmem_cache_free(per_core_sets_pack_slab, set);
 	}
+	flush_nat_blocks(sbi, &sets);
+
 	for (i = 0; i < nat_tree_cnt; i++) {
 		down_read(&nm_i->nat_tree_lock[i]);
 		f2fs_bug_on(sbi, nm_i->percore_dirty_nat_cnt[i]);
@@ -2808,12 +3488,19 @@ static int init_node_manager(struct f2fs_sb_info *sbi) {
 	nm_i->free_nid_list = kzalloc(list_cnt * sizeof(struct list_head), GFP_KERNEL);
 	nm_i->free_nid_list_lock = kzalloc(list_cnt * sizeof(struct spinlock), GFP_KERNEL);
 	nm_i->percore_fcnt = kzalloc(list_cnt * sizeof(unsigned int), GFP_KERNEL);
+	nm_i->next_scan_nids = kzalloc(list_cnt * sizeof(nid_t), GFP_KERNEL);
+	nm_i->nid_build_map = kzalloc(BITS_TO_LONGS(list_cnt) * sizeof(unsigned long), GFP_KERNEL);
+	nm_i->nid_refill_map = kzalloc(BITS_TO_LONGS(list_cnt) * sizeof(unsigned long), GFP_KERNEL);
+	nm_i->sbi = sbi;
+	INIT_WORK(&nm_i->refill_work, refill_free_nids);
+	nm_i->nid_policy = NID_CELL_LOCAL;
 
 	for (i = 0; i < list_cnt; i++) {
 		INIT_RADIX_TREE(&nm_i->free_nid_root[i], GFP_ATOMIC);
 		spin_lock_init(&nm_i->free_nid_list_lock[i]);
 		INIT_LIST_HEAD(&nm_i->free_nid_list[i]);
 		nm_i->percore_fcnt[i] = 0;
+		nm_i->next_scan_nids[i] = nid_list_start(nm_i, i);
 	}
 #else
 	INIT_RADIX_TREE(&nm_i->free_nid_root, GFP_ATOMIC);
@@ -2850,6 +3537,13 @@ static int init_node_manager(struct f2fs_sb_info *sbi) {
 	INIT_LIST_HEAD(&nm_i->nat_entries);
 #endif
 	mutex_init(&nm_i->build_lock);
+#ifdef DIRTY_NODE_INDEX
+	for (i = 0; i < DIRTY_NODE_SHARDS; i++) {
+		spin_lock_init(&nm_i->dn_shards[i].lock);
+		INIT_RADIX_TREE(&nm_i->dn_shards[i].root, GFP_ATOMIC);
+		nm_i->dn_shards[i].overflow = false;
+	}
+#endif
 	nm_i->next_scan_nid = le32_to_cpu(sbi->ckpt->next_free_nid);
 #ifdef PER_CORE_NID_LIST
 	atomic_set(&nm_i->next_allocator, (nm_i->next_scan_nid - 1) % nm_i->nid_list_count);
@@ -2876,13 +3570,27 @@ int build_node_manager(struct f2fs_sb_info *sbi) {
 	if (err)
 		return err;
 #ifdef PER_CORE_NID_LIST
-	build_all_free_nids(sbi);
+	/*
+	 * Nothing is read at mount; NAT blocks and the journal are scanned per
+	 * list by the refill worker, or by alloc_nid when a list runs dry.
+	 */
+	bitmap_fill(NM_I(sbi)->nid_refill_map, NM_I(sbi)->nid_list_count);
+	queue_work(system_unbound_wq, &NM_I(sbi)->refill_work);
 #else
 	build_free_nids(sbi);
 #endif
 	return 0;
 }
 
+void stop_free_nid_refill(struct f2fs_sb_info *sbi) {
+#ifdef PER_CORE_NID_LIST
+	struct f2fs_nm_info *nm_i = NM_I(sbi);
+
+	if (nm_i && nm_i->nid_refill_map)
+		cancel_work_sync(&nm_i->refill_work);
+#endif
+}
+
 void destroy_node_manager(struct f2fs_sb_info *sbi) {
 	struct f2fs_nm_info *nm_i = NM_I(sbi);
 	struct free_nid *i, *next_i;
@@ -2895,6 +3603,8 @@ void destroy_node_manager(struct f2fs_sb_info *sbi) {
 	if (!nm_i)
 		return;
 
+	stop_free_nid_refill(sbi);
+
 	/* destroy free nid list */
 #ifdef PER_CORE_NID_LIST
 	int nid_list_cnt = nm_i->nid_list_count;
@@ -2915,6 +3625,9 @@ void destroy_node_manager(struct f2fs_sb_info *sbi) {
 	kfree(nm_i->free_nid_list_lock);
 	kfree(nm_i->free_nid_list);
 	kfree(nm_i->percore_fcnt);
+	kfree(nm_i->next_scan_nids);
+	kfree(nm_i->nid_build_map);
+	kfree(nm_i->nid_refill_map);
 #else
 	spin_lock(&nm_i->free_nid_list_lock);
 	list_for_each_entry_safe(i, next_i, &nm_i->free_nid_list, list) {
@@ -2987,6 +3700,9 @@ void destroy_node_manager(struct f2fs_sb_info *sbi) {
 		}
 	}
 	up_write(&nm_i->nat_tree_lock);
+#endif
+#ifdef DIRTY_NODE_INDEX
+	destroy_dirty_node_index(nm_i);
 #endif
 	kfree(nm_i->nat_bitmap);
 	sbi->nm_info = NULL;
@@ -3012,9 +3728,22 @@ int __init create_node_manager_caches(void) {
 	if (!per_core_sets_pack_slab) {
 		goto destroy_per_core_sets_pack;
 	}
+#endif
+#ifdef DIRTY_NODE_INDEX
+	dirty_node_slab = f2fs_kmem_cache_create("dirty_node_entry",
+											 sizeof(struct dirty_node_entry));
+	if (!dirty_node_slab)
+		goto destroy_nat_entry_set;
 #endif
 	return 0;
 
+#ifdef DIRTY_NODE_INDEX
+	destroy_nat_entry_set:
+#ifdef FILE_CELL
+	kmem_cache_destroy(per_core_sets_pack_slab);
+#endif
+	kmem_cache_destroy(nat_entry_set_slab);
+#endif
 	destroy_free_nid:
 	kmem_cache_destroy(free_nid_slab);
 	destroy_nat_entry:
@@ -3028,10 +3757,17 @@ int __init create_node_manager_caches(void) {
 }
 
 void destroy_node_manager_caches(void) {
+#ifdef RCU_NAT_CACHE
+	/* wait for nat entries still queued by __del_from_nat_cache() */
+	rcu_barrier();
+#endif
 	kmem_cache_destroy(nat_entry_set_slab);
 	kmem_cache_destroy(free_nid_slab);
 	kmem_cache_destroy(nat_entry_slab);
 #ifdef FILE_CELL
 	kmem_cache_destroy(per_core_sets_pack_slab);
 #endif
+#ifdef DIRTY_NODE_INDEX
+	kmem_cache_destroy(dirty_node_slab);
+#endif
 }
@@ -23,6 +23,12 @@
 /* # of pages to perform readahead before building free nids */
 #define FREE_NID_PAGES 4
 
+/* refill a per-core free nid list in background below this many nids */
+#define FREE_NID_REFILL_THRESH (NAT_ENTRY_PER_BLOCK / 2)
+
+/* lists after the cpu's own one searched for a nid of the wanted cell */
+#define NID_BORROW_LISTS	4
+
 /* maximum readahead size for node during getting data blocks */
 #define MAX_RA_NODE        128
 
@@ -70,6 +76,10 @@ struct node_info {
 struct nat_entry {
 	struct list_head list;    /* for clean or dirty nat list */
 	struct node_info ni;    /* in-memory node information */
+#ifdef RCU_NAT_CACHE
+	seqcount_t seq;        /* ino, blk_addr and version for lockless readers */
+	struct rcu_head rcu;    /* freed after a grace period */
+#endif
 };
 
 #define nat_get_nid(nat)        (nat->ni.nid)
@@ -83,6 +93,22 @@ struct nat_entry {
 
 #define inc_node_version(version)    (++version)
 
+/*
+ * Writers of ino/blk_addr/version hold nat_tree_lock for write; get_node_info()
+ * reads them under rcu_read_lock() only and retries on a concurrent update.
+ */
+static inline void nat_write_begin(struct nat_entry *ne) {
+#ifdef RCU_NAT_CACHE
+	write_seqcount_begin(&ne->seq);
+#endif
+}
+
+static inline void nat_write_end(struct nat_entry *ne) {
+#ifdef RCU_NAT_CACHE
+	write_seqcount_end(&ne->seq);
+#endif
+}
+
 static inline void copy_node_info(struct node_info *dst,
 								  struct node_info *src) {
 	dst->nid = src->nid;
@@ -133,6 +159,8 @@ enum mem_type {
 	DIRTY_DENTS,    /* indicates dirty dentry pages */
 	INO_ENTRIES,    /* indicates inode entries */
 	EXTENT_CACHE,    /* indicates extent cache */
+	DIR_INDEX,    /* indicates in-memory directory indexes */
+	BMAP_CACHE,    /* indicates block-map caches */
 	BASE_CHECK,    /* check kernel status */
 };
 
@@ -283,11 +311,16 @@ static inline void copy_node_footer(struct page *dst, struct page *src) {
 	memcpy(&dst_rn->footer, &src_rn->footer, sizeof(struct node_footer));
 }
 
-static inline void fill_node_footer_blkaddr(struct page *page, block_t blkaddr) {
-	struct f2fs_checkpoint *ckpt = F2FS_CKPT(F2FS_P_SB(page));
+static inline void fill_node_footer_blkaddr(struct f2fs_sb_info *sbi,
+											struct page *page, block_t blkaddr) {
+	struct f2fs_checkpoint *ckpt = F2FS_CKPT(sbi);
 	struct f2fs_node *rn = F2FS_NODE(page);
+	__u64 cp_ver = cur_cp_version(ckpt);
 
-	rn->footer.cp_ver = ckpt->checkpoint_ver;
+	if (is_set_ckpt_flags(ckpt, CP_NODE_SEQ_FLAG))
+		cp_ver = (cp_ver & NODE_SEQ_CP_VER_MASK) |
+				 (__u64) atomic_inc_return(&sbi->node_seq) << 32;
+	rn->footer.cp_ver = cpu_to_le64(cp_ver);
 	rn->footer.next_blkaddr = cpu_to_le32(blkaddr);
 }
 
@@ -312,6 +345,27 @@ static inline unsigned long long cpver_of_node(struct page *node_page) {
 	return le64_to_cpu(rn->footer.cp_ver);
 }
 
+/*
+ * With CP_NODE_SEQ_FLAG, the upper half of a node footer's cp_ver is the
+ * order the block was written in across all logs, and only the lower half
+ * is the checkpoint version, so both sides are compared masked.
+ */
+static inline bool is_recoverable_dnode(struct f2fs_sb_info *sbi,
+										struct page *node_page) {
+	unsigned long long cp_ver = cpver_of_node(node_page);
+	unsigned long long cur_ver = cur_cp_version(F2FS_CKPT(sbi));
+
+	if (is_set_ckpt_flags(F2FS_CKPT(sbi), CP_NODE_SEQ_FLAG)) {
+		cp_ver &= NODE_SEQ_CP_VER_MASK;
+		cur_ver &= NODE_SEQ_CP_VER_MASK;
+	}
+	return cp_ver == cur_ver;
+}
+
+static inline unsigned int seq_of_node(struct page *node_page) {
+	return cpver_of_node(node_page) >> 32;
+}
+
 static inline block_t next_blkaddr_of_node(struct page *node_page) {
 	struct f2fs_node *rn = F2FS_NODE(node_page);
 	return le32_to_cpu(rn->footer.next_blkaddr);
@@ -402,6 +456,13 @@ static inline int is_node(struct page *page, int type) {
 #define is_fsync_dnode(page)    is_node(page, FSYNC_BIT_SHIFT)
 #define is_dent_dnode(page)    is_node(page, DENT_BIT_SHIFT)
 
+static inline bool is_txn_record(struct page *page) {
+	struct f2fs_node *rn = F2FS_NODE(page);
+
+	return !rn->footer.nid && !rn->footer.ino &&
+		   le32_to_cpu(rn->txn.magic) == F2FS_TXN_MAGIC;
+}
+
 static inline void set_cold_node(struct inode *inode, struct page *page) {
 	struct f2fs_node *rn = F2FS_NODE(page);
 	unsigned int flag = le32_to_cpu(rn->footer.flag);
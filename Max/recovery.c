@@ -9,6 +9,8 @@
  * published by the Free Software Foundation.
  */
 #include <linux/fs.h>
+#include <linux/radix-tree.h>
+#include <linux/sort.h>
 #include "max_fs.h"
 #include "f2fs.h"
 #include "node.h"
@@ -43,10 +45,64 @@
  * 8. CP | dnode(F) | inode(x)
  * -> If f2fs_iget fails, then goto next to find inode(DF).
  *    But it will fail due to no inode(DF).
+ *
+ * Atomic transactions write their dnodes without F and then a commit
+ * record (R) naming the last node block of every member:
+ *
+ * 9. CP | dnode(x) | inode(x) | R
+ * -> Recover every member up to the block named in R.
+ *
+ * 10. CP | dnode(x) | inode(x)
+ * -> R was missing. Drop the transaction.
  */
 
 static struct kmem_cache *fsync_entry_slab;
 
+/*
+ * Each warm node log keeps its own chain of node blocks written since the
+ * checkpoint. The chains are read concurrently, one work item per chain,
+ * and merged into one stream in write order (see seq_of_node), which is
+ * then walked like the single chain of a one log image. The data of the
+ * fsynced inodes is replayed concurrently again, each work item taking
+ * the inodes that map to it.
+ */
+struct recovery_node {
+	block_t blkaddr;
+	nid_t ino;
+	unsigned int seq;    /* write order across all chains */
+};
+
+struct recovery_stream {
+	struct recovery_node *nodes;
+	unsigned int nr, max;
+};
+
+struct recovery_chain {
+	struct work_struct work;
+	struct f2fs_sb_info *sbi;
+	struct curseg_info *curseg;    /* warm node log of this chain */
+	block_t start_blkaddr;        /* first block after the checkpoint */
+	struct recovery_stream nodes;    /* node blocks of this chain */
+	struct recovery_stream *merged;    /* node blocks of all chains */
+	struct list_head inode_list;    /* fsync_inode_entry replayed here */
+	int id, nr_chains;
+	int err;
+};
+
+/* a commit record, applied only if every member is found in the stream */
+struct txn_member {
+	nid_t ino;
+	block_t blkaddr;
+	unsigned int seq;    /* position in the stream, 0 if not found */
+	bool is_inode;
+};
+
+struct txn_entry {
+	struct list_head list;
+	int nr;
+	struct txn_member members[F2FS_TXN_MAX_MEMBERS];
+};
+
 bool space_for_roll_forward(struct f2fs_sb_info *sbi) {
 #ifdef PER_CORE_COUNTERS
 	if (percpu_counter_compare(&sbi->percore_alloc_valid_block_count,
@@ -91,6 +147,9 @@ static int recover_dentry(struct inode *inode, struct page *ipage) {
 		return 0;
 	}
 
+	/* other work items may recover dentries into the same directory */
+	mutex_lock(&dir->i_mutex);
+
 	name.len = le32_to_cpu(raw_inode->i_namelen);
 	name.name = raw_inode->i_name;
 
@@ -127,10 +186,12 @@ static int recover_dentry(struct inode *inode, struct page *ipage) {
 		goto out_err;
 
 	if (is_inode_flag_set(F2FS_I(dir), FI_DELAY_IPUT)) {
+		mutex_unlock(&dir->i_mutex);
 		iput(dir);
 	} else {
 		add_dirty_dir_inode(dir);
 		set_inode_flag(F2FS_I(dir), FI_DELAY_IPUT);
+		mutex_unlock(&dir->i_mutex);
 	}
 
 	goto out;
@@ -139,6 +200,7 @@ static int recover_dentry(struct inode *inode, struct page *ipage) {
 	f2fs_dentry_kunmap(dir, page);
 	f2fs_put_page(page, 0);
 	out_err:
+	mutex_unlock(&dir->i_mutex);
 	iput(dir);
 	out:
 	f2fs_msg(inode->i_sb, KERN_NOTICE,
@@ -170,29 +232,139 @@ static void recover_inode(struct inode *inode, struct page *page) {
 			 ino_of_node(page), name);
 }
 
-static int find_fsync_dnodes(struct f2fs_sb_info *sbi, struct list_head *head) {
-	unsigned long long cp_ver = cur_cp_version(F2FS_CKPT(sbi));
-	struct curseg_info *curseg;
-	struct page *page = NULL;
-	block_t blkaddr;
-	int err = 0;
+static int collect_txn_record(struct list_head *txn_head, struct page *page) {
+	struct f2fs_txn_record *rec = &F2FS_NODE(page)->txn;
+	unsigned int nr = le32_to_cpu(rec->nr_members);
+	struct txn_entry *te;
+	int i;
 
-	/* get node pages in the current segment */
-	curseg = CURSEG_I(sbi, CURSEG_WARM_NODE);
-	blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
+	/* a torn record is an uncommitted transaction */
+	if (!nr || nr > F2FS_TXN_MAX_MEMBERS)
+		return 0;
+	if (f2fs_crc32(rec->members, nr * sizeof(struct f2fs_txn_member)) !=
+		le32_to_cpu(rec->checksum))
+		return 0;
 
-	ra_meta_pages(sbi, blkaddr, 1, META_POR);
+	te = kzalloc(sizeof(struct txn_entry), GFP_NOFS);
+	if (!te)
+		return -ENOMEM;
+	te->nr = nr;
+	for (i = 0; i < nr; i++) {
+		te->members[i].ino = le32_to_cpu(rec->members[i].ino);
+		te->members[i].blkaddr = le32_to_cpu(rec->members[i].blkaddr);
+	}
+	list_add_tail(&te->list, txn_head);
+	return 0;
+}
 
-	while (1) {
-		struct fsync_inode_entry *entry;
+static int add_recovery_node(struct recovery_stream *rs, block_t blkaddr,
+							 nid_t ino, unsigned int seq) {
+	struct recovery_node *nodes;
+
+	if (rs->nr == rs->max) {
+		nodes = krealloc(rs->nodes, sizeof(struct recovery_node) *
+						 max_t(unsigned int, 2 * rs->max, 64), GFP_NOFS);
+		if (!nodes)
+			return -ENOMEM;
+		rs->nodes = nodes;
+		rs->max = max_t(unsigned int, 2 * rs->max, 64);
+	}
+	rs->nodes[rs->nr].blkaddr = blkaddr;
+	rs->nodes[rs->nr].ino = ino;
+	rs->nodes[rs->nr].seq = seq;
+	rs->nr++;
+	return 0;
+}
 
-		if (!is_valid_blkaddr(sbi, blkaddr, META_POR))
-			return 0;
+/* read one warm node chain into the meta cache and note its blocks */
+static int scan_node_chain(struct f2fs_sb_info *sbi, struct recovery_chain *rc) {
+	struct page *page;
+	block_t blkaddr = rc->start_blkaddr;
+	int err = 0;
 
+	ra_meta_pages(sbi, blkaddr, 1, META_POR);
+
+	while (is_valid_blkaddr(sbi, blkaddr, META_POR)) {
 		page = get_meta_page(sbi, blkaddr);
 
-		if (cp_ver != cpver_of_node(page))
+		if (!is_recoverable_dnode(sbi, page)) {
+			f2fs_put_page(page, 1);
 			break;
+		}
+		err = add_recovery_node(&rc->nodes, blkaddr, ino_of_node(page),
+								seq_of_node(page));
+		if (err) {
+			f2fs_put_page(page, 1);
+			break;
+		}
+
+		blkaddr = next_blkaddr_of_node(page);
+		f2fs_put_page(page, 1);
+
+		ra_meta_pages_cond(sbi, blkaddr);
+	}
+	return err;
+}
+
+static int cmp_recovery_node(const void *a, const void *b) {
+	const struct recovery_node *na = a, *nb = b;
+
+	return (int) (na->seq - nb->seq);
+}
+
+/*
+ * Concatenate the chains and, when the blocks carry their write order,
+ * sort them by it. An image without CP_NODE_SEQ_FLAG was written with one
+ * log, or with every dnode of an inode pinned to one log, so concatenating
+ * keeps the order of each inode's blocks.
+ */
+static int merge_node_chains(struct f2fs_sb_info *sbi,
+							 struct recovery_chain *chains, int nr_chains,
+							 struct recovery_stream *merged) {
+	unsigned int i;
+	int c, err;
+
+	for (c = 0; c < nr_chains; c++) {
+		for (i = 0; i < chains[c].nodes.nr; i++) {
+			struct recovery_node *n = &chains[c].nodes.nodes[i];
+
+			err = add_recovery_node(merged, n->blkaddr, n->ino, n->seq);
+			if (err)
+				return err;
+		}
+	}
+
+	if (!is_set_ckpt_flags(F2FS_CKPT(sbi), CP_NODE_SEQ_FLAG) || !merged->nr)
+		return 0;
+
+	sort(merged->nodes, merged->nr, sizeof(struct recovery_node),
+		 cmp_recovery_node, NULL);
+
+	/* new node blocks go after everything in the chains */
+	atomic_set(&sbi->node_seq, merged->nodes[merged->nr - 1].seq);
+	return 0;
+}
+
+static int find_fsync_dnodes(struct f2fs_sb_info *sbi, struct list_head *head,
+							 struct list_head *txn_head,
+							 struct recovery_stream *merged) {
+	struct page *page = NULL;
+	unsigned int seq;
+	block_t blkaddr;
+	int err = 0;
+
+	for (seq = 1; seq <= merged->nr; seq++) {
+		struct fsync_inode_entry *entry;
+
+		blkaddr = merged->nodes[seq - 1].blkaddr;
+		page = get_meta_page(sbi, blkaddr);
+
+		if (is_txn_record(page)) {
+			err = collect_txn_record(txn_head, page);
+			if (err)
+				break;
+			goto next;
+		}
 
 		if (!is_fsync_dnode(page))
 			goto next;
@@ -228,6 +400,7 @@ static int find_fsync_dnodes(struct f2fs_sb_info *sbi, struct list_head *head) {
 			list_add_tail(&entry->list, head);
 		}
 		entry->blkaddr = blkaddr;
+		entry->seq = seq;
 
 		if (IS_INODE(page)) {
 			entry->last_inode = blkaddr;
@@ -235,13 +408,10 @@ static int find_fsync_dnodes(struct f2fs_sb_info *sbi, struct list_head *head) {
 				entry->last_dentry = blkaddr;
 		}
 		next:
-		/* check next segment */
-		blkaddr = next_blkaddr_of_node(page);
 		f2fs_put_page(page, 1);
-
-		ra_meta_pages_cond(sbi, blkaddr);
 	}
-	f2fs_put_page(page, 1);
+	if (err)
+		f2fs_put_page(page, 1);
 	return err;
 }
 
@@ -255,6 +425,103 @@ static void destroy_fsync_dnodes(struct list_head *head) {
 	}
 }
 
+static void destroy_txn_records(struct list_head *txn_head) {
+	struct txn_entry *te, *tmp;
+
+	list_for_each_entry_safe(te, tmp, txn_head, list) {
+		list_del(&te->list);
+		kfree(te);
+	}
+}
+
+/* make the member the last block to recover of its inode, unless fsync went further */
+static int apply_txn_member(struct f2fs_sb_info *sbi, struct list_head *head,
+							struct txn_member *m) {
+	struct fsync_inode_entry *entry;
+	int err;
+
+	entry = get_fsync_inode(head, m->ino);
+	if (!entry) {
+		entry = kmem_cache_alloc(fsync_entry_slab, GFP_F2FS_ZERO);
+		if (!entry)
+			return -ENOMEM;
+		entry->inode = f2fs_iget(sbi->sb, m->ino);
+		if (IS_ERR(entry->inode)) {
+			err = PTR_ERR(entry->inode);
+			kmem_cache_free(fsync_entry_slab, entry);
+			return err == -ENOENT ? 0 : err;
+		}
+		list_add_tail(&entry->list, head);
+	}
+	if (entry->seq > m->seq)
+		return 0;
+	entry->blkaddr = m->blkaddr;
+	entry->seq = m->seq;
+	if (m->is_inode)
+		entry->last_inode = m->blkaddr;
+	return 0;
+}
+
+/*
+ * Locate the blocks named by the commit records in the merged stream, and
+ * turn every record whose members were all found into fsync entries. Runs
+ * after step #1, so the chains are in the meta cache.
+ */
+static int resolve_txn_records(struct f2fs_sb_info *sbi, struct list_head *head,
+							   struct list_head *txn_head,
+							   struct recovery_stream *merged) {
+	RADIX_TREE(members, GFP_NOFS);
+	struct recovery_node *n;
+	struct txn_member *m;
+	struct txn_entry *te;
+	struct page *page;
+	unsigned int seq;
+	int i, err = 0;
+
+	if (list_empty(txn_head))
+		return 0;
+
+	list_for_each_entry(te, txn_head, list) {
+		for (i = 0; i < te->nr; i++) {
+			err = radix_tree_insert(&members, te->members[i].blkaddr,
+									&te->members[i]);
+			/* a block named twice can only be a stale record */
+			if (err == -EEXIST)
+				err = 0;
+			if (err)
+				goto out;
+		}
+	}
+
+	for (seq = 1; seq <= merged->nr; seq++) {
+		n = &merged->nodes[seq - 1];
+		m = radix_tree_lookup(&members, n->blkaddr);
+		if (!m || m->ino != n->ino)
+			continue;
+		page = get_meta_page(sbi, n->blkaddr);
+		m->seq = seq;
+		m->is_inode = IS_INODE(page);
+		f2fs_put_page(page, 1);
+	}
+
+	list_for_each_entry(te, txn_head, list) {
+		for (i = 0; i < te->nr; i++)
+			if (!te->members[i].seq)
+				break;
+		if (i < te->nr)
+			continue;
+		for (i = 0; i < te->nr && !err; i++)
+			err = apply_txn_member(sbi, head, &te->members[i]);
+		if (err)
+			break;
+	}
+	out:
+	list_for_each_entry(te, txn_head, list)
+		for (i = 0; i < te->nr; i++)
+			radix_tree_delete(&members, te->members[i].blkaddr);
+	return err;
+}
+
 static int check_index_in_prev_nodes(struct f2fs_sb_info *sbi,
 									 block_t blkaddr, struct dnode_of_data *dn) {
 	struct seg_entry *sentry;
@@ -275,8 +542,16 @@ static int check_index_in_prev_nodes(struct f2fs_sb_info *sbi,
 		return 0;
 
 	/* Get the previous summary */
+#ifdef MLOG
+	for (i = 0; i < sbi->nr_mlog * NR_CURSEG_TYPE; i++) {
+		struct curseg_info *curseg = CURSEG_I(sbi, i);
+		if (!IS_DATASEG(i % NR_CURSEG_TYPE) ||
+			i % NR_CURSEG_TYPE == CURSEG_HOT_DATA)
+			continue;
+#else
 	for (i = CURSEG_WARM_DATA; i <= CURSEG_COLD_DATA; i++) {
 		struct curseg_info *curseg = CURSEG_I(sbi, i);
+#endif
 		if (curseg->segno == segno) {
 			sum = curseg->sum_blk->entries[blkoff];
 			goto got_it;
@@ -442,36 +717,26 @@ static int do_recover_data(struct f2fs_sb_info *sbi, struct inode *inode,
 	return err;
 }
 
-static int recover_data(struct f2fs_sb_info *sbi,
-						struct list_head *head, int type) {
-	unsigned long long cp_ver = cur_cp_version(F2FS_CKPT(sbi));
-	struct curseg_info *curseg;
+static int recover_data(struct f2fs_sb_info *sbi, struct recovery_chain *rc) {
+	struct recovery_stream *merged = rc->merged;
+	struct list_head *head = &rc->inode_list;
 	struct page *page = NULL;
+	unsigned int i;
 	int err = 0;
 	block_t blkaddr;
 
-	/* get node pages in the current segment */
-	curseg = CURSEG_I(sbi, type);
-	blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
-
-	while (1) {
+	for (i = 0; i < merged->nr && !list_empty(head); i++) {
 		struct fsync_inode_entry *entry;
 
-		if (!is_valid_blkaddr(sbi, blkaddr, META_POR))
-			break;
-
-		ra_meta_pages_cond(sbi, blkaddr);
+		if (merged->nodes[i].ino % rc->nr_chains != rc->id)
+			continue;
+		entry = get_fsync_inode(head, merged->nodes[i].ino);
+		if (!entry)
+			continue;
 
+		blkaddr = merged->nodes[i].blkaddr;
 		page = get_meta_page(sbi, blkaddr);
 
-		if (cp_ver != cpver_of_node(page)) {
-			f2fs_put_page(page, 1);
-			break;
-		}
-
-		entry = get_fsync_inode(head, ino_of_node(page));
-		if (!entry)
-			goto next;
 		/*
 		 * inode(x) | CP | inode(x) | dnode(F)
 		 * In this case, we can lose the latest inode(x).
@@ -497,29 +762,73 @@ static int recover_data(struct f2fs_sb_info *sbi,
 			list_del(&entry->list);
 			kmem_cache_free(fsync_entry_slab, entry);
 		}
-		next:
-		/* check next segment */
-		blkaddr = next_blkaddr_of_node(page);
 		f2fs_put_page(page, 1);
 	}
-	if (!err)
-		allocate_new_segments(sbi);
+	return err;
+}
+
+static void scan_node_chain_work(struct work_struct *work) {
+	struct recovery_chain *rc = container_of(work, struct recovery_chain, work);
+
+	rc->err = scan_node_chain(rc->sbi, rc);
+}
+
+static void recover_data_work(struct work_struct *work) {
+	struct recovery_chain *rc = container_of(work, struct recovery_chain, work);
+
+	rc->err = recover_data(rc->sbi, rc);
+}
+
+/* run fn over all chains concurrently and return the first error */
+static int run_recovery_chains(struct recovery_chain *chains, int nr_chains,
+							   work_func_t fn) {
+	int i, err = 0;
+
+	for (i = 0; i < nr_chains; i++) {
+		INIT_WORK(&chains[i].work, fn);
+		queue_work(system_unbound_wq, &chains[i].work);
+	}
+	for (i = 0; i < nr_chains; i++) {
+		flush_work(&chains[i].work);
+		if (chains[i].err && !err)
+			err = chains[i].err;
+	}
 	return err;
 }
 
 int recover_fsync_data(struct f2fs_sb_info *sbi) {
-	struct curseg_info *curseg = CURSEG_I(sbi, CURSEG_WARM_NODE);
-	struct list_head inode_list;
-	block_t blkaddr;
-	int err;
+	struct recovery_chain *chains;
+	struct recovery_stream merged = { NULL, 0, 0 };
+	struct fsync_inode_entry *entry, *tmp;
+	LIST_HEAD(inode_list);
+	LIST_HEAD(txn_list);
+	int nr_chains = 1;
+	int i, err;
 	bool need_writecp = false;
 
+#ifdef MLOG
+	nr_chains = sbi->nr_mlog;
+#endif
+	chains = kcalloc(nr_chains, sizeof(struct recovery_chain), GFP_KERNEL);
+	if (!chains)
+		return -ENOMEM;
+
 	fsync_entry_slab = f2fs_kmem_cache_create("max_fsync_inode_entry",
 											  sizeof(struct fsync_inode_entry));
-	if (!fsync_entry_slab)
+	if (!fsync_entry_slab) {
+		kfree(chains);
 		return -ENOMEM;
+	}
 
-	INIT_LIST_HEAD(&inode_list);
+	for (i = 0; i < nr_chains; i++) {
+		chains[i].sbi = sbi;
+		chains[i].curseg = CURSEG_I(sbi, CURSEG_WARM_NODE + i * NR_CURSEG_TYPE);
+		chains[i].start_blkaddr = NEXT_FREE_BLKADDR(sbi, chains[i].curseg);
+		chains[i].merged = &merged;
+		INIT_LIST_HEAD(&chains[i].inode_list);
+		chains[i].id = i;
+		chains[i].nr_chains = nr_chains;
+	}
 
 	/* step #1: find fsynced inode numbers */
 	set_sbi_flag(sbi, SBI_POR_DOING);
@@ -527,23 +836,46 @@ int recover_fsync_data(struct f2fs_sb_info *sbi) {
 	/* prevent checkpoint */
 	mutex_lock(&sbi->cp_mutex);
 
-	blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
+	err = run_recovery_chains(chains, nr_chains, scan_node_chain_work);
+	if (err)
+		goto out;
 
-	err = find_fsync_dnodes(sbi, &inode_list);
-	if (err) 
+	err = merge_node_chains(sbi, chains, nr_chains, &merged);
+	if (err)
 		goto out;
-		
-	if (list_empty(&inode_list))
+
+	err = find_fsync_dnodes(sbi, &inode_list, &txn_list, &merged);
+	if (err)
 		goto out;
 
+	err = resolve_txn_records(sbi, &inode_list, &txn_list, &merged);
+	if (err)
+		goto out;
+
+	if (list_empty(&inode_list))
+		goto out;
 	need_writecp = true;
 
+	/* hand every fsynced inode to the work item replaying it */
+	list_for_each_entry_safe(entry, tmp, &inode_list, list)
+		list_move_tail(&entry->list,
+					   &chains[entry->inode->i_ino % nr_chains].inode_list);
+
 	/* step #2: recover data */
-	err = recover_data(sbi, &inode_list, CURSEG_WARM_NODE);
-	if (!err)
-		f2fs_bug_on(sbi, !list_empty(&inode_list));
+	err = run_recovery_chains(chains, nr_chains, recover_data_work);
+	if (!err) {
+		for (i = 0; i < nr_chains; i++)
+			f2fs_bug_on(sbi, !list_empty(&chains[i].inode_list));
+		allocate_new_segments(sbi);
+	}
 	out:
+	for (i = 0; i < nr_chains; i++) {
+		destroy_fsync_dnodes(&chains[i].inode_list);
+		kfree(chains[i].nodes.nodes);
+	}
 	destroy_fsync_dnodes(&inode_list);
+	destroy_txn_records(&txn_list);
+	kfree(merged.nodes);
 	kmem_cache_destroy(fsync_entry_slab);
 
 	/* truncate meta pages to be used by the recovery */
@@ -552,7 +884,6 @@ int recover_fsync_data(struct f2fs_sb_info *sbi) {
 
 	if (err) {
 #ifdef FILE_CELL
-		int i;
 		for (i = 0; i < sbi->node_count; i++)
 			truncate_inode_pages_final(NODE_MAPPING(sbi, i));
 #else
@@ -563,7 +894,8 @@ int recover_fsync_data(struct f2fs_sb_info *sbi) {
 
 	clear_sbi_flag(sbi, SBI_POR_DOING);
 	if (err) {
-		discard_next_dnode(sbi, blkaddr);
+		for (i = 0; i < nr_chains; i++)
+			discard_next_dnode(sbi, chains[i].start_blkaddr);
 
 		/* Flush all the NAT/SIT pages */
 		while (get_pages(sbi, F2FS_DIRTY_META))
@@ -579,5 +911,6 @@ int recover_fsync_data(struct f2fs_sb_info *sbi) {
 	} else {
 		mutex_unlock(&sbi->cp_mutex);
 	}
+	kfree(chains);
 	return err;
 }
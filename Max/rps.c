@@ -6,30 +6,85 @@
 #include <linux/rcupdate.h>
 #include <linux/sched.h>
 #include <linux/errno.h>
+#include <linux/slab.h>
+#include <linux/nodemask.h>
+#include <linux/topology.h>
 
 #include "rps.h"
 
-int __rps_init_rwsem(struct rps *rps,
-					 const char *name, struct lock_class_key *rw_sem_key) {
+int __rps_init_rwsem(struct rps *rps, const char *name,
+					 struct lock_class_key *key,
+					 struct lock_class_key *rw_sem_key) {
+	int node;
+
 	rps->highway_cnt = alloc_percpu(int);
 	if (unlikely(!rps->highway_cnt))
 		return -ENOMEM;
+	rps->nodes = kcalloc(nr_node_ids, sizeof(struct rps_node *), GFP_KERNEL);
+	if (unlikely(!rps->nodes))
+		goto free_highway;
+	for_each_node(node) {
+		int nid = node_state(node, N_MEMORY) ? node : NUMA_NO_NODE;
+
+		rps->nodes[node] = kzalloc_node(sizeof(struct rps_node),
+										GFP_KERNEL, nid);
+		if (unlikely(!rps->nodes[node]))
+			goto free_nodes;
+		if (unlikely(!zalloc_cpumask_var_node(&rps->nodes[node]->used_cpus,
+											  GFP_KERNEL, nid)))
+			goto free_nodes;
+	}
 	__init_rwsem(&rps->rw_sem, name, rw_sem_key);
-	atomic_set(&rps->writers_cnt, 0);
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+	lockdep_init_map(&rps->dep_map, name, key, 0);
+#endif
 	atomic_set(&rps->lowway_cnt, 0);
 	init_waitqueue_head(&rps->writers_wait_q);
+	spin_lock_init(&rps->gp_lock);
+	rps->gp_state = RPS_IDLE;
+	rps->nr_writers = 0;
+	rps->clear_queued = false;
 	return 0;
+
+	free_nodes:
+	rps_free_rwsem(rps);
+	return -ENOMEM;
+	free_highway:
+	free_percpu(rps->highway_cnt);
+	rps->highway_cnt = NULL;
+	return -ENOMEM;
 }
 
 void rps_free_rwsem(struct rps *rps) {
+	int node;
+
+	/* wait for a pending rps_clear_writer_flags() */
+	rcu_barrier_sched();
+	if (rps->nodes) {
+		for_each_node(node) {
+			if (!rps->nodes[node])
+				continue;
+			free_cpumask_var(rps->nodes[node]->used_cpus);
+			kfree(rps->nodes[node]);
+		}
+		kfree(rps->nodes);
+		rps->nodes = NULL;
+	}
 	free_percpu(rps->highway_cnt);
 	rps->highway_cnt = NULL;
 }
 
 static inline bool go_highway(struct rps *rps, int val) {
+	struct rps_node *node;
 	bool highway = false;
+	int cpu;
+
 	preempt_disable();
-	if (likely(!atomic_read(&rps->writers_cnt))) {
+	node = rps->nodes[numa_node_id()];
+	if (likely(!READ_ONCE(node->writer))) {
+		cpu = smp_processor_id();
+		if (unlikely(!cpumask_test_cpu(cpu, node->used_cpus)))
+			cpumask_set_cpu(cpu, node->used_cpus);
 		this_cpu_add(*rps->highway_cnt, val);
 		highway = true;
 	}
@@ -37,58 +92,122 @@ static inline bool go_highway(struct rps *rps, int val) {
 	return highway;
 }
 
-static inline void go_lowway(struct rps *rps) {
-	down_read(&rps->rw_sem);
+static inline void go_lowway(struct rps *rps, int subclass) {
+	down_read_nested(&rps->rw_sem, subclass);
 	atomic_inc(&rps->lowway_cnt);
 	up_read(&rps->rw_sem);
 }
 
-void rps_down_read(struct rps *rps) {
+void rps_down_read_nested(struct rps *rps, int subclass) {
+	rwsem_acquire_read(&rps->dep_map, subclass, 0, _RET_IP_);
 	if (likely(go_highway(rps, +1))) {
 		return;
 	}
-	go_lowway(rps);
+	go_lowway(rps, subclass);
+}
+
+void rps_down_read(struct rps *rps) {
+	rps_down_read_nested(rps, 0);
 }
 
 int rps_down_read_try_lock(struct rps *rps) {
 	if (likely(go_highway(rps, +1))) {
+		rwsem_acquire_read(&rps->dep_map, 0, 1, _RET_IP_);
 		return 1;
 	}
 	if (down_read_trylock(&rps->rw_sem)) {
 		atomic_inc(&rps->lowway_cnt);
 		up_read(&rps->rw_sem);
+		rwsem_acquire_read(&rps->dep_map, 0, 1, _RET_IP_);
 		return 1;
 	}
 	return 0;
 }
 
 void rps_up_read(struct rps *rps) {
+	rwsem_release(&rps->dep_map, 1, _RET_IP_);
 	if (likely(go_highway(rps, -1)))
 		return;
 	if (atomic_dec_and_test(&rps->lowway_cnt))
 		wake_up_all(&rps->writers_wait_q);
 }
 
+static void set_writer_flags(struct rps *rps, int val) {
+	int node;
+
+	for_each_node(node)
+		WRITE_ONCE(rps->nodes[node]->writer, val);
+}
+
+/* only visit CPUs that have ever taken the highway */
 static int clear_highway(struct rps *rps) {
+	struct rps_node *rn;
 	int sum = 0;
-	int cpu;
-	for_each_possible_cpu(cpu) {
-		sum += per_cpu(*rps->highway_cnt, cpu);
-		per_cpu(*rps->highway_cnt, cpu) = 0;
+	int node, cpu;
+
+	for_each_node(node) {
+		rn = rps->nodes[node];
+		for_each_cpu(cpu, rn->used_cpus) {
+			sum += per_cpu(*rps->highway_cnt, cpu);
+			per_cpu(*rps->highway_cnt, cpu) = 0;
+		}
 	}
 	return sum;
 }
 
+/*
+ * Runs a grace period after the last writer left. A writer that arrived
+ * meanwhile keeps the flags set and skips its own grace period.
+ */
+static void rps_clear_writer_flags(struct rcu_head *head) {
+	struct rps *rps = container_of(head, struct rps, rcu);
+
+	spin_lock(&rps->gp_lock);
+	rps->clear_queued = false;
+	if (!rps->nr_writers) {
+		set_writer_flags(rps, 0);
+		rps->gp_state = RPS_IDLE;
+	}
+	spin_unlock(&rps->gp_lock);
+}
+
 void rps_down_write(struct rps *rps) {
-	atomic_inc(&rps->writers_cnt); 
-	synchronize_sched_expedited(); 
-	down_write(&rps->rw_sem); 
+	rwsem_acquire(&rps->dep_map, 0, 0, _RET_IP_);
+
+	spin_lock_bh(&rps->gp_lock);
+	rps->nr_writers++;
+	if (rps->gp_state == RPS_IDLE) {
+		rps->gp_state = RPS_GP_WAIT;
+		spin_unlock_bh(&rps->gp_lock);
+
+		set_writer_flags(rps, 1);
+		synchronize_sched_expedited();
+
+		spin_lock_bh(&rps->gp_lock);
+		rps->gp_state = RPS_ACTIVE;
+		spin_unlock_bh(&rps->gp_lock);
+		wake_up_all(&rps->writers_wait_q);
+	} else {
+		/* back-to-back writers share the first one's grace period */
+		spin_unlock_bh(&rps->gp_lock);
+		wait_event(rps->writers_wait_q,
+				   READ_ONCE(rps->gp_state) == RPS_ACTIVE);
+	}
+
+	down_write(&rps->rw_sem);
 	atomic_add(clear_highway(rps), &rps->lowway_cnt);
-	wait_event(rps->writers_wait_q, !atomic_read(&rps->lowway_cnt)); 
+	wait_event(rps->writers_wait_q, !atomic_read(&rps->lowway_cnt));
 }
 
 void rps_up_write(struct rps *rps) {
-	up_write(&rps->rw_sem); 
-	synchronize_sched_expedited(); 
-	atomic_dec(&rps->writers_cnt);
+	up_write(&rps->rw_sem);
+
+	spin_lock_bh(&rps->gp_lock);
+	if (!--rps->nr_writers && !rps->clear_queued) {
+		rps->clear_queued = true;
+		call_rcu_sched(&rps->rcu, rps_clear_writer_flags);
+	}
+	spin_unlock_bh(&rps->gp_lock);
+
+	rwsem_release(&rps->dep_map, 1, _RET_IP_);
 }
@@ -6,17 +6,47 @@
 #include <linux/percpu.h>
 #include <linux/wait.h>
 #include <linux/lockdep.h>
+#include <linux/cpumask.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+
+/*
+ * Per-NUMA-node reader indicator: readers only ever read the writer flag
+ * of their own node, and the drain only visits CPUs that took the highway.
+ */
+struct rps_node {
+    int writer;                    /* a writer is pending or active */
+    cpumask_var_t used_cpus;       /* CPUs whose highway_cnt may be non-zero */
+} ____cacheline_aligned_in_smp;
+
+enum {
+    RPS_IDLE,                      /* writer flags clear, readers on highway */
+    RPS_GP_WAIT,                   /* flags set, waiting for a grace period */
+    RPS_ACTIVE,                    /* flags set, all readers on lowway */
+};
 
 struct rps {
     int __percpu *highway_cnt;
+    struct rps_node **nodes;
     atomic_t lowway_cnt;
-    atomic_t writers_cnt;
     wait_queue_head_t writers_wait_q;
     struct rw_semaphore rw_sem;
+
+    /* writer side, protected by gp_lock */
+    spinlock_t gp_lock;
+    int gp_state;
+    unsigned int nr_writers;       /* queued and active writers */
+    bool clear_queued;             /* flag clearing waits for a grace period */
+    struct rcu_head rcu;
+#ifdef CONFIG_DEBUG_LOCK_ALLOC
+    struct lockdep_map dep_map;
+#endif
 };
 
 void rps_down_read(struct rps *);
 
+void rps_down_read_nested(struct rps *, int);
+
 int rps_down_read_try_lock(struct rps *rps);
 
 void rps_up_read(struct rps *);
@@ -25,15 +55,16 @@ void rps_down_write(struct rps *);
 
 void rps_up_write(struct rps *);
 
-int __rps_init_rwsem(struct rps *,
-                     const char *, struct lock_class_key *);
+int __rps_init_rwsem(struct rps *, const char *,
+                     struct lock_class_key *, struct lock_class_key *);
 
 void rps_free_rwsem(struct rps *);
 
 #define rps_init_rwsem(sem)    \
-do {                                \
+({                                \
     static struct lock_class_key __key;            \
-    __rps_init_rwsem(sem, #sem, &__key);        \
-}while(0)
+    static struct lock_class_key __rw_sem_key;        \
+    __rps_init_rwsem(sem, #sem, &__key, &__rw_sem_key);    \
+})
 
 #endif
@@ -16,6 +16,7 @@
 #include <linux/kthread.h>
 #include <linux/vmalloc.h>
 #include <linux/swap.h>
+#include <linux/hash.h>
 
 #include "f2fs.h"
 #include "segment.h"
@@ -223,30 +224,18 @@ void register_inmem_page(struct inode *inode, struct page *page) {
 	trace_f2fs_register_inmem_page(page, INMEM);
 }
 
-void commit_inmem_pages(struct inode *inode, bool abort) {
-	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+/* returns true if a page was written, the caller submits the bio */
+static bool __commit_inmem_pages(struct inode *inode, bool abort) {
 	struct f2fs_inode_info *fi = F2FS_I(inode);
 	struct inmem_pages *cur, *tmp;
 	bool submit_bio = false;
 	struct f2fs_io_info fio = {
-			.sbi = sbi,
+			.sbi = F2FS_I_SB(inode),
 			.type = DATA,
 			.rw = WRITE_SYNC | REQ_PRIO,
 			.encrypted_page = NULL,
 	};
 
-	/*
-	 * The abort is true only when f2fs_evict_inode is called.
-	 * Basically, the f2fs_evict_inode doesn't produce any data writes, so
-	 * that we don't need to call f2fs_balance_fs.
-	 * Otherwise, f2fs_gc in f2fs_balance_fs can wait forever until this
-	 * inode becomes free by iget_locked in f2fs_iget.
-	 */
-	if (!abort) {
-		f2fs_balance_fs(sbi);
-		f2fs_lock_op(sbi);
-	}
-
 	mutex_lock(&fi->inmem_lock);
 	list_for_each_entry_safe(cur, tmp, &fi->inmem_pages, list) {
 		if (!abort) {
@@ -272,6 +261,26 @@ void commit_inmem_pages(struct inode *inode, bool abort) {
 		dec_page_count(F2FS_I_SB(inode), F2FS_INMEM_PAGES);
 	}
 	mutex_unlock(&fi->inmem_lock);
+	return submit_bio;
+}
+
+void commit_inmem_pages(struct inode *inode, bool abort) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	bool submit_bio;
+
+	/*
+	 * The abort is true only when f2fs_evict_inode is called.
+	 * Basically, the f2fs_evict_inode doesn't produce any data writes, so
+	 * that we don't need to call f2fs_balance_fs.
+	 * Otherwise, f2fs_gc in f2fs_balance_fs can wait forever until this
+	 * inode becomes free by iget_locked in f2fs_iget.
+	 */
+	if (!abort) {
+		f2fs_balance_fs(sbi);
+		f2fs_lock_op(sbi);
+	}
+
+	submit_bio = __commit_inmem_pages(inode, abort);
 
 	if (!abort) {
 		f2fs_unlock_op(sbi);
@@ -280,6 +289,31 @@ void commit_inmem_pages(struct inode *inode, bool abort) {
 	}
 }
 
+/*
+ * Write the atomic pages of all members of a transaction under one
+ * f2fs_lock_op() hold, so that a checkpoint sees either none or all of
+ * them, and submit them as one plugged batch.
+ */
+void commit_inmem_pages_txn(struct inode **inodes, int nr) {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inodes[0]);
+	struct blk_plug plug;
+	bool submit_bio = false;
+	int i;
+
+	f2fs_balance_fs(sbi);
+	blk_start_plug(&plug);
+	f2fs_lock_op(sbi);
+	for (i = 0; i < nr; i++) {
+		clear_inode_flag(F2FS_I(inodes[i]), FI_ATOMIC_FILE);
+		if (__commit_inmem_pages(inodes[i], false))
+			submit_bio = true;
+	}
+	f2fs_unlock_op(sbi);
+	if (submit_bio)
+		f2fs_submit_merged_bio(sbi, DATA, WRITE);
+	blk_finish_plug(&plug);
+}
+
 /*
  * This function balances dirty node and dentry pages.
  * In addition, it controls garbage collection.
@@ -288,16 +322,27 @@ void f2fs_balance_fs(struct f2fs_sb_info *sbi) {
 	/*
 	 * We should do GC or end up with checkpoint, if there are so many dirty
 	 * dir/node pages without enough free segments.
+	 * Up to nr_gc_workers writers clean disjoint victims in parallel, the
+	 * others just wait until one of them has made room.
 	 */
-	if (has_not_enough_free_secs(sbi, 0)) {
-		mutex_lock(&sbi->gc_mutex);
-		f2fs_gc(sbi);
+	while (has_not_enough_free_secs(sbi, 0)) {
+		if (atomic_inc_return(&sbi->nr_fg_gc) <= sbi->nr_gc_workers) {
+			f2fs_gc(sbi);
+			atomic_dec(&sbi->nr_fg_gc);
+			wake_up_all(&sbi->fg_gc_wait);
+			return;
+		}
+		atomic_dec(&sbi->nr_fg_gc);
+		wait_event(sbi->fg_gc_wait, !has_not_enough_free_secs(sbi, 0) ||
+				   atomic_read(&sbi->nr_fg_gc) < sbi->nr_gc_workers);
 	}
 }
 
 void f2fs_balance_fs_bg(struct f2fs_sb_info *sbi) {
 	/* try to shrink extent cache when there is no enough memory */
 	f2fs_shrink_extent_tree(sbi, EXTENT_CACHE_SHRINK_NUMBER);
+	f2fs_shrink_dir_index(sbi, DIR_INDEX_SHRINK_NUMBER);
+	f2fs_shrink_block_map(sbi, BMAP_CACHE_SHRINK_NUMBER);
 
 	/* check the # of cached NAT entries and prefree segments */
 	if (try_to_free_nats(sbi, NAT_ENTRY_PER_BLOCK) ||
@@ -306,41 +351,136 @@ void f2fs_balance_fs_bg(struct f2fs_sb_info *sbi) {
 		f2fs_sync_fs(sbi->sb, true);
 }
 
-static int issue_flush_thread(void *data) {
-	struct f2fs_sb_info *sbi = data;
+static inline bool flush_seq_before(unsigned int a, unsigned int b) {
+	return (int) (a - b) < 0;
+}
+
+static void flush_seq_advance(atomic_t *v, unsigned int seq) {
+	unsigned int old = atomic_read(v), cur;
+
+	while (flush_seq_before(old, seq)) {
+		cur = atomic_cmpxchg(v, old, seq);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+
+/*
+ * A failed flush stays reported to every seq it covered, even after a
+ * newer flush succeeded, so no fsync it covered returns 0.
+ */
+static int flush_result(struct flush_cmd_control *fcc, unsigned int seq) {
+	int ret = 0;
+
+	spin_lock(&fcc->flushed_lock);
+	if (fcc->flushed_err && !flush_seq_before(seq, fcc->err_lo) &&
+		!flush_seq_before(fcc->err_hi, seq))
+		ret = fcc->flushed_err;
+	spin_unlock(&fcc->flushed_lock);
+	return ret;
+}
+
+static void flush_done(struct flush_cmd_control *fcc, unsigned int lo,
+					   unsigned int covered, int ret) {
+	spin_lock(&fcc->flushed_lock);
+	if (ret) {
+		if (!fcc->flushed_err || flush_seq_before(lo, fcc->err_lo))
+			fcc->err_lo = lo;
+		if (!fcc->flushed_err || flush_seq_before(fcc->err_hi, covered))
+			fcc->err_hi = covered;
+		fcc->flushed_err = ret;
+	}
+	flush_seq_advance(&fcc->flushed_seq, covered);
+	spin_unlock(&fcc->flushed_lock);
+	wake_up_all(&fcc->flushed_wait);
+}
+
+/*
+ * Make sure a flush covering every command up to seq has completed.
+ * A command's writes are done before it gets its seq, so any flush
+ * submitted after that covers it, even one issued by another node's
+ * thread. Reuse such a flush instead of sending one more to the device.
+ */
+static int flush_upto(struct f2fs_sb_info *sbi, unsigned int seq) {
 	struct flush_cmd_control *fcc = SM_I(sbi)->cmd_control_info;
-	wait_queue_head_t *q = &fcc->flush_wait_queue;
+	unsigned int lo, covered;
+	struct bio *bio;
+	int ret;
+
+	if (!flush_seq_before(atomic_read(&fcc->flushed_seq), seq))
+		return flush_result(fcc, seq);
+
+	if (!flush_seq_before(atomic_read(&fcc->inflight_seq), seq)) {
+		wait_event(fcc->flushed_wait,
+				   !flush_seq_before(atomic_read(&fcc->flushed_seq), seq));
+		return flush_result(fcc, seq);
+	}
+
+	/* this flush may be the first to cover any seq after flushed_seq */
+	lo = atomic_read(&fcc->flushed_seq) + 1;
+	covered = atomic_read(&fcc->queued_seq);
+	flush_seq_advance(&fcc->inflight_seq, covered);
+
+	bio = bio_alloc(GFP_NOIO, 0);
+	bio->bi_bdev = sbi->sb->s_bdev;
+	ret = submit_bio_wait(WRITE_FLUSH, bio);
+	bio_put(bio);
+
+	flush_done(fcc, lo, covered, ret);
+	return ret ? ret : flush_result(fcc, seq);
+}
+
+static int issue_flush_thread(void *data) {
+	struct flush_cmd_queue *fcq = data;
+	struct f2fs_sb_info *sbi = fcq->sbi;
+	wait_queue_head_t *q = &fcq->flush_wait_queue;
 	repeat:
 	if (kthread_should_stop())
 		return 0;
 
-	if (!llist_empty(&fcc->issue_list)) {
-		struct bio *bio = bio_alloc(GFP_NOIO, 0);
+	if (!llist_empty(&fcq->issue_list)) {
 		struct flush_cmd *cmd, *next;
+		unsigned int last = 0;
+		int nr = 0;
 		int ret;
 
-		fcc->dispatch_list = llist_del_all(&fcc->issue_list);
-		fcc->dispatch_list = llist_reverse_order(fcc->dispatch_list);
+		/* let concurrent fsyncs join this flush while it pays off */
+		if (fcq->window)
+			usleep_range(fcq->window, fcq->window * 2);
 
-		bio->bi_bdev = sbi->sb->s_bdev;
-		ret = submit_bio_wait(WRITE_FLUSH, bio);
+		fcq->dispatch_list = llist_del_all(&fcq->issue_list);
+		fcq->dispatch_list = llist_reverse_order(fcq->dispatch_list);
+
+		llist_for_each_entry(cmd, fcq->dispatch_list, llnode) {
+			if (!nr++ || flush_seq_before(last, cmd->seq))
+				last = cmd->seq;
+		}
+
+		ret = flush_upto(sbi, last);
 
 		llist_for_each_entry_safe(cmd, next,
-								  fcc->dispatch_list, llnode) {
+								  fcq->dispatch_list, llnode) {
 			cmd->ret = ret;
 			complete(&cmd->wait);
 		}
-		bio_put(bio);
-		fcc->dispatch_list = NULL;
+		fcq->dispatch_list = NULL;
+
+		if (nr > 1)
+			fcq->window = min(fcq->window + FLUSH_WINDOW_STEP,
+							  (unsigned int) MAX_FLUSH_WINDOW);
+		else
+			fcq->window >>= 1;
 	}
 
 	wait_event_interruptible(*q,
-							 kthread_should_stop() || !llist_empty(&fcc->issue_list));
+							 kthread_should_stop() || !llist_empty(&fcq->issue_list));
 	goto repeat;
 }
 
 int f2fs_issue_flush(struct f2fs_sb_info *sbi) {
 	struct flush_cmd_control *fcc = SM_I(sbi)->cmd_control_info;
+	struct flush_cmd_queue *fcq;
 	struct flush_cmd cmd;
 
 	trace_f2fs_issue_flush(sbi->sb, test_opt(sbi, NOBARRIER),
@@ -352,12 +492,15 @@ int f2fs_issue_flush(struct f2fs_sb_info *sbi) {
 	if (!test_opt(sbi, FLUSH_MERGE))
 		return blkdev_issue_flush(sbi->sb->s_bdev, GFP_KERNEL, NULL);
 
+	fcq = &fcc->queues[numa_node_id() % fcc->nr_queues];
+
 	init_completion(&cmd.wait);
+	cmd.seq = atomic_inc_return(&fcc->queued_seq);
 
-	llist_add(&cmd.llnode, &fcc->issue_list);
+	llist_add(&cmd.llnode, &fcq->issue_list);
 
-	if (!fcc->dispatch_list)
-		wake_up(&fcc->flush_wait_queue);
+	if (!fcq->dispatch_list)
+		wake_up(&fcq->flush_wait_queue);
 
 	wait_for_completion(&cmd.wait);
 
@@ -367,21 +510,42 @@ int f2fs_issue_flush(struct f2fs_sb_info *sbi) {
 int create_flush_cmd_control(struct f2fs_sb_info *sbi) {
 	dev_t dev = sbi->sb->s_bdev->bd_dev;
 	struct flush_cmd_control *fcc;
+	struct flush_cmd_queue *fcq;
+	int node;
 	int err = 0;
 
 	fcc = kzalloc(sizeof(struct flush_cmd_control), GFP_KERNEL);
 	if (!fcc)
 		return -ENOMEM;
-	init_waitqueue_head(&fcc->flush_wait_queue);
-	init_llist_head(&fcc->issue_list);
-	SM_I(sbi)->cmd_control_info = fcc;
-	fcc->f2fs_issue_flush = kthread_run(issue_flush_thread, sbi,
-										"f2fs_flush-%u:%u", MAJOR(dev), MINOR(dev));
-	if (IS_ERR(fcc->f2fs_issue_flush)) {
-		err = PTR_ERR(fcc->f2fs_issue_flush);
+	fcc->nr_queues = nr_node_ids;
+	fcc->queues = kcalloc(fcc->nr_queues, sizeof(struct flush_cmd_queue),
+						  GFP_KERNEL);
+	if (!fcc->queues) {
 		kfree(fcc);
-		SM_I(sbi)->cmd_control_info = NULL;
-		return err;
+		return -ENOMEM;
+	}
+	init_waitqueue_head(&fcc->flushed_wait);
+	spin_lock_init(&fcc->flushed_lock);
+	SM_I(sbi)->cmd_control_info = fcc;
+
+	for (node = 0; node < fcc->nr_queues; node++) {
+		fcq = &fcc->queues[node];
+		fcq->sbi = sbi;
+		init_waitqueue_head(&fcq->flush_wait_queue);
+		init_llist_head(&fcq->issue_list);
+		fcq->f2fs_issue_flush = kthread_create_on_node(issue_flush_thread,
+							fcq, node, "f2fs_flush-%u:%u-%d",
+							MAJOR(dev), MINOR(dev), node);
+		if (IS_ERR(fcq->f2fs_issue_flush)) {
+			err = PTR_ERR(fcq->f2fs_issue_flush);
+			fcq->f2fs_issue_flush = NULL;
+			destroy_flush_cmd_control(sbi);
+			return err;
+		}
+		if (node_state(node, N_CPU))
+			set_cpus_allowed_ptr(fcq->f2fs_issue_flush,
+								 cpumask_of_node(node));
+		wake_up_process(fcq->f2fs_issue_flush);
 	}
 
 	return err;
@@ -389,9 +553,14 @@ int create_flush_cmd_control(struct f2fs_sb_info *sbi) {
 
 void destroy_flush_cmd_control(struct f2fs_sb_info *sbi) {
 	struct flush_cmd_control *fcc = SM_I(sbi)->cmd_control_info;
+	int node;
 
-	if (fcc && fcc->f2fs_issue_flush)
-		kthread_stop(fcc->f2fs_issue_flush);
+	if (!fcc)
+		return;
+	for (node = 0; node < fcc->nr_queues; node++)
+		if (fcc->queues[node].f2fs_issue_flush)
+			kthread_stop(fcc->queues[node].f2fs_issue_flush);
+	kfree(fcc->queues);
 	kfree(fcc);
 	SM_I(sbi)->cmd_control_info = NULL;
 }
@@ -405,7 +574,11 @@ static void __locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 		return;
 
 	if (!test_and_set_bit(segno, dirty_i->dirty_segmap[dirty_type]))
+#ifdef LOCKFREE_SIT
+		atomic_inc(&dirty_i->nr_dirty[dirty_type]);
+#else
 		dirty_i->nr_dirty[dirty_type]++;
+#endif
 
 	if (dirty_type == DIRTY) {
 		struct seg_entry *sentry = get_seg_entry(sbi, segno);
@@ -416,7 +589,11 @@ static void __locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 			return;
 		}
 		if (!test_and_set_bit(segno, dirty_i->dirty_segmap[t]))
+#ifdef LOCKFREE_SIT
+			atomic_inc(&dirty_i->nr_dirty[t]);
+#else
 			dirty_i->nr_dirty[t]++;
+#endif
 	}
 }
 
@@ -425,14 +602,22 @@ static void __remove_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 
 	if (test_and_clear_bit(segno, dirty_i->dirty_segmap[dirty_type]))
+#ifdef LOCKFREE_SIT
+		atomic_dec(&dirty_i->nr_dirty[dirty_type]);
+#else
 		dirty_i->nr_dirty[dirty_type]--;
+#endif
 
 	if (dirty_type == DIRTY) {
 		struct seg_entry *sentry = get_seg_entry(sbi, segno);
 		enum dirty_type t = sentry->type;
 
 		if (test_and_clear_bit(segno, dirty_i->dirty_segmap[t]))
+#ifdef LOCKFREE_SIT
+			atomic_dec(&dirty_i->nr_dirty[t]);
+#else
 			dirty_i->nr_dirty[t]--;
+#endif
 
 		if (get_valid_blocks(sbi, segno, sbi->segs_per_sec) == 0)
 			clear_bit(GET_SECNO(sbi, segno),
@@ -445,14 +630,41 @@ static void __remove_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno,
  * Adding dirty entry into seglist is not critical operation.
  * If a given segment is one of current working segments, it won't be added.
  */
-static void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno) {
+/*
+ * Move a section to the bucket of its current valid block count. The caller
+ * serializes updates of the same section.
+ */
+static void __update_gc_bucket(struct f2fs_sb_info *sbi, unsigned int secno) {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned char old = dirty_i->sec_gc_bucket[secno];
+	unsigned char new = gc_bucket_of(sbi, get_valid_blocks(sbi,
+							secno * sbi->segs_per_sec, sbi->segs_per_sec));
+
+	if (old == new)
+		return;
+	if (old != NO_GC_BUCKET) {
+		clear_bit(secno, dirty_i->gc_buckets[old]);
+		atomic_dec(&dirty_i->nr_gc_bucket[old]);
+	}
+	if (new != NO_GC_BUCKET) {
+		set_bit(secno, dirty_i->gc_buckets[new]);
+		atomic_inc(&dirty_i->nr_gc_bucket[new]);
+	}
+	dirty_i->sec_gc_bucket[secno] = new;
+}
+
+static void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno) {
 	unsigned short valid_blocks;
 
 	if (segno == NULL_SEGNO || IS_CURSEG(sbi, segno))
 		return;
 
-	mutex_lock(&dirty_i->seglist_lock);
+	/*
+	 * Every SIT update is followed by a locate of its segment, so with
+	 * LOCKFREE_SIT it is enough to serialize the locates of the same
+	 * section: the last one sees the latest valid block count.
+	 */
+	lock_dirty_segment(sbi, segno);
 
 	valid_blocks = get_valid_blocks(sbi, segno, 0);
 
@@ -465,8 +677,9 @@ static void locate_dirty_segment(struct f2fs_sb_info *sbi, unsigned int segno) {
 		/* Recovery routine with SSR needs this */
 		__remove_dirty_segment(sbi, segno, DIRTY);
 	}
+	__update_gc_bucket(sbi, GET_SECNO(sbi, segno));
 
-	mutex_unlock(&dirty_i->seglist_lock);
+	unlock_dirty_segment(sbi, segno);
 }
 
 static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
@@ -481,8 +694,13 @@ static int f2fs_issue_discard(struct f2fs_sb_info *sbi,
 		se = get_seg_entry(sbi, GET_SEGNO(sbi, i));
 		offset = GET_BLKOFF_FROM_SEG0(sbi, i);
 
+#ifdef LOCKFREE_SIT
+		if (!f2fs_test_and_set_bit_atomic(offset, se->discard_map))
+			percpu_counter_dec(&sbi->discard_blks);
+#else
 		if (!f2fs_test_and_set_bit(offset, se->discard_map))
 			sbi->discard_blks--;
+#endif
 	}
 	trace_f2fs_issue_discard(sbi->sb, blkstart, blklen);
 	return blkdev_issue_discard(sbi->sb->s_bdev, start, len, GFP_NOFS, 0);
@@ -539,14 +757,15 @@ static void add_discard_addrs(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	unsigned long *discard_map = (unsigned long *) se->discard_map;
 	unsigned long *dmap = SIT_I(sbi)->tmp_map;
 	unsigned int start = 0, end = -1;
+	unsigned int valid_blocks = get_valid_blocks(sbi, cpc->trim_start, 0);
 	bool force = (cpc->reason == CP_DISCARD);
 	int i;
 
-	if (se->valid_blocks == max_blocks)
+	if (valid_blocks == max_blocks)
 		return;
 
 	if (!force) {
-		if (!test_opt(sbi, DISCARD) || !se->valid_blocks ||
+		if (!test_opt(sbi, DISCARD) || !valid_blocks ||
 			SM_I(sbi)->nr_discards >= SM_I(sbi)->max_discards)
 			return;
 	}
@@ -580,20 +799,84 @@ void release_discard_addrs(struct f2fs_sb_info *sbi) {
 /*
  * Should call clear_prefree_segments after checkpoint is done.
  */
+#ifdef LOCKFREE_SIT
+/*
+ * locate_dirty_segment() does not hold sentry_lock, so it can race with a
+ * log switching to the same segment and put a current segment back into
+ * the dirty seglist. Drop them before prefree segments are freed.
+ */
+static void __remove_dirty_cursegs(struct f2fs_sb_info *sbi) {
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int segno;
+	int i, t;
+
+#ifdef MLOG
+	for (i = 0; i < NR_CURSEG_TYPE * sbi->nr_mlog; i++) {
+#else
+	for (i = 0; i < NR_CURSEG_TYPE; i++) {
+#endif
+		segno = CURSEG_I(sbi, i)->segno;
+		if (segno == NULL_SEGNO)
+			continue;
+		lock_dirty_segment(sbi, segno);
+		for (t = DIRTY_HOT_DATA; t < NR_DIRTY_TYPE; t++)
+			if (test_and_clear_bit(segno, dirty_i->dirty_segmap[t]))
+				atomic_dec(&dirty_i->nr_dirty[t]);
+		unlock_dirty_segment(sbi, segno);
+	}
+}
+#endif
+
 static void set_prefree_as_free_segments(struct f2fs_sb_info *sbi) {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	unsigned int segno;
 
 	mutex_lock(&dirty_i->seglist_lock);
+#ifdef LOCKFREE_SIT
+	__remove_dirty_cursegs(sbi);
+#endif
 	for_each_set_bit(segno, dirty_i->dirty_segmap[PRE], MAIN_SEGS(sbi)) __set_test_and_free(sbi, segno);
 	mutex_unlock(&dirty_i->seglist_lock);
 }
 
+/*
+ * An epoch checkpoint lets operations resume before its pack is durable,
+ * so prefree segments must not be reused until then. Remember the ones
+ * this checkpoint covers and free them in clear_prefree_segments().
+ */
+static void freeze_prefree_segments(struct f2fs_sb_info *sbi) {
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+
+	mutex_lock(&dirty_i->seglist_lock);
+#ifdef LOCKFREE_SIT
+	__remove_dirty_cursegs(sbi);
+#endif
+	bitmap_copy(dirty_i->frozen_prefree_map, dirty_i->dirty_segmap[PRE],
+				MAIN_SEGS(sbi));
+	dirty_i->nr_frozen_prefree = prefree_segments(sbi);
+	mutex_unlock(&dirty_i->seglist_lock);
+}
+
+/*
+ * The epoch checkpoint failed, so its frozen segments stay prefree and
+ * only stop being held back for it.
+ */
+void thaw_prefree_segments(struct f2fs_sb_info *sbi) {
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+
+	mutex_lock(&dirty_i->seglist_lock);
+	bitmap_zero(dirty_i->frozen_prefree_map, MAIN_SEGS(sbi));
+	dirty_i->nr_frozen_prefree = 0;
+	mutex_unlock(&dirty_i->seglist_lock);
+}
+
 void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	struct list_head *head = &(SM_I(sbi)->discard_list);
 	struct discard_entry *entry, *this;
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
-	unsigned long *prefree_map = dirty_i->dirty_segmap[PRE];
+	bool frozen = cpc->epoch;
+	unsigned long *prefree_map = frozen ? dirty_i->frozen_prefree_map :
+								 dirty_i->dirty_segmap[PRE];
 	unsigned int start = 0, end = -1;
 
 	mutex_lock(&dirty_i->seglist_lock);
@@ -606,22 +889,45 @@ void clear_prefree_segments(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 		end = find_next_zero_bit(prefree_map, MAIN_SEGS(sbi),
 								 start + 1);
 
-		for (i = start; i < end; i++)
+		/*
+		 * Operations of the next epoch already run, so frozen segments
+		 * must be discarded before they become allocatable again.
+		 */
+		if (test_opt(sbi, DISCARD))
+			f2fs_issue_discard(sbi, START_BLOCK(sbi, start),
+							   (end - start) << sbi->log_blocks_per_seg);
+
+		for (i = start; i < end; i++) {
+#ifdef LOCKFREE_SIT
+			/* locate_dirty_segment() sets PRE under the segment lock */
+			lock_dirty_segment(sbi, i);
+#endif
 			clear_bit(i, prefree_map);
+			if (frozen) {
+				clear_bit(i, dirty_i->dirty_segmap[PRE]);
+				__set_test_and_free(sbi, i);
+			}
+#ifdef LOCKFREE_SIT
+			atomic_dec(&dirty_i->nr_dirty[PRE]);
+			unlock_dirty_segment(sbi, i);
+#endif
+		}
 
+#ifndef LOCKFREE_SIT
 		dirty_i->nr_dirty[PRE] -= end - start;
-
-		if (!test_opt(sbi, DISCARD))
-			continue;
-
-		f2fs_issue_discard(sbi, START_BLOCK(sbi, start),
-						   (end - start) << sbi->log_blocks_per_seg);
+#endif
 	}
+	dirty_i->nr_frozen_prefree = 0;
 	mutex_unlock(&dirty_i->seglist_lock);
 
-	/* send small discards */
+	/*
+	 * send small discards; an epoch checkpoint drops them, since SSR of
+	 * the next epoch may already reuse those blocks. They stay clear in
+	 * discard_map, so the next fstrim still finds them.
+	 */
 	list_for_each_entry_safe(entry, this, head, list) {
-		if (cpc->reason == CP_DISCARD && entry->len < cpc->trim_minlen)
+		if (frozen || (cpc->reason == CP_DISCARD &&
+					   entry->len < cpc->trim_minlen))
 			goto skip;
 		f2fs_issue_discard(sbi, entry->blkaddr, entry->len);
 		cpc->trimmed += entry->len;
@@ -643,14 +949,158 @@ static bool __mark_sit_entry_dirty(struct f2fs_sb_info *sbi, unsigned int segno)
 	return true;
 }
 
+#ifdef LOCKFREE_SIT
+/*
+ * Block updates record dirty sentries in a small per-cpu cache, so that they
+ * neither take sentry_lock nor bounce dirty_sentries between cores. Once the
+ * cache is full, further segments go to a shared bitmap with atomic bit ops.
+ * Both are folded into dirty_sentries_bitmap when SIT is flushed.
+ */
+static void __mark_sit_entry_dirty_pcpu(struct f2fs_sb_info *sbi,
+										unsigned int segno) {
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct dirty_sentry_cache *dc;
+	unsigned int i;
+
+	dc = get_cpu_ptr(sit_i->dirty_sentries_pcpu);
+	for (i = 0; i < dc->nr; i++)
+		if (dc->segnos[i] == segno)
+			goto out;
+	if (dc->nr < DIRTY_SENTRY_BATCH)
+		dc->segnos[dc->nr++] = segno;
+	else if (!test_bit(segno, sit_i->dirty_sentries_spill))
+		set_bit(segno, sit_i->dirty_sentries_spill);
+	out:
+	put_cpu_ptr(sit_i->dirty_sentries_pcpu);
+}
+
+/*
+ * This should be called under sentry_lock while all the block updates are
+ * blocked by checkpoint.
+ */
+static void __merge_dirty_sentries(struct f2fs_sb_info *sbi) {
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct dirty_sentry_cache *dc;
+	unsigned int segno, i;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		dc = per_cpu_ptr(sit_i->dirty_sentries_pcpu, cpu);
+		for (i = 0; i < dc->nr; i++)
+			__mark_sit_entry_dirty(sbi, dc->segnos[i]);
+		dc->nr = 0;
+	}
+	for_each_set_bit(segno, sit_i->dirty_sentries_spill, MAIN_SEGS(sbi)) {
+		clear_bit(segno, sit_i->dirty_sentries_spill);
+		__mark_sit_entry_dirty(sbi, segno);
+	}
+}
+#endif
+
 static void __set_sit_entry_type(struct f2fs_sb_info *sbi, int type,
 								 unsigned int segno, int modified) {
 	struct seg_entry *se = get_seg_entry(sbi, segno);
 	se->type = type;
 	if (modified)
+#ifdef LOCKFREE_SIT
+		__mark_sit_entry_dirty_pcpu(sbi, segno);
+#else
 		__mark_sit_entry_dirty(sbi, segno);
+#endif
 }
 
+#ifdef LOCKFREE_SIT
+
+/*
+ * Lock-free version: the valid block counters are atomic and the bitmaps
+ * are updated with atomic bit operations, so that block allocation and
+ * invalidation of different logs do not serialize on sentry_lock.
+ */
+static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del) {
+	struct seg_entry *se;
+	unsigned int segno, offset;
+	unsigned long long mtime;
+	long int new_vblocks;
+
+	segno = GET_SEGNO(sbi, blkaddr);
+
+	se = get_seg_entry(sbi, segno);
+	new_vblocks = atomic_add_return(del, &se->valid_blocks);
+	offset = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
+
+	f2fs_bug_on(sbi, (new_vblocks < 0 ||
+					  (new_vblocks > sbi->blocks_per_seg)));
+
+	mtime = get_mtime(sbi);
+	advance_mtime(&se->mtime, mtime);
+	advance_mtime(&SIT_I(sbi)->max_mtime, mtime);
+	/* Update valid block bitmap */
+	if (del > 0) {
+		if (f2fs_test_and_set_bit_atomic(offset, se->cur_valid_map))
+			f2fs_bug_on(sbi, 1);
+		if (!f2fs_test_and_set_bit_atomic(offset, se->discard_map))
+			percpu_counter_dec(&sbi->discard_blks);
+	} else {
+		if (!f2fs_test_and_clear_bit_atomic(offset, se->cur_valid_map))
+			f2fs_bug_on(sbi, 1);
+		if (f2fs_test_and_clear_bit_atomic(offset, se->discard_map))
+			percpu_counter_inc(&sbi->discard_blks);
+	}
+	if (!f2fs_test_bit(offset, se->ckpt_valid_map))
+		atomic_add(del, &se->ckpt_valid_blocks);
+
+	__mark_sit_entry_dirty_pcpu(sbi, segno);
+
+	/* update total number of valid blocks to be written in ckpt area */
+	percpu_counter_add(&SIT_I(sbi)->written_valid_blocks, del);
+
+	if (sbi->segs_per_sec > 1)
+		atomic_add(del, &get_sec_entry(sbi, segno)->valid_blocks);
+}
+
+/* account a run of newly written blocks inside one segment at once */
+static void update_sit_entry_run(struct f2fs_sb_info *sbi, block_t blkaddr,
+								 unsigned int nr) {
+	struct seg_entry *se;
+	unsigned int segno, offset, i;
+	unsigned long long mtime;
+	long int new_vblocks;
+	int ckpt_new = 0, discarded = 0;
+
+	segno = GET_SEGNO(sbi, blkaddr);
+	offset = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
+	f2fs_bug_on(sbi, offset + nr > sbi->blocks_per_seg);
+
+	se = get_seg_entry(sbi, segno);
+	new_vblocks = atomic_add_return(nr, &se->valid_blocks);
+	f2fs_bug_on(sbi, new_vblocks > sbi->blocks_per_seg);
+
+	mtime = get_mtime(sbi);
+	advance_mtime(&se->mtime, mtime);
+	advance_mtime(&SIT_I(sbi)->max_mtime, mtime);
+	for (i = offset; i < offset + nr; i++) {
+		if (f2fs_test_and_set_bit_atomic(i, se->cur_valid_map))
+			f2fs_bug_on(sbi, 1);
+		if (!f2fs_test_and_set_bit_atomic(i, se->discard_map))
+			discarded++;
+		if (!f2fs_test_bit(i, se->ckpt_valid_map))
+			ckpt_new++;
+	}
+	if (discarded)
+		percpu_counter_sub(&sbi->discard_blks, discarded);
+	if (ckpt_new)
+		atomic_add(ckpt_new, &se->ckpt_valid_blocks);
+
+	__mark_sit_entry_dirty_pcpu(sbi, segno);
+
+	percpu_counter_add(&SIT_I(sbi)->written_valid_blocks, nr);
+
+	if (sbi->segs_per_sec > 1)
+		atomic_add(nr, &get_sec_entry(sbi, segno)->valid_blocks);
+}
+
+#else
+
 static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del) {
 	struct seg_entry *se;
 	unsigned int segno, offset;
@@ -692,6 +1142,40 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 		get_sec_entry(sbi, segno)->valid_blocks += del;
 }
 
+/* account a run of newly written blocks inside one segment at once */
+static void update_sit_entry_run(struct f2fs_sb_info *sbi, block_t blkaddr,
+								 unsigned int nr) {
+	struct seg_entry *se;
+	unsigned int segno, offset, i;
+
+	segno = GET_SEGNO(sbi, blkaddr);
+	offset = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
+	f2fs_bug_on(sbi, offset + nr > sbi->blocks_per_seg);
+
+	se = get_seg_entry(sbi, segno);
+	f2fs_bug_on(sbi, se->valid_blocks + nr > sbi->blocks_per_seg);
+	se->valid_blocks += nr;
+	se->mtime = get_mtime(sbi);
+	SIT_I(sbi)->max_mtime = se->mtime;
+	for (i = offset; i < offset + nr; i++) {
+		if (f2fs_test_and_set_bit(i, se->cur_valid_map))
+			f2fs_bug_on(sbi, 1);
+		if (!f2fs_test_and_set_bit(i, se->discard_map))
+			sbi->discard_blks--;
+		if (!f2fs_test_bit(i, se->ckpt_valid_map))
+			se->ckpt_valid_blocks++;
+	}
+
+	__mark_sit_entry_dirty(sbi, segno);
+
+	SIT_I(sbi)->written_valid_blocks += nr;
+
+	if (sbi->segs_per_sec > 1)
+		get_sec_entry(sbi, segno)->valid_blocks += nr;
+}
+
+#endif
+
 void refresh_sit_entry(struct f2fs_sb_info *sbi, block_t old, block_t new) {
 	update_sit_entry(sbi, new, 1);
 	if (GET_SEGNO(sbi, old) != NULL_SEGNO)
@@ -703,21 +1187,27 @@ void refresh_sit_entry(struct f2fs_sb_info *sbi, block_t old, block_t new) {
 
 void invalidate_blocks(struct f2fs_sb_info *sbi, block_t addr) {
 	unsigned int segno = GET_SEGNO(sbi, addr);
+#ifndef LOCKFREE_SIT
 	struct sit_info *sit_i = SIT_I(sbi);
+#endif
 
 	f2fs_bug_on(sbi, addr == NULL_ADDR);
 	if (addr == NEW_ADDR)
 		return;
 
 	/* add it into sit main buffer */
+#ifndef LOCKFREE_SIT
 	mutex_lock(&sit_i->sentry_lock);
+#endif
 
 	update_sit_entry(sbi, addr, -1);
 
 	/* add it into dirty seglist */
 	locate_dirty_segment(sbi, segno);
 
+#ifndef LOCKFREE_SIT
 	mutex_unlock(&sit_i->sentry_lock);
+#endif
 }
 
 /*
@@ -962,6 +1452,7 @@ static void reset_curseg(struct f2fs_sb_info *sbi, int type, int modified) {
 static void new_curseg(struct f2fs_sb_info *sbi, int type, int mlog, bool new_sec) {
 	struct curseg_info *curseg = CURSEG_I(sbi, type + mlog * NR_CURSEG_TYPE);
 	unsigned int segno = curseg->segno;
+	unsigned int old_segno = segno;
 	int dir = ALLOC_LEFT;
 
 	write_sum_page(sbi, curseg->sum_blk,
@@ -976,11 +1467,15 @@ static void new_curseg(struct f2fs_sb_info *sbi, int type, int mlog, bool new_se
 	curseg->next_segno = segno;
 	reset_curseg_mlog(sbi, type, mlog, 1);
 	curseg->alloc_type = LFS;
+
+	/* the old segment was skipped by locate_dirty_segment while current */
+	locate_dirty_segment(sbi, old_segno);
 }
 #else
 static void new_curseg(struct f2fs_sb_info *sbi, int type, bool new_sec) {
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
 	unsigned int segno = curseg->segno;
+	unsigned int old_segno = segno;
 	int dir = ALLOC_LEFT;
 
 	write_sum_page(sbi, curseg->sum_blk,
@@ -995,6 +1490,9 @@ static void new_curseg(struct f2fs_sb_info *sbi, int type, bool new_sec) {
 	curseg->next_segno = segno;
 	reset_curseg(sbi, type, 1);
 	curseg->alloc_type = LFS;
+
+	/* the old segment was skipped by locate_dirty_segment while current */
+	locate_dirty_segment(sbi, old_segno);
 }
 #endif
 
@@ -1034,9 +1532,9 @@ static void __refresh_next_blkoff(struct f2fs_sb_info *sbi,
  */
 #ifdef MLOG
 static void change_curseg(struct f2fs_sb_info *sbi, int type, int mlog, bool reuse) {
-	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	struct curseg_info *curseg = CURSEG_I(sbi, type + mlog * NR_CURSEG_TYPE);
 	unsigned int new_segno = curseg->next_segno;
+	unsigned int old_segno = curseg->segno;
 	struct f2fs_summary_block *sum_node;
 	struct page *sum_page;
 
@@ -1044,14 +1542,15 @@ static void change_curseg(struct f2fs_sb_info *sbi, int type, int mlog, bool reu
 				   GET_SUM_BLOCK(sbi, curseg->segno));
 	__set_test_and_inuse(sbi, new_segno);
 
-	mutex_lock(&dirty_i->seglist_lock);
+	lock_dirty_segment(sbi, new_segno);
 	__remove_dirty_segment(sbi, new_segno, PRE);
 	__remove_dirty_segment(sbi, new_segno, DIRTY);
-	mutex_unlock(&dirty_i->seglist_lock);
+	unlock_dirty_segment(sbi, new_segno);
 
 	reset_curseg_mlog(sbi, type, mlog, 1);
 	curseg->alloc_type = SSR;
 	__next_free_blkoff(sbi, curseg, 0);
+	locate_dirty_segment(sbi, old_segno);
 
 	if (reuse) {
 		sum_page = get_sum_page(sbi, new_segno);
@@ -1062,9 +1561,9 @@ static void change_curseg(struct f2fs_sb_info *sbi, int type, int mlog, bool reu
 }
 #else
 static void change_curseg(struct f2fs_sb_info *sbi, int type, bool reuse) {
-	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	struct curseg_info *curseg = CURSEG_I(sbi, type);
 	unsigned int new_segno = curseg->next_segno;
+	unsigned int old_segno = curseg->segno;
 	struct f2fs_summary_block *sum_node;
 	struct page *sum_page;
 
@@ -1072,14 +1571,15 @@ static void change_curseg(struct f2fs_sb_info *sbi, int type, bool reuse) {
 				   GET_SUM_BLOCK(sbi, curseg->segno));
 	__set_test_and_inuse(sbi, new_segno);
 
-	mutex_lock(&dirty_i->seglist_lock);
+	lock_dirty_segment(sbi, new_segno);
 	__remove_dirty_segment(sbi, new_segno, PRE);
 	__remove_dirty_segment(sbi, new_segno, DIRTY);
-	mutex_unlock(&dirty_i->seglist_lock);
+	unlock_dirty_segment(sbi, new_segno);
 
 	reset_curseg(sbi, type, 1);
 	curseg->alloc_type = SSR;
 	__next_free_blkoff(sbi, curseg, 0);
+	locate_dirty_segment(sbi, old_segno);
 
 	if (reuse) {
 		sum_page = get_sum_page(sbi, new_segno);
@@ -1223,9 +1723,9 @@ int f2fs_trim_fs(struct f2fs_sb_info *sbi, struct fstrim_range *range) {
 	for (; start_segno <= end_segno; start_segno = cpc.trim_end + 1) {
 		cpc.trim_start = start_segno;
 
-		if (sbi->discard_blks == 0)
+		if (discard_blocks(sbi) == 0)
 			break;
-		else if (sbi->discard_blks < BATCHED_TRIM_BLOCKS(sbi))
+		else if (discard_blocks(sbi) < BATCHED_TRIM_BLOCKS(sbi))
 			cpc.trim_end = end_segno;
 		else
 			cpc.trim_end = min_t(unsigned int,
@@ -1233,9 +1733,9 @@ int f2fs_trim_fs(struct f2fs_sb_info *sbi, struct fstrim_range *range) {
 										   BATCHED_TRIM_SEGMENTS(sbi),
 										   sbi->segs_per_sec) - 1, end_segno);
 
-		mutex_lock(&sbi->gc_mutex);
+		down_write(&sbi->gc_rwsem);
 		write_checkpoint(sbi, &cpc);
-		mutex_unlock(&sbi->gc_mutex);
+		up_write(&sbi->gc_rwsem);
 	}
 	out:
 	range->len = F2FS_BLK_TO_BYTES(cpc.trimmed);
@@ -1313,9 +1813,71 @@ static int __get_segment_type(struct page *page, enum page_type p_type) {
 	return __get_segment_type_6(page, p_type);
 }
 
-void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
-						 block_t old_blkaddr, block_t *new_blkaddr,
+#ifdef MLOG
+/* the inode owning the block; without a page fall back to the dnode nid */
+static nid_t __mlog_owner(struct page *page, struct f2fs_summary *sum,
+						  int type) {
+	if (!page)
+		return le32_to_cpu(sum->nid);
+	if (IS_NODESEG(type))
+		return ino_of_node(page);
+	return page->mapping->host->i_ino;
+}
+
+static int __select_mlog(struct f2fs_sb_info *sbi, struct page *page,
 						 struct f2fs_summary *sum, int type) {
+	switch (sbi->mlog_policy) {
+		case MLOG_ROUND_ROBIN:
+			return atomic_inc_return(&sbi->next_mlog) % sbi->nr_mlog;
+		case MLOG_INODE_HASH:
+			return hash_32(__mlog_owner(page, sum, type), 32) % sbi->nr_mlog;
+		case MLOG_PER_CELL:
+#ifdef FILE_CELL
+			return (__mlog_owner(page, sum, type) % sbi->node_count) %
+				   sbi->nr_mlog;
+#endif
+		case MLOG_PER_CPU:
+		case MLOG_ADAPTIVE:
+		default:
+			return raw_smp_processor_id() % sbi->nr_mlog;
+	}
+}
+
+/*
+ * Pick a log of @type and return it with its curseg_mutex held. A caller
+ * bound to a log (bound >= 0) always gets that one. Otherwise the
+ * adaptive policy starts from the per-cpu log and only moves to another
+ * log when that one is busy, falling back to waiting on its own log.
+ */
+static int __lock_mlog_curseg(struct f2fs_sb_info *sbi, struct page *page,
+							  struct f2fs_summary *sum, int type, int bound,
+							  struct curseg_info **curseg) {
+	int mlog = bound >= 0 ? bound : __select_mlog(sbi, page, sum, type);
+	int i, next;
+
+	if (bound < 0 && sbi->mlog_policy == MLOG_ADAPTIVE) {
+		for (i = 0; i < sbi->nr_mlog; i++) {
+			next = (mlog + i) % sbi->nr_mlog;
+			*curseg = CURSEG_I(sbi, type + next * NR_CURSEG_TYPE);
+			if (mutex_trylock(&(*curseg)->curseg_mutex))
+				return next;
+		}
+	}
+
+	*curseg = CURSEG_I(sbi, type + mlog * NR_CURSEG_TYPE);
+	mutex_lock(&(*curseg)->curseg_mutex);
+	return mlog;
+}
+#endif
+
+/*
+ * Returns the log the block was allocated from, so that the caller can
+ * submit the page through the write bio merger of that log. With MLOG a
+ * bound log >= 0 overrides mlog_policy; it is ignored otherwise.
+ */
+static int __allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
+								 block_t old_blkaddr, block_t *new_blkaddr,
+								 struct f2fs_summary *sum, int type, int bound) {
 	struct sit_info *sit_i = SIT_I(sbi);
 	struct curseg_info *curseg;
 	bool direct_io = (type == CURSEG_DIRECT_IO);
@@ -1323,22 +1885,35 @@ void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 	type = direct_io ? CURSEG_WARM_DATA : type;
 
 #ifdef MLOG
-	int mlog = atomic_inc_return(&sbi->next_mlog) % sbi->nr_mlog;
-	curseg = CURSEG_I(sbi, type + mlog * NR_CURSEG_TYPE);
+	int mlog = __lock_mlog_curseg(sbi, page, sum, type, bound, &curseg);
 #else
 	curseg = CURSEG_I(sbi, type);
+	mutex_lock(&curseg->curseg_mutex);
 #endif
 
-	mutex_lock(&curseg->curseg_mutex);
+#ifdef LOCKFREE_SIT
+	/*
+	 * SIT entries are updated lock-free, sentry_lock only serializes
+	 * segment allocation among logs below.
+	 */
+#else
 	mutex_lock(&sit_i->sentry_lock); // to protect SIT cache
+#endif
 
 	/* direct_io'ed data is aligned to the segment for better performance */
-	if (direct_io && curseg->next_blkoff)
+	if (direct_io && curseg->next_blkoff) {
+#ifdef LOCKFREE_SIT
+		mutex_lock(&sit_i->sentry_lock);
+#endif
 #ifdef MLOG
 		__allocate_new_segments(sbi, type, mlog);
 #else
 		__allocate_new_segments(sbi, type);
 #endif
+#ifdef LOCKFREE_SIT
+		mutex_unlock(&sit_i->sentry_lock);
+#endif
+	}
 
 	*new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg); // start addr + offset
 	/*
@@ -1356,11 +1931,25 @@ void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 
 	stat_inc_block_count(sbi, curseg);
 #ifdef MLOG
-	if (!__has_curseg_space(sbi, type, mlog))
+	if (!__has_curseg_space(sbi, type, mlog)) {
+#ifdef LOCKFREE_SIT
+		mutex_lock(&sit_i->sentry_lock);
 		sit_i->s_ops->allocate_segment(sbi, type, mlog, false);
+		mutex_unlock(&sit_i->sentry_lock);
+#else
+		sit_i->s_ops->allocate_segment(sbi, type, mlog, false);
+#endif
+	}
 #else
-	if (!__has_curseg_space(sbi, type))
+	if (!__has_curseg_space(sbi, type)) {
+#ifdef LOCKFREE_SIT
+		mutex_lock(&sit_i->sentry_lock);
 		sit_i->s_ops->allocate_segment(sbi, type, false);
+		mutex_unlock(&sit_i->sentry_lock);
+#else
+		sit_i->s_ops->allocate_segment(sbi, type, false);
+#endif
+	}
 #endif
 	/*
 	 * SIT information should be updated before segment allocation,
@@ -1368,12 +1957,119 @@ void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 	 */
 	refresh_sit_entry(sbi, old_blkaddr, *new_blkaddr);
 
+#ifndef LOCKFREE_SIT
 	mutex_unlock(&sit_i->sentry_lock);
+#endif
 
 	if (page && IS_NODESEG(type))
-		fill_node_footer_blkaddr(page, NEXT_FREE_BLKADDR(sbi, curseg));
+		fill_node_footer_blkaddr(sbi, page, NEXT_FREE_BLKADDR(sbi, curseg));
 
 	mutex_unlock(&curseg->curseg_mutex);
+#ifdef MLOG
+	return mlog;
+#else
+	return 0;
+#endif
+}
+
+int allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
+						block_t old_blkaddr, block_t *new_blkaddr,
+						struct f2fs_summary *sum, int type) {
+	return __allocate_data_block(sbi, page, old_blkaddr, new_blkaddr, sum,
+								 type, -1);
+}
+
+/*
+ * Allocate up to nr consecutive blocks of a data log for the dnode slots
+ * described by sum, sum->ofs_in_node and on. The blocks must not have an
+ * on-disk address yet. The run is taken under one curseg_mutex hold and
+ * accounted in SIT at once; it stops at the end of the current segment,
+ * and an SSR log hands out one block at a time. Returns the # of blocks
+ * allocated from *new_blkaddr.
+ */
+int allocate_data_blocks(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
+						 unsigned int nr, block_t *new_blkaddr, int type) {
+	struct sit_info *sit_i = SIT_I(sbi);
+	struct curseg_info *curseg;
+	bool direct_io = (type == CURSEG_DIRECT_IO);
+	struct f2fs_summary run_sum = *sum;
+	unsigned int ofs_in_node = le16_to_cpu(sum->ofs_in_node);
+	unsigned int i;
+
+	type = direct_io ? CURSEG_WARM_DATA : type;
+
+#ifdef MLOG
+	int mlog = __lock_mlog_curseg(sbi, NULL, sum, type, -1, &curseg);
+#else
+	curseg = CURSEG_I(sbi, type);
+	mutex_lock(&curseg->curseg_mutex);
+#endif
+
+#ifndef LOCKFREE_SIT
+	mutex_lock(&sit_i->sentry_lock);
+#endif
+
+	if (direct_io && curseg->next_blkoff) {
+#ifdef LOCKFREE_SIT
+		mutex_lock(&sit_i->sentry_lock);
+#endif
+#ifdef MLOG
+		__allocate_new_segments(sbi, type, mlog);
+#else
+		__allocate_new_segments(sbi, type);
+#endif
+#ifdef LOCKFREE_SIT
+		mutex_unlock(&sit_i->sentry_lock);
+#endif
+	}
+
+	if (curseg->alloc_type == SSR)
+		nr = 1;
+	else
+		nr = min(nr, sbi->blocks_per_seg - curseg->next_blkoff);
+
+	*new_blkaddr = NEXT_FREE_BLKADDR(sbi, curseg);
+	for (i = 0; i < nr; i++) {
+		run_sum.ofs_in_node = cpu_to_le16(ofs_in_node + i);
+#ifdef MLOG
+		__add_sum_entry(sbi, type, mlog, &run_sum);
+#else
+		__add_sum_entry(sbi, type, &run_sum);
+#endif
+		__refresh_next_blkoff(sbi, curseg);
+		stat_inc_block_count(sbi, curseg);
+	}
+
+#ifdef MLOG
+	if (!__has_curseg_space(sbi, type, mlog)) {
+#ifdef LOCKFREE_SIT
+		mutex_lock(&sit_i->sentry_lock);
+		sit_i->s_ops->allocate_segment(sbi, type, mlog, false);
+		mutex_unlock(&sit_i->sentry_lock);
+#else
+		sit_i->s_ops->allocate_segment(sbi, type, mlog, false);
+#endif
+	}
+#else
+	if (!__has_curseg_space(sbi, type)) {
+#ifdef LOCKFREE_SIT
+		mutex_lock(&sit_i->sentry_lock);
+		sit_i->s_ops->allocate_segment(sbi, type, false);
+		mutex_unlock(&sit_i->sentry_lock);
+#else
+		sit_i->s_ops->allocate_segment(sbi, type, false);
+#endif
+	}
+#endif
+
+	update_sit_entry_run(sbi, *new_blkaddr, nr);
+	locate_dirty_segment(sbi, GET_SEGNO(sbi, *new_blkaddr));
+
+#ifndef LOCKFREE_SIT
+	mutex_unlock(&sit_i->sentry_lock);
+#endif
+	mutex_unlock(&curseg->curseg_mutex);
+	return nr;
 }
 
 /*
@@ -1382,8 +2078,15 @@ void allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 static void do_write_page(struct f2fs_summary *sum, struct f2fs_io_info *fio) {
 	int type = __get_segment_type(fio->page, fio->type); // hot, warm or cold data
 
+#ifdef MLOG
+	/* pages written back under a writeback context stay in its log */
+	fio->mlog = __allocate_data_block(fio->sbi, fio->page, fio->blk_addr,
+									  &fio->blk_addr, sum, type,
+									  fio->wb_ctx ? fio->wb_ctx->mlog : -1);
+#else
 	allocate_data_block(fio->sbi, fio->page, fio->blk_addr,
 						&fio->blk_addr, sum, type);
+#endif
 	/* writeout dirty page into bdev */
 	f2fs_submit_page_mbio(fio);
 
@@ -1443,6 +2146,9 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 	struct seg_entry *se;
 	int type;
 	unsigned short old_blkoff;
+#ifdef MLOG
+	int mlog;
+#endif
 
 	segno = GET_SEGNO(sbi, new_blkaddr);
 	se = get_seg_entry(sbi, segno);
@@ -1450,7 +2156,7 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 
 	if (!recover_curseg) {
 		/* for recovery flow */
-		if (se->valid_blocks == 0 && !IS_CURSEG(sbi, segno)) {
+		if (get_valid_blocks(sbi, segno, 0) == 0 && !IS_CURSEG(sbi, segno)) {
 			if (old_blkaddr == NULL_ADDR)
 				type = CURSEG_COLD_DATA;
 			else
@@ -1461,7 +2167,22 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 			type = CURSEG_WARM_DATA;
 	}
 
-	curseg = CURSEG_I(sbi, type); // todo: modified for max 
+#ifdef MLOG
+	/*
+	 * A segment already current in some log is replaced through that log.
+	 * Parallel recovery workers must not move two logs onto one segment,
+	 * since each would write back the SSA block with only its own entries.
+	 */
+	mutex_lock(&sbi->replace_mutex);
+	for (mlog = 0; mlog < sbi->nr_mlog; mlog++)
+		if (CURSEG_I(sbi, type + mlog * NR_CURSEG_TYPE)->segno == segno)
+			break;
+	if (mlog == sbi->nr_mlog)
+		mlog = __select_mlog(sbi, NULL, sum, type);
+	curseg = CURSEG_I(sbi, type + mlog * NR_CURSEG_TYPE);
+#else
+	curseg = CURSEG_I(sbi, type);
+#endif
 
 	mutex_lock(&curseg->curseg_mutex);
 	mutex_lock(&sit_i->sentry_lock);
@@ -1473,7 +2194,7 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 	if (segno != curseg->segno) {
 		curseg->next_segno = segno;
 #ifdef MLOG
-		change_curseg(sbi, type, 0, true);
+		change_curseg(sbi, type, mlog, true);
 #else
 		change_curseg(sbi, type, true);
 #endif
@@ -1481,7 +2202,7 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 
 	curseg->next_blkoff = GET_BLKOFF_FROM_SEG0(sbi, new_blkaddr);
 #ifdef MLOG
-	__add_sum_entry(sbi, type, 0, sum);
+	__add_sum_entry(sbi, type, mlog, sum);
 #else
 	__add_sum_entry(sbi, type, sum);
 #endif
@@ -1493,7 +2214,7 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 		if (old_cursegno != curseg->segno) {
 			curseg->next_segno = old_cursegno;
 #ifdef MLOG
-			change_curseg(sbi, type, 0, true);
+			change_curseg(sbi, type, mlog, true);
 #else
 			change_curseg(sbi, type, true);
 #endif
@@ -1503,6 +2224,9 @@ static void __f2fs_replace_block(struct f2fs_sb_info *sbi,
 
 	mutex_unlock(&sit_i->sentry_lock);
 	mutex_unlock(&curseg->curseg_mutex);
+#ifdef MLOG
+	mutex_unlock(&sbi->replace_mutex);
+#endif
 }
 
 void f2fs_replace_block(struct f2fs_sb_info *sbi, struct dnode_of_data *dn,
@@ -1519,10 +2243,8 @@ void f2fs_replace_block(struct f2fs_sb_info *sbi, struct dnode_of_data *dn,
 	f2fs_update_extent_cache(dn);
 }
 
-static inline bool is_merged_page(struct f2fs_sb_info *sbi,
-								  struct page *page, enum page_type type) {
-	enum page_type btype = PAGE_TYPE_OF_BIO(type);
-	struct f2fs_bio_info *io = &sbi->write_io[btype];
+static inline bool __is_merged_page(struct f2fs_bio_info *io,
+									struct page *page) {
 	struct bio_vec *bvec;
 	struct page *target;
 	int i;
@@ -1556,6 +2278,21 @@ static inline bool is_merged_page(struct f2fs_sb_info *sbi,
 	return false;
 }
 
+static inline bool is_merged_page(struct f2fs_sb_info *sbi,
+								  struct page *page, enum page_type type) {
+	enum page_type btype = PAGE_TYPE_OF_BIO(type);
+#ifdef MLOG
+	int i;
+
+	for (i = 0; i < NR_WRITE_IO(sbi, btype); i++)
+		if (__is_merged_page(WRITE_IO(sbi, btype, i), page))
+			return true;
+	return false;
+#else
+	return __is_merged_page(&sbi->write_io[btype], page);
+#endif
+}
+
 void f2fs_wait_on_page_writeback(struct page *page,
 								 enum page_type type) {
 	if (PageWriteback(page)) {
@@ -1960,33 +2697,6 @@ static struct page *get_current_sit_page(struct f2fs_sb_info *sbi,
 	return get_meta_page(sbi, current_sit_addr(sbi, segno));
 }
 
-static struct page *get_next_sit_page(struct f2fs_sb_info *sbi,
-									  unsigned int start) {
-	struct sit_info *sit_i = SIT_I(sbi);
-	struct page *src_page, *dst_page;
-	pgoff_t src_off, dst_off;
-	void *src_addr, *dst_addr;
-
-	src_off = current_sit_addr(sbi, start);
-	dst_off = next_sit_addr(sbi, src_off);
-
-	/* get current sit block page without lock */
-	src_page = get_meta_page(sbi, src_off);
-	dst_page = grab_meta_page(sbi, dst_off);
-	f2fs_bug_on(sbi, PageDirty(src_page));
-
-	src_addr = page_address(src_page);
-	dst_addr = page_address(dst_page);
-	memcpy(dst_addr, src_addr, PAGE_CACHE_SIZE);
-
-	set_page_dirty(dst_page);
-	f2fs_put_page(src_page, 1);
-
-	set_to_next_sit(sit_i, start);
-
-	return dst_page;
-}
-
 static struct sit_entry_set *grab_sit_entry_set(void) {
 	struct sit_entry_set *ses =
 			f2fs_kmem_cache_alloc(sit_entry_set_slab, GFP_ATOMIC);
@@ -2060,6 +2770,113 @@ static void remove_sits_in_journal(struct f2fs_sb_info *sbi) {
 	update_sits_in_cursum(sum, -sits_in_cursum(sum));
 }
 
+struct sit_flush_work {
+	struct work_struct work;
+	struct f2fs_sb_info *sbi;
+	unsigned int start_segno;
+	pgoff_t src_off;        /* current copy of the SIT block */
+	pgoff_t dst_off;        /* copy written by this checkpoint */
+};
+
+/*
+ * Fill the next copy of one SIT block. The checkpoint holds sentry_lock and
+ * leaves the dirty bitmap alone until every block has been filled.
+ */
+static void __flush_sit_block(struct f2fs_sb_info *sbi, unsigned int start_segno,
+							  pgoff_t src_off, pgoff_t dst_off) {
+	struct sit_info *sit_i = SIT_I(sbi);
+	unsigned int end = min(start_segno + SIT_ENTRY_PER_BLOCK,
+						   (unsigned long) MAIN_SEGS(sbi));
+	unsigned int segno = start_segno;
+	struct f2fs_sit_block *raw_sit;
+	struct page *page;
+
+	page = get_next_meta_page(sbi, src_off, dst_off);
+	raw_sit = page_address(page);
+
+	for_each_set_bit_from(segno, sit_i->dirty_sentries_bitmap, end)
+		seg_info_to_raw_sit(get_seg_entry(sbi, segno),
+							&raw_sit->entries[SIT_ENTRY_OFFSET(sit_i, segno)]);
+
+	f2fs_put_page(page, 1);
+}
+
+static void flush_sit_block_work(struct work_struct *work) {
+	struct sit_flush_work *sfw = container_of(work, struct sit_flush_work,
+											  work);
+
+	__flush_sit_block(sfw->sbi, sfw->start_segno, sfw->src_off, sfw->dst_off);
+}
+
+/*
+ * Every set left on the sit entry set list owns one SIT block. Discard
+ * candidates and the SIT version bitmap are handled here, the blocks
+ * themselves are read and filled by the meta flush workers.
+ */
+static void flush_sit_blocks(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
+	struct sit_info *sit_i = SIT_I(sbi);
+	unsigned long *bitmap = sit_i->dirty_sentries_bitmap;
+	struct list_head *head = &SM_I(sbi)->sit_entry_set;
+	struct workqueue_struct *wq = sbi->max_info->meta_flush_wq;
+	struct sit_flush_work *works;
+	struct sit_entry_set *ses, *tmp;
+	unsigned int nr = 0, i = 0;
+	unsigned int segno, end;
+	pgoff_t src_off, dst_off;
+
+	list_for_each_entry(ses, head, set_list)
+		nr++;
+	if (!nr)
+		return;
+
+	works = kcalloc(nr, sizeof(struct sit_flush_work), GFP_NOFS | __GFP_NOWARN);
+
+	list_for_each_entry(ses, head, set_list) {
+		segno = ses->start_segno;
+		end = min(segno + SIT_ENTRY_PER_BLOCK, (unsigned long) MAIN_SEGS(sbi));
+
+		/* has to see ckpt_valid_map before the block is filled */
+		if (cpc->reason != CP_DISCARD) {
+			for_each_set_bit_from(segno, bitmap, end) {
+				cpc->trim_start = segno;
+				add_discard_addrs(sbi, cpc);
+			}
+		}
+
+		src_off = current_sit_addr(sbi, ses->start_segno);
+		dst_off = next_sit_addr(sbi, src_off);
+		set_to_next_sit(sit_i, ses->start_segno);
+
+		if (!works) {
+			__flush_sit_block(sbi, ses->start_segno, src_off, dst_off);
+			continue;
+		}
+		INIT_WORK(&works[i].work, flush_sit_block_work);
+		works[i].sbi = sbi;
+		works[i].start_segno = ses->start_segno;
+		works[i].src_off = src_off;
+		works[i].dst_off = dst_off;
+		queue_work(wq, &works[i++].work);
+	}
+
+	if (works) {
+		flush_workqueue(wq);
+		kfree(works);
+	}
+
+	list_for_each_entry_safe(ses, tmp, head, set_list) {
+		segno = ses->start_segno;
+		end = min(segno + SIT_ENTRY_PER_BLOCK, (unsigned long) MAIN_SEGS(sbi));
+		for_each_set_bit_from(segno, bitmap, end) {
+			__clear_bit(segno, bitmap);
+			sit_i->dirty_sentries--;
+			ses->entry_cnt--;
+		}
+		f2fs_bug_on(sbi, ses->entry_cnt);
+		release_sit_entry_set(ses);
+	}
+}
+
 /*
  * CP calls this function, which flushes SIT entries including sit_journal,
  * and moves prefree segs to free segs.
@@ -2071,12 +2888,14 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	struct f2fs_summary_block *sum = curseg->sum_blk;
 	struct sit_entry_set *ses, *tmp;
 	struct list_head *head = &SM_I(sbi)->sit_entry_set;
-	bool to_journal = true;
 	struct seg_entry *se;
 
 	mutex_lock(&curseg->curseg_mutex);
 	mutex_lock(&sit_i->sentry_lock);
 
+#ifdef LOCKFREE_SIT
+	__merge_dirty_sentries(sbi);
+#endif
 	if (!sit_i->dirty_sentries)
 		goto out;
 
@@ -2097,28 +2916,21 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	/*
 	 * there are two steps to flush sit entries:
 	 * #1, flush sit entries to journal in current cold data summary block.
-	 * #2, flush sit entries to sit page.
+	 * #2, flush sit entries to sit pages, one work item per sit block.
 	 */
 	list_for_each_entry_safe(ses, tmp, head, set_list) {
-		struct page *page = NULL;
-		struct f2fs_sit_block *raw_sit = NULL;
 		unsigned int start_segno = ses->start_segno;
 		unsigned int end = min(start_segno + SIT_ENTRY_PER_BLOCK,
 							   (unsigned long) MAIN_SEGS(sbi));
 		unsigned int segno = start_segno;
 
-		if (to_journal &&
-			!__has_cursum_space(sum, ses->entry_cnt, SIT_JOURNAL))
-			to_journal = false;
-
-		if (!to_journal) {
-			page = get_next_sit_page(sbi, start_segno);
-			raw_sit = page_address(page);
-		}
+		/* sets are sorted by entry_cnt, so the rest won't fit either */
+		if (!__has_cursum_space(sum, ses->entry_cnt, SIT_JOURNAL))
+			break;
 
 		/* flush dirty sit entries in region of current sit set */
 		for_each_set_bit_from(segno, bitmap, end) {
-			int offset, sit_offset;
+			int offset;
 
 			se = get_seg_entry(sbi, segno);
 
@@ -2128,31 +2940,23 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 				add_discard_addrs(sbi, cpc);
 			}
 
-			if (to_journal) {
-				offset = lookup_journal_in_cursum(sum,
-												  SIT_JOURNAL, segno, 1);
-				f2fs_bug_on(sbi, offset < 0);
-				segno_in_journal(sum, offset) =
-								cpu_to_le32(segno);
-				seg_info_to_raw_sit(se,
-									&sit_in_journal(sum, offset));
-			} else {
-				sit_offset = SIT_ENTRY_OFFSET(sit_i, segno);
-				seg_info_to_raw_sit(se,
-									&raw_sit->entries[sit_offset]);
-			}
+			offset = lookup_journal_in_cursum(sum,
+											  SIT_JOURNAL, segno, 1);
+			f2fs_bug_on(sbi, offset < 0);
+			segno_in_journal(sum, offset) =
+							cpu_to_le32(segno);
+			seg_info_to_raw_sit(se,
+								&sit_in_journal(sum, offset));
 
 			__clear_bit(segno, bitmap);
 			sit_i->dirty_sentries--;
 			ses->entry_cnt--;
 		}
 
-		if (!to_journal)
-			f2fs_put_page(page, 1);
-
 		f2fs_bug_on(sbi, ses->entry_cnt);
 		release_sit_entry_set(ses);
 	}
+	flush_sit_blocks(sbi, cpc);
 
 	f2fs_bug_on(sbi, !list_empty(head));
 	f2fs_bug_on(sbi, sit_i->dirty_sentries);
@@ -2164,7 +2968,10 @@ void flush_sit_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc) {
 	mutex_unlock(&sit_i->sentry_lock);
 	mutex_unlock(&curseg->curseg_mutex);
 
-	set_prefree_as_free_segments(sbi);
+	if (cpc->epoch)
+		freeze_prefree_segments(sbi);
+	else
+		set_prefree_as_free_segments(sbi);
 }
 
 static int build_sit_info(struct f2fs_sb_info *sbi) {
@@ -2192,6 +2999,20 @@ static int build_sit_info(struct f2fs_sb_info *sbi) {
 	if (!sit_i->dirty_sentries_bitmap)
 		return -ENOMEM;
 
+#ifdef LOCKFREE_SIT
+	sit_i->dirty_sentries_pcpu = alloc_percpu(struct dirty_sentry_cache);
+	if (!sit_i->dirty_sentries_pcpu)
+		return -ENOMEM;
+	sit_i->dirty_sentries_spill = kzalloc(bitmap_size, GFP_KERNEL);
+	if (!sit_i->dirty_sentries_spill)
+		return -ENOMEM;
+	if (percpu_counter_init(&sit_i->written_valid_blocks,
+							le64_to_cpu(ckpt->valid_block_count), GFP_KERNEL))
+		return -ENOMEM;
+	if (percpu_counter_init(&sbi->discard_blks, 0, GFP_KERNEL))
+		return -ENOMEM;
+#endif
+
 	for (start = 0; start < MAIN_SEGS(sbi); start++) {
 		sit_i->sentries[start].cur_valid_map
 				= kzalloc(SIT_VBLOCK_MAP_SIZE, GFP_KERNEL);
@@ -2232,7 +3053,9 @@ static int build_sit_info(struct f2fs_sb_info *sbi) {
 
 	sit_i->sit_base_addr = le32_to_cpu(raw_super->sit_blkaddr);
 	sit_i->sit_blocks = sit_segs << sbi->log_blocks_per_seg;
+#ifndef LOCKFREE_SIT
 	sit_i->written_valid_blocks = le64_to_cpu(ckpt->valid_block_count);
+#endif
 	sit_i->sit_bitmap = dst_bitmap;
 	sit_i->bitmap_size = bitmap_size;
 	sit_i->dirty_sentries = 0;
@@ -2344,12 +3167,22 @@ static void build_sit_entries(struct f2fs_sb_info *sbi) {
 
 			/* build discard map only one time */
 			memcpy(se->discard_map, se->cur_valid_map, SIT_VBLOCK_MAP_SIZE);
+#ifdef LOCKFREE_SIT
+			percpu_counter_add(&sbi->discard_blks, sbi->blocks_per_seg -
+											get_valid_blocks(sbi, start, 0));
+
+			if (sbi->segs_per_sec > 1) {
+				struct sec_entry *e = get_sec_entry(sbi, start);
+				atomic_add(get_valid_blocks(sbi, start, 0), &e->valid_blocks);
+			}
+#else
 			sbi->discard_blks += sbi->blocks_per_seg - se->valid_blocks;
 
 			if (sbi->segs_per_sec > 1) {
 				struct sec_entry *e = get_sec_entry(sbi, start);
 				e->valid_blocks += se->valid_blocks;
 			}
+#endif
 		}
 		start_blk += readed;
 	} while (start_blk < sit_blk_cnt);
@@ -2361,8 +3194,7 @@ static void init_free_segmap(struct f2fs_sb_info *sbi) {
 	int type, i;
 
 	for (start = 0; start < MAIN_SEGS(sbi); start++) {
-		struct seg_entry *sentry = get_seg_entry(sbi, start);
-		if (!sentry->valid_blocks)
+		if (!get_valid_blocks(sbi, start, 0))
 			__set_free(sbi, start);
 	}
 
@@ -2379,8 +3211,7 @@ static void init_free_segmap(struct f2fs_sb_info *sbi) {
 	int type;
 
 	for (start = 0; start < MAIN_SEGS(sbi); start++) {
-		struct seg_entry *sentry = get_seg_entry(sbi, start);
-		if (!sentry->valid_blocks)
+		if (!get_valid_blocks(sbi, start, 0))
 			__set_free(sbi, start);
 	}
 
@@ -2393,7 +3224,6 @@ static void init_free_segmap(struct f2fs_sb_info *sbi) {
 #endif
 
 static void init_dirty_segmap(struct f2fs_sb_info *sbi) {
-	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	struct free_segmap_info *free_i = FREE_I(sbi);
 	unsigned int segno = 0, offset = 0;
 	unsigned short valid_blocks;
@@ -2411,9 +3241,9 @@ static void init_dirty_segmap(struct f2fs_sb_info *sbi) {
 			f2fs_bug_on(sbi, 1);
 			continue;
 		}
-		mutex_lock(&dirty_i->seglist_lock);
+		lock_dirty_segment(sbi, segno);
 		__locate_dirty_segment(sbi, segno, DIRTY);
-		mutex_unlock(&dirty_i->seglist_lock);
+		unlock_dirty_segment(sbi, segno);
 	}
 }
 
@@ -2424,6 +3254,32 @@ static int init_victim_secmap(struct f2fs_sb_info *sbi) {
 	dirty_i->victim_secmap = kzalloc(bitmap_size, GFP_KERNEL);
 	if (!dirty_i->victim_secmap)
 		return -ENOMEM;
+	dirty_i->gc_busy_secmap = kzalloc(bitmap_size, GFP_KERNEL);
+	if (!dirty_i->gc_busy_secmap)
+		return -ENOMEM;
+	return 0;
+}
+
+static int init_gc_buckets(struct f2fs_sb_info *sbi) {
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	unsigned int bitmap_size = f2fs_bitmap_size(MAIN_SECS(sbi));
+	unsigned int secno;
+	int i;
+
+	for (i = 0; i < NR_GC_BUCKETS; i++) {
+		dirty_i->gc_buckets[i] = kzalloc(bitmap_size, GFP_KERNEL);
+		if (!dirty_i->gc_buckets[i])
+			return -ENOMEM;
+		atomic_set(&dirty_i->nr_gc_bucket[i], 0);
+	}
+
+	dirty_i->sec_gc_bucket = vmalloc(MAIN_SECS(sbi));
+	if (!dirty_i->sec_gc_bucket)
+		return -ENOMEM;
+	memset(dirty_i->sec_gc_bucket, NO_GC_BUCKET, MAIN_SECS(sbi));
+
+	for (secno = 0; secno < MAIN_SECS(sbi); secno++)
+		__update_gc_bucket(sbi, secno);
 	return 0;
 }
 
@@ -2438,6 +3294,10 @@ static int build_dirty_segmap(struct f2fs_sb_info *sbi) {
 
 	SM_I(sbi)->dirty_info = dirty_i;
 	mutex_init(&dirty_i->seglist_lock);
+#ifdef LOCKFREE_SIT
+	for (i = 0; i < NR_SEG_LOCKS; i++)
+		spin_lock_init(&dirty_i->seg_locks[i]);
+#endif
 
 	bitmap_size = f2fs_bitmap_size(MAIN_SEGS(sbi));
 
@@ -2446,9 +3306,14 @@ static int build_dirty_segmap(struct f2fs_sb_info *sbi) {
 		if (!dirty_i->dirty_segmap[i])
 			return -ENOMEM;
 	}
+	dirty_i->frozen_prefree_map = kzalloc(bitmap_size, GFP_KERNEL);
+	if (!dirty_i->frozen_prefree_map)
+		return -ENOMEM;
 
 	init_dirty_segmap(sbi);
-	return init_victim_secmap(sbi);
+	if (init_victim_secmap(sbi))
+		return -ENOMEM;
+	return init_gc_buckets(sbi);
 }
 
 /*
@@ -2545,13 +3410,27 @@ static void discard_dirty_segmap(struct f2fs_sb_info *sbi,
 
 	mutex_lock(&dirty_i->seglist_lock);
 	kfree(dirty_i->dirty_segmap[dirty_type]);
+#ifdef LOCKFREE_SIT
+	atomic_set(&dirty_i->nr_dirty[dirty_type], 0);
+#else
 	dirty_i->nr_dirty[dirty_type] = 0;
+#endif
 	mutex_unlock(&dirty_i->seglist_lock);
 }
 
 static void destroy_victim_secmap(struct f2fs_sb_info *sbi) {
 	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
 	kfree(dirty_i->victim_secmap);
+	kfree(dirty_i->gc_busy_secmap);
+}
+
+static void destroy_gc_buckets(struct f2fs_sb_info *sbi) {
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+	int i;
+
+	for (i = 0; i < NR_GC_BUCKETS; i++)
+		kfree(dirty_i->gc_buckets[i]);
+	vfree(dirty_i->sec_gc_bucket);
 }
 
 static void destroy_dirty_segmap(struct f2fs_sb_info *sbi) {
@@ -2566,6 +3445,8 @@ static void destroy_dirty_segmap(struct f2fs_sb_info *sbi) {
 		discard_dirty_segmap(sbi, i);
 
 	destroy_victim_secmap(sbi);
+	destroy_gc_buckets(sbi);
+	kfree(dirty_i->frozen_prefree_map);
 	SM_I(sbi)->dirty_info = NULL;
 	kfree(dirty_i);
 }
@@ -2611,6 +3492,12 @@ static void destroy_sit_info(struct f2fs_sb_info *sbi) {
 	vfree(sit_i->sentries);
 	vfree(sit_i->sec_entries);
 	kfree(sit_i->dirty_sentries_bitmap);
+#ifdef LOCKFREE_SIT
+	free_percpu(sit_i->dirty_sentries_pcpu);
+	kfree(sit_i->dirty_sentries_spill);
+	percpu_counter_destroy(&sit_i->written_valid_blocks);
+	percpu_counter_destroy(&sbi->discard_blks);
+#endif
 
 	SM_I(sbi)->sit_info = NULL;
 	kfree(sit_i->sit_bitmap);
@@ -169,13 +169,21 @@ struct victim_sel_policy {
 };
 
 struct seg_entry {
+#ifdef LOCKFREE_SIT
+	atomic_t valid_blocks;    /* # of valid blocks */
+#else
 	unsigned short valid_blocks;    /* # of valid blocks */
+#endif
 	unsigned char *cur_valid_map;    /* validity bitmap of blocks */
 	/*
 	 * # of valid blocks and the validity bitmap stored in the the last
 	 * checkpoint pack. This information is used by the SSR mode.
 	 */
+#ifdef LOCKFREE_SIT
+	atomic_t ckpt_valid_blocks;
+#else
 	unsigned short ckpt_valid_blocks;
+#endif
 	unsigned char *ckpt_valid_map;
 	unsigned char *discard_map;
 	unsigned char type;        /* segment type like CURSEG_XXX_TYPE */
@@ -183,7 +191,11 @@ struct seg_entry {
 };
 
 struct sec_entry {
+#ifdef LOCKFREE_SIT
+	atomic_t valid_blocks;    /* # of valid blocks in a section */
+#else
 	unsigned int valid_blocks;    /* # of valid blocks in a section */
+#endif
 };
 
 struct segment_allocation {
@@ -199,18 +211,36 @@ struct inmem_pages {
 	struct page *page;
 };
 
+#ifdef LOCKFREE_SIT
+/* recently dirtied sentries of one cpu, spilled to a shared bitmap when full */
+#define DIRTY_SENTRY_BATCH    32
+
+struct dirty_sentry_cache {
+	unsigned int nr;
+	unsigned int segnos[DIRTY_SENTRY_BATCH];
+};
+#endif
+
 struct sit_info {
 	const struct segment_allocation *s_ops;
 
 	block_t sit_base_addr;        /* start block address of SIT area */
 	block_t sit_blocks;        /* # of blocks used by SIT area */
+#ifdef LOCKFREE_SIT
+	struct percpu_counter written_valid_blocks;    /* # of valid blocks in main area */
+#else
 	block_t written_valid_blocks;    /* # of valid blocks in main area */
+#endif
 	char *sit_bitmap;        /* SIT bitmap pointer */
 	unsigned int bitmap_size;    /* SIT bitmap size */
 
 	unsigned long *tmp_map;            /* bitmap for temporal use */
 	unsigned long *dirty_sentries_bitmap;    /* bitmap for dirty sentries */
 	unsigned int dirty_sentries;        /* # of dirty sentries */
+#ifdef LOCKFREE_SIT
+	struct dirty_sentry_cache __percpu *dirty_sentries_pcpu;    /* per-cpu dirty sentries, merged at checkpoint */
+	unsigned long *dirty_sentries_spill;    /* dirty sentries overflowing the per-cpu caches */
+#endif
 	unsigned int sents_per_block;        /* # of SIT entries per block */
 	struct mutex sentry_lock;        /* to protect SIT cache */
 	struct seg_entry *sentries;        /* SIT segment-level cache */
@@ -245,12 +275,40 @@ enum dirty_type {
 	NR_DIRTY_TYPE
 };
 
+#ifdef LOCKFREE_SIT
+/*
+ * The dirty_segmap bits and nr_dirty of a segment only change under the
+ * lock hashed by its secno; seglist_lock no longer covers them.
+ */
+#define NR_SEG_LOCKS    256
+#define SEG_LOCK(dirty_i, secno) (&(dirty_i)->seg_locks[(secno) & (NR_SEG_LOCKS - 1)])
+#endif
+
+/*
+ * Sections holding valid and invalid blocks are indexed by their number of
+ * valid blocks, so that victim selection starts from the emptiest ones
+ * instead of scanning the whole dirty_segmap.
+ */
+#define NR_GC_BUCKETS    32
+#define NO_GC_BUCKET    0xff
+
 struct dirty_seglist_info {
 	const struct victim_selection *v_ops;    /* victim selction operation */
 	unsigned long *dirty_segmap[NR_DIRTY_TYPE];
 	struct mutex seglist_lock;        /* lock for segment bitmaps */
+#ifdef LOCKFREE_SIT
+	spinlock_t seg_locks[NR_SEG_LOCKS];    /* per-segment dirty state locks */
+	atomic_t nr_dirty[NR_DIRTY_TYPE];    /* # of dirty segments */
+#else
 	int nr_dirty[NR_DIRTY_TYPE];        /* # of dirty segments */
+#endif
 	unsigned long *victim_secmap;        /* background GC victims */
+	unsigned long *gc_busy_secmap;        /* sections being cleaned by any GC */
+	unsigned long *gc_buckets[NR_GC_BUCKETS];    /* sections per valid range */
+	atomic_t nr_gc_bucket[NR_GC_BUCKETS];    /* # of sections in a bucket */
+	unsigned char *sec_gc_bucket;        /* bucket of each section */
+	unsigned long *frozen_prefree_map;    /* prefree segments of epoch_cp */
+	unsigned int nr_frozen_prefree;        /* # of frozen prefree segments */
 };
 
 /* victim selection function for cleaning and SSR */
@@ -326,16 +384,64 @@ static inline unsigned int get_valid_blocks(struct f2fs_sb_info *sbi,
 	 * In order to get # of valid blocks in a section instantly from many
 	 * segments, f2fs manages two counting structures separately.
 	 */
+#ifdef LOCKFREE_SIT
+	if (section > 1)
+		return atomic_read(&get_sec_entry(sbi, segno)->valid_blocks);
+	else
+		return atomic_read(&get_seg_entry(sbi, segno)->valid_blocks);
+#else
 	if (section > 1)
 		return get_sec_entry(sbi, segno)->valid_blocks;
 	else
 		return get_seg_entry(sbi, segno)->valid_blocks;
+#endif
+}
+
+static inline unsigned int get_ckpt_valid_blocks(struct seg_entry *se) {
+#ifdef LOCKFREE_SIT
+	return atomic_read(&se->ckpt_valid_blocks);
+#else
+	return se->ckpt_valid_blocks;
+#endif
+}
+
+static inline unsigned int get_nr_dirty(struct dirty_seglist_info *dirty_i,
+										enum dirty_type type) {
+#ifdef LOCKFREE_SIT
+	return atomic_read(&dirty_i->nr_dirty[type]);
+#else
+	return dirty_i->nr_dirty[type];
+#endif
+}
+
+/* serializes changes to the dirty_segmap bits and nr_dirty of @segno */
+static inline void lock_dirty_segment(struct f2fs_sb_info *sbi,
+									  unsigned int segno) {
+#ifdef LOCKFREE_SIT
+	spin_lock(SEG_LOCK(DIRTY_I(sbi), GET_SECNO(sbi, segno)));
+#else
+	mutex_lock(&DIRTY_I(sbi)->seglist_lock);
+#endif
+}
+
+static inline void unlock_dirty_segment(struct f2fs_sb_info *sbi,
+										unsigned int segno) {
+#ifdef LOCKFREE_SIT
+	spin_unlock(SEG_LOCK(DIRTY_I(sbi), GET_SECNO(sbi, segno)));
+#else
+	mutex_unlock(&DIRTY_I(sbi)->seglist_lock);
+#endif
 }
 
 static inline void seg_info_from_raw_sit(struct seg_entry *se,
 										 struct f2fs_sit_entry *rs) {
+#ifdef LOCKFREE_SIT
+	atomic_set(&se->valid_blocks, GET_SIT_VBLOCKS(rs));
+	atomic_set(&se->ckpt_valid_blocks, GET_SIT_VBLOCKS(rs));
+#else
 	se->valid_blocks = GET_SIT_VBLOCKS(rs);
 	se->ckpt_valid_blocks = GET_SIT_VBLOCKS(rs);
+#endif
 	memcpy(se->cur_valid_map, rs->valid_map, SIT_VBLOCK_MAP_SIZE);
 	memcpy(se->ckpt_valid_map, rs->valid_map, SIT_VBLOCK_MAP_SIZE);
 	se->type = GET_SIT_TYPE(rs);
@@ -344,12 +450,21 @@ static inline void seg_info_from_raw_sit(struct seg_entry *se,
 
 static inline void seg_info_to_raw_sit(struct seg_entry *se,
 									   struct f2fs_sit_entry *rs) {
+#ifdef LOCKFREE_SIT
+	unsigned short valid_blocks = atomic_read(&se->valid_blocks);
+#else
+	unsigned short valid_blocks = se->valid_blocks;
+#endif
 	unsigned short raw_vblocks = (se->type << SIT_VBLOCKS_SHIFT) |
-								 se->valid_blocks;
+								 valid_blocks;
 	rs->vblocks = cpu_to_le16(raw_vblocks);
 	memcpy(rs->valid_map, se->cur_valid_map, SIT_VBLOCK_MAP_SIZE);
 	memcpy(se->ckpt_valid_map, rs->valid_map, SIT_VBLOCK_MAP_SIZE);
+#ifdef LOCKFREE_SIT
+	atomic_set(&se->ckpt_valid_blocks, valid_blocks);
+#else
 	se->ckpt_valid_blocks = se->valid_blocks;
+#endif
 	rs->mtime = cpu_to_le64(se->mtime);
 }
 
@@ -432,7 +547,11 @@ static inline void get_sit_bitmap(struct f2fs_sb_info *sbi,
 }
 
 static inline block_t written_block_count(struct f2fs_sb_info *sbi) {
+#ifdef LOCKFREE_SIT
+	return percpu_counter_sum_positive(&SIT_I(sbi)->written_valid_blocks);
+#else
 	return SIT_I(sbi)->written_valid_blocks;
+#endif
 }
 
 static inline unsigned int free_segments(struct f2fs_sb_info *sbi) {
@@ -448,16 +567,18 @@ static inline unsigned int free_sections(struct f2fs_sb_info *sbi) {
 }
 
 static inline unsigned int prefree_segments(struct f2fs_sb_info *sbi) {
-	return DIRTY_I(sbi)->nr_dirty[PRE];
+	return get_nr_dirty(DIRTY_I(sbi), PRE);
 }
 
 static inline unsigned int dirty_segments(struct f2fs_sb_info *sbi) {
-	return DIRTY_I(sbi)->nr_dirty[DIRTY_HOT_DATA] +
-		   DIRTY_I(sbi)->nr_dirty[DIRTY_WARM_DATA] +
-		   DIRTY_I(sbi)->nr_dirty[DIRTY_COLD_DATA] +
-		   DIRTY_I(sbi)->nr_dirty[DIRTY_HOT_NODE] +
-		   DIRTY_I(sbi)->nr_dirty[DIRTY_WARM_NODE] +
-		   DIRTY_I(sbi)->nr_dirty[DIRTY_COLD_NODE];
+	struct dirty_seglist_info *dirty_i = DIRTY_I(sbi);
+
+	return get_nr_dirty(dirty_i, DIRTY_HOT_DATA) +
+		   get_nr_dirty(dirty_i, DIRTY_WARM_DATA) +
+		   get_nr_dirty(dirty_i, DIRTY_COLD_DATA) +
+		   get_nr_dirty(dirty_i, DIRTY_HOT_NODE) +
+		   get_nr_dirty(dirty_i, DIRTY_WARM_NODE) +
+		   get_nr_dirty(dirty_i, DIRTY_COLD_NODE);
 }
 
 static inline int overprovision_segments(struct f2fs_sb_info *sbi) {
@@ -518,6 +639,10 @@ static inline int utilization(struct f2fs_sb_info *sbi) {
 #define DEF_MIN_IPU_UTIL    70
 #define DEF_MIN_FSYNC_BLOCKS    8
 
+/* bounds of the adaptive group commit window of a flush thread (usecs) */
+#define FLUSH_WINDOW_STEP    5
+#define MAX_FLUSH_WINDOW    50
+
 enum {
 	F2FS_IPU_FORCE,
 	F2FS_IPU_SSR,
@@ -681,6 +806,21 @@ static inline unsigned long long get_mtime(struct f2fs_sb_info *sbi) {
 		   sit_i->mounted_time;
 }
 
+#ifdef LOCKFREE_SIT
+/* racing SIT updates without sentry_lock may only move a time forward */
+static inline void advance_mtime(unsigned long long *time,
+								 unsigned long long mtime) {
+	unsigned long long old = READ_ONCE(*time), cur;
+
+	while (old < mtime) {
+		cur = cmpxchg64(time, old, mtime);
+		if (cur == old)
+			break;
+		old = cur;
+	}
+}
+#endif
+
 static inline void set_summary(struct f2fs_summary *sum, nid_t nid,
 							   unsigned int ofs_in_node, unsigned char version) {
 	sum->nid = cpu_to_le32(nid);
@@ -706,8 +846,18 @@ static inline block_t sum_blk_addr(struct f2fs_sb_info *sbi, int base, int type)
 		   - (base + 1) + type;
 }
 
+static inline unsigned char gc_bucket_of(struct f2fs_sb_info *sbi,
+										 unsigned int valid_blocks) {
+	unsigned int blocks_per_sec = sbi->blocks_per_seg * sbi->segs_per_sec;
+
+	if (!valid_blocks || valid_blocks >= blocks_per_sec)
+		return NO_GC_BUCKET;
+	return valid_blocks * NR_GC_BUCKETS / blocks_per_sec;
+}
+
 static inline bool sec_usage_check(struct f2fs_sb_info *sbi, unsigned int secno) {
-	if (IS_CURSEC(sbi, secno) || (sbi->cur_victim_sec == secno))
+	if (IS_CURSEC(sbi, secno) ||
+		test_bit(secno, DIRTY_I(sbi)->gc_busy_secmap))
 		return true;
 	return false;
 }
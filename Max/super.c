@@ -62,6 +62,11 @@ enum {
 	Opt_noinline_data,
 	Opt_nr_IMDS,
 	Opt_nr_mlog,
+	Opt_mlog_policy,
+	Opt_epoch_cp,
+	Opt_dir_index,
+	Opt_bmap_cache,
+	Opt_gc_workers,
 	Opt_err,
 };
 
@@ -87,9 +92,24 @@ static match_table_t f2fs_tokens = {
 		{Opt_noinline_data,        "noinline_data"},
 		{Opt_nr_IMDS,              "imds=%u"},
 		{Opt_nr_mlog,              "mlog=%u"},
+		{Opt_mlog_policy,          "mlog_policy=%s"},
+		{Opt_epoch_cp,             "epoch_cp"},
+		{Opt_dir_index,            "dir_index"},
+		{Opt_bmap_cache,           "bmap_cache"},
+		{Opt_gc_workers,           "gc_workers=%u"},
 		{Opt_err, NULL},
 };
 
+#ifdef MLOG
+static const char *mlog_policy_names[MLOG_POLICY_MAX] = {
+		[MLOG_ROUND_ROBIN] = "round_robin",
+		[MLOG_PER_CPU]     = "per_cpu",
+		[MLOG_INODE_HASH]  = "inode_hash",
+		[MLOG_PER_CELL]    = "per_cell",
+		[MLOG_ADAPTIVE]    = "adaptive",
+};
+#endif
+
 /* Sysfs support for f2fs */
 enum {
 	GC_THREAD,    /* struct f2fs_gc_thread */
@@ -157,6 +177,24 @@ static ssize_t f2fs_sbi_store(struct f2fs_attr *a,
 	return count;
 }
 
+#ifdef MLOG
+static ssize_t f2fs_mlog_policy_store(struct f2fs_attr *a,
+									  struct f2fs_sb_info *sbi,
+									  const char *buf, size_t count) {
+	unsigned long t;
+	ssize_t ret;
+
+	ret = kstrtoul(skip_spaces(buf), 0, &t);
+	if (ret < 0)
+		return ret;
+	/* __select_mlog() only knows the defined policies */
+	if (t >= MLOG_POLICY_MAX)
+		return -EINVAL;
+	sbi->mlog_policy = t;
+	return count;
+}
+#endif
+
 static ssize_t f2fs_attr_show(struct kobject *kobj,
 							  struct attribute *attr, char *buf) {
 	struct f2fs_sb_info *sbi = container_of(kobj, struct f2fs_sb_info,
@@ -199,6 +237,11 @@ F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_min_sleep_time, min_sleep_time);
 F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_max_sleep_time, max_sleep_time);
 F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_no_gc_sleep_time, no_gc_sleep_time);
 F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_idle, gc_idle);
+F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_sched, gc_sched);
+F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_urgent_sleep_time, urgent_sleep_time);
+F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_busy_wb_pages, busy_wb_pages);
+F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_urgent_horizon, urgent_horizon);
+F2FS_RW_ATTR(GC_THREAD, f2fs_gc_kthread, gc_relaxed_horizon, relaxed_horizon);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, reclaim_segments, rec_prefree_segments);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, max_small_discards, max_discards);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, batched_trim_sections, trim_sections);
@@ -206,8 +249,16 @@ F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, ipu_policy, ipu_policy);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, min_ipu_util, min_ipu_util);
 F2FS_RW_ATTR(SM_INFO, f2fs_sm_info, min_fsync_blocks, min_fsync_blocks);
 F2FS_RW_ATTR(NM_INFO, f2fs_nm_info, ram_thresh, ram_thresh);
+#if defined(PER_CORE_NID_LIST) && defined(FILE_CELL)
+F2FS_RW_ATTR(NM_INFO, f2fs_nm_info, nid_policy, nid_policy);
+#endif
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, max_victim_search, max_victim_search);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, dir_level, dir_level);
+#ifdef MLOG
+F2FS_ATTR_OFFSET(F2FS_SBI, mlog_policy, 0644,
+				 f2fs_sbi_show, f2fs_mlog_policy_store,
+				 offsetof(struct f2fs_sb_info, mlog_policy));
+#endif
 
 #define ATTR_LIST(name) (&f2fs_attr_##name.attr)
 static struct attribute *f2fs_attrs[] = {
@@ -215,6 +266,11 @@ static struct attribute *f2fs_attrs[] = {
 		ATTR_LIST(gc_max_sleep_time),
 		ATTR_LIST(gc_no_gc_sleep_time),
 		ATTR_LIST(gc_idle),
+		ATTR_LIST(gc_sched),
+		ATTR_LIST(gc_urgent_sleep_time),
+		ATTR_LIST(gc_busy_wb_pages),
+		ATTR_LIST(gc_urgent_horizon),
+		ATTR_LIST(gc_relaxed_horizon),
 		ATTR_LIST(reclaim_segments),
 		ATTR_LIST(max_small_discards),
 		ATTR_LIST(batched_trim_sections),
@@ -224,6 +280,12 @@ static struct attribute *f2fs_attrs[] = {
 		ATTR_LIST(max_victim_search),
 		ATTR_LIST(dir_level),
 		ATTR_LIST(ram_thresh),
+#if defined(PER_CORE_NID_LIST) && defined(FILE_CELL)
+		ATTR_LIST(nid_policy),
+#endif
+#ifdef MLOG
+		ATTR_LIST(mlog_policy),
+#endif
 		NULL,
 };
 
@@ -267,7 +329,9 @@ static int parse_options(struct super_block *sb, char *options) {
 #endif
 #ifdef MLOG
 	sbi->nr_mlog = 1;
+	sbi->mlog_policy = MLOG_PER_CPU;
 #endif
+	sbi->nr_gc_workers = 0;
 
 	if (!options)
 		return 0;
@@ -391,6 +455,22 @@ static int parse_options(struct super_block *sb, char *options) {
 			case Opt_noinline_data:
 				clear_opt(sbi, INLINE_DATA);
 				break;
+			case Opt_epoch_cp:
+				set_opt(sbi, EPOCH_CP);
+				break;
+			case Opt_dir_index:
+				set_opt(sbi, DIR_INDEX);
+				break;
+			case Opt_bmap_cache:
+				set_opt(sbi, BMAP_CACHE);
+				break;
+			case Opt_gc_workers:
+				if (args->from && match_int(args, &arg))
+					return -EINVAL;
+				if (arg <= 0)
+					return -EINVAL;
+				sbi->nr_gc_workers = arg;
+				break;
 			case Opt_nr_mlog:
 				if (args->from && match_int(args, &arg))
 					return -EINVAL;
@@ -398,6 +478,21 @@ static int parse_options(struct super_block *sb, char *options) {
 					return -EINVAL;
 				sbi->nr_mlog = arg;
 				break;
+#ifdef MLOG
+			case Opt_mlog_policy:
+				name = match_strdup(&args[0]);
+
+				if (!name)
+					return -ENOMEM;
+				for (arg = 0; arg < MLOG_POLICY_MAX; arg++)
+					if (!strcmp(name, mlog_policy_names[arg]))
+						break;
+				kfree(name);
+				if (arg == MLOG_POLICY_MAX)
+					return -EINVAL;
+				sbi->mlog_policy = arg;
+				break;
+#endif
 			case Opt_nr_IMDS:
 				if (args->from && match_int(args, &arg))
 					return -EINVAL;
@@ -434,6 +529,12 @@ static struct inode *f2fs_alloc_inode(struct super_block *sb) {
 	INIT_RADIX_TREE(&fi->inmem_root, GFP_NOFS);
 	INIT_LIST_HEAD(&fi->inmem_pages);
 	mutex_init(&fi->inmem_lock);
+	fi->i_dindex = NULL;
+	spin_lock_init(&fi->dindex_lock);
+	fi->dindex_seq = 0;
+	fi->dindex_next_build = jiffies;
+	fi->i_bmap = NULL;
+	spin_lock_init(&fi->bmap_lock);
 
 	set_inode_flag(fi, FI_NEW_INODE);
 
@@ -516,6 +617,7 @@ static void f2fs_put_super(struct super_block *sb) {
 	kobject_del(&sbi->s_kobj);
 	f2fs_destroy_stats(sbi);
 	stop_gc_thread(sbi);
+	stop_free_nid_refill(sbi);
 	/*
 	 * We don't need to do checkpoint when superblock is clean.
 	 * But, the previous checkpoint was not done by umount, it needs to do
@@ -562,6 +664,9 @@ static void f2fs_put_super(struct super_block *sb) {
 	destroy_node_manager(sbi);
 	destroy_segment_manager(sbi);
 	destroy_max_kernel(sbi);
+#ifdef MLOG
+	destroy_mlog_write_io(sbi);
+#endif
 	kfree(sbi->ckpt);
 	kobject_put(&sbi->s_kobj);
 	wait_for_completion(&sbi->s_kobj_unregister);
@@ -579,9 +684,9 @@ int f2fs_sync_fs(struct super_block *sb, int sync) {
 	if (sync) {
 		struct cp_control cpc;
 		cpc.reason = __get_cp_reason(sbi);
-		mutex_lock(&sbi->gc_mutex);
+		down_write(&sbi->gc_rwsem);
 		write_checkpoint(sbi, &cpc);
-		mutex_unlock(&sbi->gc_mutex);
+		up_write(&sbi->gc_rwsem);
 	} else {
 		f2fs_balance_fs(sbi);
 	}
@@ -674,7 +779,19 @@ static int f2fs_show_options(struct seq_file *seq, struct dentry *root) {
 		seq_puts(seq, ",fastboot");
 	if (test_opt(sbi, EXTENT_CACHE))
 		seq_puts(seq, ",extent_cache");
+	if (test_opt(sbi, EPOCH_CP))
+		seq_puts(seq, ",epoch_cp");
+	if (test_opt(sbi, DIR_INDEX))
+		seq_puts(seq, ",dir_index");
+	if (test_opt(sbi, BMAP_CACHE))
+		seq_puts(seq, ",bmap_cache");
 	seq_printf(seq, ",active_logs=%u", sbi->active_logs);
+	seq_printf(seq, ",gc_workers=%u", sbi->nr_gc_workers);
+#ifdef MLOG
+	if (sbi->mlog_policy < MLOG_POLICY_MAX)
+		seq_printf(seq, ",mlog_policy=%s",
+				   mlog_policy_names[sbi->mlog_policy]);
+#endif
 
 	return 0;
 }
@@ -736,6 +853,11 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data) {
 	struct f2fs_sb_info *sbi = F2FS_SB(sb);
 	struct f2fs_mount_info org_mount_opt;
 	int err, active_logs;
+#ifdef MLOG
+	unsigned int nr_mlog = sbi->nr_mlog;
+	unsigned int mlog_policy = sbi->mlog_policy;
+#endif
+	unsigned int nr_gc_workers = sbi->nr_gc_workers;
 	bool need_restart_gc = false;
 	bool need_stop_gc = false;
 
@@ -753,6 +875,15 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data) {
 
 	/* parse mount options */
 	err = parse_options(sb, data);
+#ifdef MLOG
+	/* cursegs and write bio mergers are sized by nr_mlog at mount time */
+	sbi->nr_mlog = nr_mlog;
+#endif
+	/* so is the GC worker array */
+	sbi->nr_gc_workers = nr_gc_workers;
+	/* indexes are kept up to date only while dir_index is set */
+	sbi->mount_opt.opt &= ~F2FS_MOUNT_DIR_INDEX;
+	sbi->mount_opt.opt |= org_mount_opt.opt & F2FS_MOUNT_DIR_INDEX;
 	if (err)
 		goto restore_opts;
 
@@ -808,6 +939,9 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data) {
 	restore_opts:
 	sbi->mount_opt = org_mount_opt;
 	sbi->active_logs = active_logs;
+#ifdef MLOG
+	sbi->mlog_policy = mlog_policy;
+#endif
 	return err;
 }
 
@@ -978,7 +1112,6 @@ static void init_sb_info(struct f2fs_sb_info *sbi) {
 	sbi->root_ino_num = le32_to_cpu(raw_super->root_ino);
 	sbi->node_ino_num = le32_to_cpu(raw_super->node_ino);
 	sbi->meta_ino_num = le32_to_cpu(raw_super->meta_ino);
-	sbi->cur_victim_sec = NULL_SECNO;
 	sbi->max_victim_search = DEF_MAX_VICTIM_SEARCH;
 
 	for (i = 0; i < NR_COUNT_TYPE; i++)
@@ -1154,8 +1287,18 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent) {
 	sbi->sb = sb;
 	sbi->raw_super = raw_super;
 	sbi->raw_super_buf = raw_super_buf;
-	mutex_init(&sbi->gc_mutex);
+	init_rwsem(&sbi->gc_rwsem);
+	atomic_set(&sbi->nr_fg_gc, 0);
+	init_waitqueue_head(&sbi->fg_gc_wait);
+	atomic_set(&sbi->nr_fg_collectors, 0);
+	mutex_init(&sbi->fg_gc_cp_mutex);
+	atomic_set(&sbi->fg_gc_cp_seq, 0);
+	atomic_set(&sbi->node_seq, 0);
+#ifndef MLOG
 	mutex_init(&sbi->writepages);
+#else
+	mutex_init(&sbi->replace_mutex);
+#endif
 	mutex_init(&sbi->cp_mutex);
 	init_rwsem(&sbi->node_write);
 	clear_sbi_flag(sbi, SBI_POR_DOING);
@@ -1169,9 +1312,9 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent) {
 		sbi->write_io[i].bio = NULL;
 	}
 
-	if (init_max_kernel(sbi) < 0) {
+	err = init_max_kernel(sbi);
+	if (err < 0)
 		goto free_options;
-	}
 
 	init_rwsem(&sbi->cp_rwsem);
 	init_waitqueue_head(&sbi->cp_wait);
@@ -1201,6 +1344,16 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent) {
 #ifdef MLOG
 	if (sbi->nr_mlog > le32_to_cpu(sbi->ckpt->nr_mlog)) 
 		sbi->nr_mlog = le32_to_cpu(sbi->ckpt->nr_mlog);
+	err = init_mlog_write_io(sbi);
+	if (err)
+		goto free_cp;
+#endif
+	if (!sbi->nr_gc_workers)
+#ifdef MLOG
+		sbi->nr_gc_workers = max_t(unsigned int, 1,
+								   sbi->nr_mlog / DEF_MLOGS_PER_GC_WORKER);
+#else
+		sbi->nr_gc_workers = 1;
 #endif
 
 	sbi->total_valid_node_count =
@@ -1226,6 +1379,13 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent) {
 
 	INIT_LIST_HEAD(&sbi->dir_inode_list);
 	spin_lock_init(&sbi->dir_inode_lock);
+	INIT_LIST_HEAD(&sbi->dindex_list);
+	spin_lock_init(&sbi->dindex_list_lock);
+	atomic_set(&sbi->total_dindex_entries, 0);
+	atomic_long_set(&sbi->total_dindex_mem, 0);
+	INIT_LIST_HEAD(&sbi->bmap_list);
+	spin_lock_init(&sbi->bmap_list_lock);
+	atomic_set(&sbi->total_bmap_entries, 0);
 
 	init_extent_cache_info(sbi);
 
@@ -1379,11 +1539,15 @@ static int f2fs_fill_super(struct super_block *sb, void *data, int silent) {
 	free_sm:
 	destroy_segment_manager(sbi);
 	free_cp:
+#ifdef MLOG
+	destroy_mlog_write_io(sbi);
+#endif
 	kfree(sbi->ckpt);
 	free_meta_inode:
 	make_bad_inode(sbi->meta_inode);
 	iput(sbi->meta_inode);
 	free_options:
+	destroy_max_kernel(sbi);
 	kfree(options);
 	free_sb_buf:
 	brelse(raw_super_buf);
@@ -1456,10 +1620,13 @@ static int __init init_f2fs_fs(void) {
 	err = create_extent_cache();
 	if (err)
 		goto free_checkpoint_caches;
+	err = create_dir_index_cache();
+	if (err)
+		goto free_extent_cache;
 	f2fs_kset = kset_create_and_add("max", NULL, fs_kobj);
 	if (!f2fs_kset) {
 		err = -ENOMEM;
-		goto free_extent_cache;
+		goto free_dir_index_cache;
 	}
 	err = f2fs_init_crypto();
 	if (err)
@@ -1475,6 +1642,8 @@ static int __init init_f2fs_fs(void) {
 	f2fs_exit_crypto();
 	free_kset:
 	kset_unregister(f2fs_kset);
+	free_dir_index_cache:
+	destroy_dir_index_cache();
 	free_extent_cache:
 	destroy_extent_cache();
 	free_checkpoint_caches:
@@ -1494,6 +1663,7 @@ static void __exit exit_f2fs_fs(void) {
 	f2fs_destroy_root_stats();
 	unregister_filesystem(&f2fs_fs_type);
 	f2fs_exit_crypto();
+	destroy_dir_index_cache();
 	destroy_extent_cache();
 	destroy_checkpoint_caches();
 	destroy_segment_manager_caches();
@@ -0,0 +1,237 @@
+#ifndef _KSHIM_H
+#define _KSHIM_H
+
+/*
+ * Userspace stand-ins for the kernel primitives Max/rps.c uses, so the
+ * benchmark compiles rps.c itself rather than a copy of it. The
+ * include/linux/ headers next to this file resolve here, except errno.h,
+ * which glibc includes as well and which goes on to the system header.
+ *
+ * - a "CPU" is a benchmark thread; kshim_set_cpu() binds the calling
+ *   thread to a CPU id and NUMA node, and per-CPU data is one cache line
+ *   per id;
+ * - preempt_disable() raises a per-CPU "in critical section" flag, and
+ *   synchronize_sched_expedited() waits for every raised flag to drop,
+ *   with membarrier() (or full fences on readers if membarrier is
+ *   missing) ordering the flag against the writer's stores;
+ * - call_rcu_sched() queues the callback for a grace-period thread;
+ * - rw_semaphore is a pthread_rwlock, spinlock_t a pthread mutex and
+ *   wait_queue_head_t a mutex/condvar pair;
+ * - lockdep annotations compile away, as with !CONFIG_DEBUG_LOCK_ALLOC.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NR_CPUS             512
+#define MAX_NUMNODES        64
+#define SMP_CACHE_BYTES     64
+#define BITS_PER_LONG       (8 * sizeof(long))
+
+#define likely(x)           __builtin_expect(!!(x), 1)
+#define unlikely(x)         __builtin_expect(!!(x), 0)
+#define barrier()           __asm__ __volatile__("" ::: "memory")
+
+#define ____cacheline_aligned_in_smp    __attribute__((aligned(SMP_CACHE_BYTES)))
+#define __percpu
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
+
+#define READ_ONCE(x)        __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, val)  __atomic_store_n(&(x), (val), __ATOMIC_RELAXED)
+
+#define _RET_IP_            ((unsigned long) __builtin_return_address(0))
+
+/* set up by kshim_init() and kshim_set_cpu() */
+extern int nr_cpu_ids;
+extern int nr_node_ids;
+extern int kshim_use_fences;
+extern __thread int kshim_cpu;
+extern __thread int kshim_node;
+
+struct kshim_cpu_state {
+	int in_cs;                     /* inside preempt_disable() */
+} ____cacheline_aligned_in_smp;
+
+extern struct kshim_cpu_state kshim_cpu_state[NR_CPUS];
+
+/* nr_cpus thread slots spread over nr_nodes NUMA nodes */
+void kshim_init(int nr_cpus, int nr_nodes);
+
+void kshim_set_cpu(int cpu, int node);
+
+/* sched */
+#define smp_processor_id()  (kshim_cpu)
+#define numa_node_id()      (kshim_node)
+
+static inline void preempt_disable(void) {
+	__atomic_store_n(&kshim_cpu_state[kshim_cpu].in_cs, 1, __ATOMIC_RELAXED);
+	if (kshim_use_fences)
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	else
+		barrier();
+}
+
+static inline void preempt_enable(void) {
+	__atomic_store_n(&kshim_cpu_state[kshim_cpu].in_cs, 0, __ATOMIC_RELEASE);
+}
+
+/* nodemask, topology */
+#define N_MEMORY            0
+#define NUMA_NO_NODE        (-1)
+#define node_state(node, state)    1
+#define for_each_node(node) \
+	for ((node) = 0; (node) < nr_node_ids; (node)++)
+
+/* slab */
+typedef unsigned int gfp_t;
+#define GFP_KERNEL          0
+
+static inline void *kzalloc_node(size_t size, gfp_t flags, int node) {
+	size_t len = (size + SMP_CACHE_BYTES - 1) & ~(size_t) (SMP_CACHE_BYTES - 1);
+	void *p = aligned_alloc(SMP_CACHE_BYTES, len);
+
+	if (p)
+		memset(p, 0, len);
+	return p;
+}
+
+#define kcalloc(n, size, flags)    calloc(n, size)
+#define kfree(p)                   free(p)
+
+/* percpu: one cache line per CPU id */
+void *kshim_alloc_percpu(size_t size);
+
+#define alloc_percpu(type)  ((typeof(type) __percpu *) kshim_alloc_percpu(sizeof(type)))
+#define free_percpu(p)      free(p)
+#define per_cpu_ptr(ptr, cpu) \
+	((typeof(ptr)) ((char *) (ptr) + (size_t) (cpu) * SMP_CACHE_BYTES))
+#define per_cpu(var, cpu)   (*per_cpu_ptr(&(var), cpu))
+#define this_cpu_add(var, val)                                                \
+do {                                                                          \
+	typeof(&(var)) __p = per_cpu_ptr(&(var), smp_processor_id());         \
+	__atomic_store_n(__p, *__p + (val), __ATOMIC_RELAXED);                \
+} while (0)
+
+/* cpumask */
+struct cpumask {
+	unsigned long bits[NR_CPUS / (8 * sizeof(long))];
+};
+
+typedef struct cpumask *cpumask_var_t;
+
+static inline bool zalloc_cpumask_var_node(cpumask_var_t *mask, gfp_t flags,
+										   int node) {
+	*mask = calloc(1, sizeof(struct cpumask));
+	return *mask != NULL;
+}
+
+#define free_cpumask_var(mask)     free(mask)
+
+static inline bool cpumask_test_cpu(int cpu, const struct cpumask *mask) {
+	return (__atomic_load_n(&mask->bits[cpu / BITS_PER_LONG], __ATOMIC_RELAXED)
+			>> (cpu % BITS_PER_LONG)) & 1;
+}
+
+static inline void cpumask_set_cpu(int cpu, struct cpumask *mask) {
+	__atomic_fetch_or(&mask->bits[cpu / BITS_PER_LONG],
+					  1UL << (cpu % BITS_PER_LONG), __ATOMIC_RELAXED);
+}
+
+static inline int cpumask_next(int cpu, const struct cpumask *mask) {
+	for (cpu++; cpu < nr_cpu_ids; cpu++)
+		if (cpumask_test_cpu(cpu, mask))
+			break;
+	return cpu;
+}
+
+#define for_each_cpu(cpu, mask)                                               \
+	for ((cpu) = cpumask_next(-1, (mask)); (cpu) < nr_cpu_ids;            \
+		 (cpu) = cpumask_next((cpu), (mask)))
+
+/* atomic */
+typedef struct {
+	int counter;
+} atomic_t;
+
+#define atomic_read(v)      __atomic_load_n(&(v)->counter, __ATOMIC_SEQ_CST)
+#define atomic_set(v, i)    __atomic_store_n(&(v)->counter, (i), __ATOMIC_SEQ_CST)
+#define atomic_add(i, v)    ((void) __atomic_add_fetch(&(v)->counter, (i), __ATOMIC_SEQ_CST))
+#define atomic_inc(v)       atomic_add(1, v)
+#define atomic_dec_and_test(v)    (__atomic_sub_fetch(&(v)->counter, 1, __ATOMIC_SEQ_CST) == 0)
+
+/* spinlock */
+typedef pthread_mutex_t spinlock_t;
+
+#define spin_lock_init(l)   pthread_mutex_init(l, NULL)
+#define spin_lock(l)        pthread_mutex_lock(l)
+#define spin_unlock(l)      pthread_mutex_unlock(l)
+#define spin_lock_bh(l)     pthread_mutex_lock(l)
+#define spin_unlock_bh(l)   pthread_mutex_unlock(l)
+
+/* lockdep */
+struct lock_class_key {
+	char dummy;
+};
+
+#define rwsem_acquire(l, s, t, i)         do { } while (0)
+#define rwsem_acquire_read(l, s, t, i)    do { } while (0)
+#define rwsem_release(l, n, i)            do { } while (0)
+
+/* rwsem */
+struct rw_semaphore {
+	pthread_rwlock_t lock;
+};
+
+#define __init_rwsem(sem, name, key)    pthread_rwlock_init(&(sem)->lock, NULL)
+#define down_read_nested(sem, sub)      pthread_rwlock_rdlock(&(sem)->lock)
+#define down_read_trylock(sem)          (pthread_rwlock_tryrdlock(&(sem)->lock) == 0)
+#define up_read(sem)                    pthread_rwlock_unlock(&(sem)->lock)
+#define down_write(sem)                 pthread_rwlock_wrlock(&(sem)->lock)
+#define up_write(sem)                   pthread_rwlock_unlock(&(sem)->lock)
+
+/* wait */
+typedef struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *q) {
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->cond, NULL);
+}
+
+static inline void wake_up_all(wait_queue_head_t *q) {
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_broadcast(&q->cond);
+	pthread_mutex_unlock(&q->lock);
+}
+
+#define wait_event(wq, condition)                                             \
+do {                                                                          \
+	pthread_mutex_lock(&(wq).lock);                                       \
+	while (!(condition))                                                  \
+		pthread_cond_wait(&(wq).cond, &(wq).lock);                    \
+	pthread_mutex_unlock(&(wq).lock);                                     \
+} while (0)
+
+/* rcupdate */
+struct rcu_head {
+	struct rcu_head *next;
+	void (*func)(struct rcu_head *);
+};
+
+typedef void (*rcu_callback_t)(struct rcu_head *);
+
+void synchronize_sched_expedited(void);
+
+void call_rcu_sched(struct rcu_head *, rcu_callback_t);
+
+void rcu_barrier_sched(void);
+
+#endif
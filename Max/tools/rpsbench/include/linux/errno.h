@@ -0,0 +1,2 @@
+/* the system one; glibc <errno.h> pulls it in too */
+#include_next <linux/errno.h>
@@ -0,0 +1,126 @@
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+
+#include "kshim.h"
+
+int nr_cpu_ids = 1;
+int nr_node_ids = 1;
+int kshim_use_fences;
+__thread int kshim_cpu;
+__thread int kshim_node;
+
+struct kshim_cpu_state kshim_cpu_state[NR_CPUS];
+
+/* call_rcu_sched() queue, drained by rcu_thread_fn() */
+static pthread_mutex_t rcu_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rcu_kick = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rcu_idle = PTHREAD_COND_INITIALIZER;
+static pthread_once_t rcu_once = PTHREAD_ONCE_INIT;
+static struct rcu_head *rcu_queue;
+static bool rcu_busy;
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause" ::: "memory");
+#else
+	barrier();
+#endif
+}
+
+static int membarrier(int cmd) {
+#ifdef __NR_membarrier
+	return syscall(__NR_membarrier, cmd, 0);
+#else
+	return -1;
+#endif
+}
+
+void kshim_init(int nr_cpus, int nr_nodes) {
+	nr_cpu_ids = nr_cpus < 1 ? 1 : (nr_cpus > NR_CPUS ? NR_CPUS : nr_cpus);
+	nr_node_ids = nr_nodes < 1 ? 1 :
+				  (nr_nodes > MAX_NUMNODES ? MAX_NUMNODES : nr_nodes);
+	kshim_use_fences = membarrier(MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED) != 0;
+}
+
+void kshim_set_cpu(int cpu, int node) {
+	kshim_cpu = cpu % nr_cpu_ids;
+	kshim_node = node % nr_node_ids;
+}
+
+void *kshim_alloc_percpu(size_t size) {
+	void *p;
+
+	if (size > SMP_CACHE_BYTES)
+		return NULL;
+	p = aligned_alloc(SMP_CACHE_BYTES, (size_t) NR_CPUS * SMP_CACHE_BYTES);
+	if (p)
+		memset(p, 0, (size_t) NR_CPUS * SMP_CACHE_BYTES);
+	return p;
+}
+
+static void heavy_fence(void) {
+	if (kshim_use_fences || membarrier(MEMBARRIER_CMD_PRIVATE_EXPEDITED))
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* wait out every preempt_disable() section in flight */
+void synchronize_sched_expedited(void) {
+	int cpu;
+
+	heavy_fence();
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		while (__atomic_load_n(&kshim_cpu_state[cpu].in_cs, __ATOMIC_ACQUIRE))
+			cpu_relax();
+	heavy_fence();
+}
+
+static void *rcu_thread_fn(void *arg) {
+	struct rcu_head *list, *next;
+
+	pthread_mutex_lock(&rcu_lock);
+	for (;;) {
+		while (!rcu_queue)
+			pthread_cond_wait(&rcu_kick, &rcu_lock);
+		list = rcu_queue;
+		rcu_queue = NULL;
+		rcu_busy = true;
+		pthread_mutex_unlock(&rcu_lock);
+
+		synchronize_sched_expedited();
+		for (; list; list = next) {
+			next = list->next;
+			list->func(list);
+		}
+
+		pthread_mutex_lock(&rcu_lock);
+		rcu_busy = false;
+		pthread_cond_broadcast(&rcu_idle);
+	}
+	return NULL;
+}
+
+static void rcu_start(void) {
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, rcu_thread_fn, NULL))
+		abort();
+	pthread_detach(thread);
+}
+
+void call_rcu_sched(struct rcu_head *head, rcu_callback_t func) {
+	pthread_once(&rcu_once, rcu_start);
+	head->func = func;
+	pthread_mutex_lock(&rcu_lock);
+	head->next = rcu_queue;
+	rcu_queue = head;
+	pthread_cond_signal(&rcu_kick);
+	pthread_mutex_unlock(&rcu_lock);
+}
+
+void rcu_barrier_sched(void) {
+	pthread_mutex_lock(&rcu_lock);
+	while (rcu_queue || rcu_busy)
+		pthread_cond_wait(&rcu_idle, &rcu_lock);
+	pthread_mutex_unlock(&rcu_lock);
+}
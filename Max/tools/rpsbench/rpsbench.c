@@ -0,0 +1,480 @@
+/*
+ * rpsbench: reader/writer lock microbenchmark for the RPS lock.
+ *
+ * Sweeps 1..N cores, pins one thread per core, and runs reader and writer
+ * threads against one of:
+ *   rps      Max/rps.c, built against the kernel shim in include/kshim.h
+ *   pthread  pthread_rwlock_t
+ *   percpu   a plain per-CPU rwlock: readers take their own spinlock,
+ *            writers take all of them
+ * With -C the lock is split into independent cells that threads pick by
+ * index, the way FILE_CELL partitions its locks; -C 1 is a global lock.
+ *
+ * For each point it prints throughput and acquire latency percentiles,
+ * and with -H the full latency histograms.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../../rps.h"
+
+#define NR_BUCKETS    256
+
+enum lock_type {
+	LOCK_RPS,
+	LOCK_PTHREAD,
+	LOCK_PERCPU,
+	NR_LOCK_TYPES,
+};
+
+static const char *lock_names[NR_LOCK_TYPES] = {"rps", "pthread", "percpu"};
+
+struct percpu_slot {
+	pthread_spinlock_t lock;
+} __attribute__((aligned(SMP_CACHE_BYTES)));
+
+struct cell {
+	struct rps *rps;
+	pthread_rwlock_t rwlock;
+	struct percpu_slot *slots;
+	int nr_slots;
+};
+
+struct hist {
+	uint64_t ops;
+	uint64_t bucket[NR_BUCKETS];
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int cpu;
+	bool writer;
+	struct cell *cell;
+	struct hist hist;
+} __attribute__((aligned(SMP_CACHE_BYTES)));
+
+/* options */
+static int max_cores;
+static int nr_writers = 1;
+static int nr_cells = 1;
+static int duration = 2;
+static int cs_loops = 50;
+static int think_loops = 50;
+static int write_interval_us = 100;
+static bool print_hist;
+static bool lock_enabled[NR_LOCK_TYPES] = {true, true, true};
+
+/* machine */
+static int nr_cpus;
+static int cpu_list[NR_CPUS];
+static int cpu_node[NR_CPUS];
+static int nr_nodes = 1;
+
+/* run state */
+static enum lock_type cur_lock;
+static volatile int start_flag;
+static volatile int stop_flag;
+
+static inline uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void spin_loops(int n) {
+	volatile int i;
+
+	for (i = 0; i < n; i++)
+		;
+}
+
+/* log2 buckets with four linear sub-buckets each */
+static int lat_bucket(uint64_t ns) {
+	int msb, b;
+
+	if (ns < 4)
+		return ns;
+	msb = 63 - __builtin_clzll(ns);
+	b = (msb - 1) * 4 + ((ns >> (msb - 2)) & 3);
+	return b < NR_BUCKETS ? b : NR_BUCKETS - 1;
+}
+
+static uint64_t bucket_floor(int b) {
+	if (b < 4)
+		return b;
+	return (uint64_t) (4 + b % 4) << (b / 4 - 1);
+}
+
+static uint64_t hist_percentile(struct hist *h, double pct) {
+	uint64_t want, seen = 0;
+	int b;
+
+	if (!h->ops)
+		return 0;
+	want = (uint64_t) (h->ops * pct / 100.0);
+	for (b = 0; b < NR_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen > want)
+			return bucket_floor(b);
+	}
+	return bucket_floor(NR_BUCKETS - 1);
+}
+
+static void hist_add(struct hist *dst, struct hist *src) {
+	int b;
+
+	dst->ops += src->ops;
+	for (b = 0; b < NR_BUCKETS; b++)
+		dst->bucket[b] += src->bucket[b];
+}
+
+static void hist_print(const char *what, struct hist *h) {
+	int b;
+
+	printf("#   %s acquire latency histogram (ns floor: count)\n", what);
+	for (b = 0; b < NR_BUCKETS; b++)
+		if (h->bucket[b])
+			printf("#     %10llu: %llu\n",
+				   (unsigned long long) bucket_floor(b),
+				   (unsigned long long) h->bucket[b]);
+}
+
+static void lock_read(struct worker *w) {
+	switch (cur_lock) {
+		case LOCK_RPS:
+			rps_down_read(w->cell->rps);
+			break;
+		case LOCK_PTHREAD:
+			pthread_rwlock_rdlock(&w->cell->rwlock);
+			break;
+		default:
+			pthread_spin_lock(&w->cell->slots[w->id].lock);
+			break;
+	}
+}
+
+static void unlock_read(struct worker *w) {
+	switch (cur_lock) {
+		case LOCK_RPS:
+			rps_up_read(w->cell->rps);
+			break;
+		case LOCK_PTHREAD:
+			pthread_rwlock_unlock(&w->cell->rwlock);
+			break;
+		default:
+			pthread_spin_unlock(&w->cell->slots[w->id].lock);
+			break;
+	}
+}
+
+static void lock_write(struct worker *w) {
+	int i;
+
+	switch (cur_lock) {
+		case LOCK_RPS:
+			rps_down_write(w->cell->rps);
+			break;
+		case LOCK_PTHREAD:
+			pthread_rwlock_wrlock(&w->cell->rwlock);
+			break;
+		default:
+			for (i = 0; i < w->cell->nr_slots; i++)
+				pthread_spin_lock(&w->cell->slots[i].lock);
+			break;
+	}
+}
+
+static void unlock_write(struct worker *w) {
+	int i;
+
+	switch (cur_lock) {
+		case LOCK_RPS:
+			rps_up_write(w->cell->rps);
+			break;
+		case LOCK_PTHREAD:
+			pthread_rwlock_unlock(&w->cell->rwlock);
+			break;
+		default:
+			for (i = w->cell->nr_slots - 1; i >= 0; i--)
+				pthread_spin_unlock(&w->cell->slots[i].lock);
+			break;
+	}
+}
+
+static void *worker_fn(void *arg) {
+	struct worker *w = arg;
+	cpu_set_t set;
+	uint64_t t0, t1;
+
+	CPU_ZERO(&set);
+	CPU_SET(w->cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	kshim_set_cpu(w->id, cpu_node[w->id % nr_cpus]);
+
+	while (!start_flag)
+		;
+
+	while (!stop_flag) {
+		t0 = now_ns();
+		if (w->writer)
+			lock_write(w);
+		else
+			lock_read(w);
+		t1 = now_ns();
+		spin_loops(cs_loops);
+		if (w->writer)
+			unlock_write(w);
+		else
+			unlock_read(w);
+
+		w->hist.ops++;
+		w->hist.bucket[lat_bucket(t1 - t0)]++;
+
+		if (w->writer && write_interval_us)
+			usleep(write_interval_us);
+		else
+			spin_loops(think_loops);
+	}
+	return NULL;
+}
+
+static int init_cells(struct cell *cells, int cores) {
+	int i, j;
+
+	for (i = 0; i < nr_cells; i++) {
+		cells[i].nr_slots = cores;
+		switch (cur_lock) {
+			case LOCK_RPS:
+				cells[i].rps = calloc(1, sizeof(struct rps));
+				if (!cells[i].rps || rps_init_rwsem(cells[i].rps))
+					return -1;
+				break;
+			case LOCK_PTHREAD:
+				pthread_rwlock_init(&cells[i].rwlock, NULL);
+				break;
+			default:
+				cells[i].slots = aligned_alloc(SMP_CACHE_BYTES,
+						sizeof(struct percpu_slot) * cores);
+				if (!cells[i].slots)
+					return -1;
+				for (j = 0; j < cores; j++)
+					pthread_spin_init(&cells[i].slots[j].lock,
+									  PTHREAD_PROCESS_PRIVATE);
+				break;
+		}
+	}
+	return 0;
+}
+
+static void destroy_cells(struct cell *cells) {
+	int i;
+
+	for (i = 0; i < nr_cells; i++) {
+		switch (cur_lock) {
+			case LOCK_RPS:
+				if (cells[i].rps)
+					rps_free_rwsem(cells[i].rps);
+				free(cells[i].rps);
+				break;
+			case LOCK_PTHREAD:
+				pthread_rwlock_destroy(&cells[i].rwlock);
+				break;
+			default:
+				free(cells[i].slots);
+				break;
+		}
+	}
+}
+
+static int run_point(int cores) {
+	struct cell *cells;
+	struct worker *workers;
+	struct hist rd, wr;
+	int writers = nr_writers < cores / 2 ? nr_writers : cores / 2;
+	int i;
+
+	cells = calloc(nr_cells, sizeof(struct cell));
+	workers = aligned_alloc(SMP_CACHE_BYTES, sizeof(struct worker) * cores);
+	if (!cells || !workers || init_cells(cells, cores)) {
+		fprintf(stderr, "rpsbench: out of memory\n");
+		return -1;
+	}
+	memset(workers, 0, sizeof(struct worker) * cores);
+
+	start_flag = 0;
+	stop_flag = 0;
+	for (i = 0; i < cores; i++) {
+		workers[i].id = i;
+		workers[i].cpu = cpu_list[i % nr_cpus];
+		workers[i].writer = i < writers;
+		workers[i].cell = &cells[i % nr_cells];
+		pthread_create(&workers[i].thread, NULL, worker_fn, &workers[i]);
+	}
+
+	start_flag = 1;
+	sleep(duration);
+	stop_flag = 1;
+
+	memset(&rd, 0, sizeof(rd));
+	memset(&wr, 0, sizeof(wr));
+	for (i = 0; i < cores; i++) {
+		pthread_join(workers[i].thread, NULL);
+		hist_add(workers[i].writer ? &wr : &rd, &workers[i].hist);
+	}
+
+	printf("%-8s %5d %7d %7d %10.3f %10.1f %7llu %7llu %8llu %8llu %8llu %9llu\n",
+		   lock_names[cur_lock], cores, cores - writers, writers,
+		   rd.ops / 1e6 / duration, (double) wr.ops / duration,
+		   (unsigned long long) hist_percentile(&rd, 50),
+		   (unsigned long long) hist_percentile(&rd, 99),
+		   (unsigned long long) hist_percentile(&rd, 99.9),
+		   (unsigned long long) hist_percentile(&wr, 50),
+		   (unsigned long long) hist_percentile(&wr, 99),
+		   (unsigned long long) hist_percentile(&wr, 99.9));
+	if (print_hist) {
+		hist_print("read", &rd);
+		if (writers)
+			hist_print("write", &wr);
+	}
+	fflush(stdout);
+
+	destroy_cells(cells);
+	free(workers);
+	free(cells);
+	return 0;
+}
+
+/* map each online CPU to its NUMA node through sysfs */
+static void probe_cpus(void) {
+	cpu_set_t set;
+	char path[64];
+	struct dirent *de;
+	DIR *dir;
+	int cpu, node;
+
+	sched_getaffinity(0, sizeof(set), &set);
+	for (cpu = 0; cpu < CPU_SETSIZE && nr_cpus < NR_CPUS; cpu++) {
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		node = 0;
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+		dir = opendir(path);
+		while (dir && (de = readdir(dir))) {
+			if (sscanf(de->d_name, "node%d", &node) == 1)
+				break;
+		}
+		if (dir)
+			closedir(dir);
+		if (node >= MAX_NUMNODES)
+			node = MAX_NUMNODES - 1;
+		if (node + 1 > nr_nodes)
+			nr_nodes = node + 1;
+		cpu_node[nr_cpus] = node;
+		cpu_list[nr_cpus++] = cpu;
+	}
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr,
+			"usage: %s [options]\n"
+			"  -n cores     sweep up to this many cores (default: all)\n"
+			"  -w writers   writer threads per point (default: 1)\n"
+			"  -C cells     independent lock instances (default: 1)\n"
+			"  -d seconds   duration of each point (default: 2)\n"
+			"  -s loops     critical section length (default: 50)\n"
+			"  -t loops     think time between read locks (default: 50)\n"
+			"  -i usecs     sleep between write locks (default: 100)\n"
+			"  -l locks     comma list of rps,pthread,percpu (default: all)\n"
+			"  -H           print latency histograms\n", prog);
+}
+
+static void parse_locks(char *arg) {
+	char *tok;
+	int i;
+
+	for (i = 0; i < NR_LOCK_TYPES; i++)
+		lock_enabled[i] = false;
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		for (i = 0; i < NR_LOCK_TYPES; i++)
+			if (!strcmp(tok, lock_names[i]))
+				lock_enabled[i] = true;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	int opt, cores, lock;
+
+	while ((opt = getopt(argc, argv, "n:w:C:d:s:t:i:l:Hh")) != -1) {
+		switch (opt) {
+			case 'n':
+				max_cores = atoi(optarg);
+				break;
+			case 'w':
+				nr_writers = atoi(optarg);
+				break;
+			case 'C':
+				nr_cells = atoi(optarg);
+				break;
+			case 'd':
+				duration = atoi(optarg);
+				break;
+			case 's':
+				cs_loops = atoi(optarg);
+				break;
+			case 't':
+				think_loops = atoi(optarg);
+				break;
+			case 'i':
+				write_interval_us = atoi(optarg);
+				break;
+			case 'l':
+				parse_locks(optarg);
+				break;
+			case 'H':
+				print_hist = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	probe_cpus();
+	if (max_cores <= 0 || max_cores > NR_CPUS)
+		max_cores = nr_cpus;
+	kshim_init(max_cores, nr_nodes);
+	if (nr_cells < 1)
+		nr_cells = 1;
+	if (duration < 1)
+		duration = 1;
+
+	printf("# %d cpus, %d nodes, %d cells, membarrier %s\n", nr_cpus, nr_nodes,
+		   nr_cells, kshim_use_fences ? "off" : "on");
+	printf("# %-6s %5s %7s %7s %10s %10s %7s %7s %8s %8s %8s %9s\n",
+		   "lock", "cores", "readers", "writers", "rd_Mops/s", "wr_ops/s",
+		   "rd_p50", "rd_p99", "rd_p999", "wr_p50", "wr_p99", "wr_p999");
+
+	for (lock = 0; lock < NR_LOCK_TYPES; lock++) {
+		if (!lock_enabled[lock])
+			continue;
+		cur_lock = lock;
+		for (cores = 1; cores <= max_cores; ) {
+			if (run_point(cores))
+				return 1;
+			if (cores == max_cores)
+				break;
+			cores = cores * 2 > max_cores ? max_cores : cores * 2;
+		}
+	}
+	return 0;
+}
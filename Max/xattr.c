@@ -337,7 +337,7 @@ static inline int write_all_xattrs(struct inode *inode, __u32 hsize,
 	inline_size = inline_xattr_size(inode);
 
 	if (hsize > inline_size && !F2FS_I(inode)->i_xattr_nid)
-		if (!alloc_nid(sbi, &new_nid))
+		if (!alloc_nid_for_inode(sbi, &new_nid, inode->i_ino))
 			return -ENOSPC;
 
 	/* write to inline xattr */